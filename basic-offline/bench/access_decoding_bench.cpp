@@ -0,0 +1,63 @@
+// Long chain build, so every width below fits
+#define MAX_HARDWARE_POSITIONS 4096
+#include "../src/database.cpp"
+
+#include <random>
+
+// Decoding one cardScanned() answer: the per-character loop AuthCardScanned used before
+// word-wide decoding, the word-wide text decoder and the bitmap decoder, at a single
+// board, a 512 position cabinet and the longest chain
+
+#define BENCH_ITERATIONS 200000
+
+void PerCharacterReadAccess(const string &text, size_t chain_positions, position_word *output) {
+  for (size_t i = 0; i < text.length() && i < chain_positions; i++) {
+    output->Set(i, text[i] == '1');
+  }
+}
+
+template <typename F>
+double NanosecondsPerCall(F decode) {
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ITERATIONS; i++) {
+    decode();
+  }
+  return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / BENCH_ITERATIONS;
+}
+
+int main() {
+  mt19937_64 rng(7);
+  printf("positions  text bytes  bitmap bytes  per char ns  text ns  bitmap ns\n");
+  for (size_t positions : { 8, 512, 4096 }) {
+    string text(positions, '0');
+    string bitmap = "\\x";
+    for (size_t i = 0; i < positions; i++) {
+      if (rng() & 1) text[i] = '1';
+    }
+    for (size_t i = 0; i < positions; i += 8) {
+      int byte = 0;
+      for (int b = 0; b < 8; b++) {
+        if (text[i + b] == '1') byte |= 1 << b;
+      }
+      bitmap += "0123456789abcdef"[byte >> 4];
+      bitmap += "0123456789abcdef"[byte & 0xf];
+    }
+
+    position_word output;
+    double per_character_ns = NanosecondsPerCall([&] {
+      output.Clear();
+      PerCharacterReadAccess(text, positions, &output);
+      asm volatile("" : : "r"(&output) : "memory");
+    });
+    double text_ns = NanosecondsPerCall([&] {
+      ReadAccessText(text, positions, &output);
+      asm volatile("" : : "r"(&output) : "memory");
+    });
+    double bitmap_ns = NanosecondsPerCall([&] {
+      ReadAccessBitmap(bitmap, positions, &output);
+      asm volatile("" : : "r"(&output) : "memory");
+    });
+    printf("%9zu  %10zu  %12zu  %11.1f  %7.1f  %9.1f\n", positions, text.size(), bitmap.size(), per_character_ns, text_ns, bitmap_ns);
+  }
+  return 0;
+}
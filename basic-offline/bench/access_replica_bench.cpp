@@ -0,0 +1,97 @@
+#include "../src/database.cpp"
+#include "../src/gpio_actor.cpp"
+#include "../src/auth_cache.cpp"
+
+#include <algorithm>
+#include <stdlib.h>
+
+// The access replica at 1k, 100k and 1M cards: building the table file from a snapshot,
+// mapping it at startup the way OpenAccessReplica does, and LookupAccessReplica for
+// cards it holds and codes it does not. Lookups run on a table that was just written,
+// so its pages are already cached. Each lookup is timed on its own, clock overhead
+// included
+
+#define BENCH_LOOKUPS 200000
+// Distinct access sets the cards share, real cabinets have few
+#define BENCH_ACCESS_SETS 64
+
+string CardCode(size_t card) {
+  return "CARD" + to_string(card * 2654435761ULL % 1000000007ULL);
+}
+
+typedef struct _lookup_timing {
+  double p50_ns;
+  double p99_ns;
+} lookup_timing;
+
+lookup_timing TimeLookups(const vector<string> &codes, bool expect_hit) {
+  vector<double> samples;
+  samples.reserve(codes.size());
+  position_word access;
+  for (auto &code : codes) {
+    auto start = chrono::steady_clock::now();
+    bool hit = LookupAccessReplica(code, &access);
+    samples.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+    if (hit != expect_hit) {
+      cout << "Lookup of " << code << (expect_hit ? " missed" : " hit") << endl;
+      exit(1);
+    }
+  }
+  sort(samples.begin(), samples.end());
+  return { samples[samples.size() / 2], samples[samples.size() * 99 / 100] };
+}
+
+int main() {
+  num_hardware_positions = min((size_t)MAX_HARDWARE_POSITIONS, (size_t)512);
+  char path[] = "/tmp/access_replica_bench.XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  mt19937_64 rng(7);
+
+  vector<position_word> access_sets(BENCH_ACCESS_SETS);
+  for (auto &access : access_sets) {
+    for (size_t p = 0; p < num_hardware_positions; p++) {
+      if (rng() % 8 == 0) access.Set(p);
+    }
+    access.Set(0);
+  }
+
+  printf("   cards   file KB  build ms  open us  hit p50 ns  hit p99 ns  miss p50 ns  miss p99 ns\n");
+  for (size_t cards : { 1000, 100000, 1000000 }) {
+    auth_hash_key hash_key = RandomAuthHashKey();
+    access_replica_hash_key = hash_key;
+    replica_builder builder;
+    for (size_t card = 0; card < cards; card++) {
+      builder.Add(AccessReplicaKey(CardCode(card)), &access_sets[card % BENCH_ACCESS_SETS]);
+    }
+    auto started = chrono::steady_clock::now();
+    if (builder.Build(path, hash_key, ReplicaClockNow())) {
+      cout << "Could not build the replica at " << path << endl;
+      return 1;
+    }
+    double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    struct stat info;
+    stat(path, &info);
+
+    started = chrono::steady_clock::now();
+    OpenAccessReplica("", "BENCH", path);
+    double open_us = chrono::duration<double, micro>(chrono::steady_clock::now() - started).count();
+    access_replica_synced = true;
+
+    vector<string> held, unknown;
+    for (int i = 0; i < BENCH_LOOKUPS; i++) {
+      held.push_back(CardCode(rng() % cards));
+      unknown.push_back("NOCARD" + to_string(i));
+    }
+    lookup_timing hits = TimeLookups(held, true);
+    lookup_timing misses = TimeLookups(unknown, false);
+    printf("%8zu  %8.0f  %8.1f  %7.1f  %10.1f  %10.1f  %11.1f  %11.1f\n", cards, info.st_size / 1e3, build_ms, open_us,
+           hits.p50_ns, hits.p99_ns, misses.p50_ns, misses.p99_ns);
+
+    access_replica_synced = false;
+    CloseAccessReplica();
+  }
+
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include "../test/fake_postgres.cpp"
+#include "../src/database.cpp"
+
+#include <algorithm>
+#include <stdlib.h>
+
+// One cardScanned() round trip on a pooled connection to the in-process Postgres: SQL
+// built with tx.quote on every call, the way AuthCardScanned worked before prepared
+// statements, against the statement each connection prepares once. The fake server
+// neither parses nor plans, so this is the controller's share of a scan and the
+// loopback round trip, not the planning a real server saves
+
+#define BENCH_SCANS 20000
+
+void LiteralCardScanned(connection *conn, const char *auth_code, int length, position_word *output) {
+  char buffer[513] = {0};
+  memcpy(buffer, auth_code, length);
+  work tx{*conn};
+  string access_string = tx.query_value<string>("select \"cardScanned\"(" + tx.quote(getenv("CONTROLLER_SERIAL_NUMBER")) + "," + tx.quote(buffer) + ")");
+  tx.commit();
+  ReadAccessText(access_string, num_hardware_positions, output);
+}
+
+typedef struct _scan_timing {
+  double p50_us;
+  double p99_us;
+  // The calling thread's own CPU, what the controller spends apart from the server
+  double cpu_us;
+} scan_timing;
+
+double ThreadCpuMicroseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+// Round trip percentiles and mean CPU of scan over BENCH_SCANS calls
+template <typename F>
+scan_timing TimeScans(F scan) {
+  vector<double> samples;
+  samples.reserve(BENCH_SCANS);
+  double cpu_start = ThreadCpuMicroseconds();
+  for (int i = 0; i < BENCH_SCANS; i++) {
+    auto start = chrono::steady_clock::now();
+    scan();
+    samples.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+  }
+  double cpu = (ThreadCpuMicroseconds() - cpu_start) / BENCH_SCANS;
+  sort(samples.begin(), samples.end());
+  return { samples[samples.size() / 2], samples[samples.size() * 99 / 100], cpu };
+}
+
+int main() {
+  fake_postgres server([](const fake_statement &statement) {
+    fake_reply reply;
+    reply.rows = { { statement.query.find("cardScanned") != string::npos ? "1010" : "1" } };
+    return reply;
+  });
+  setenv("PGPORT", to_string(server.Port()).c_str(), 1);
+  setenv("DATABASE_HOST", "127.0.0.1", 1);
+  setenv("DATABASE_NAME", "simsafe", 1);
+  setenv("DATABASE_USERNAME", "bench", 1);
+  setenv("DATABASE_PASSWORD", "bench", 1);
+  setenv("DATABASE_POOL_SIZE", "1", 1);
+  setenv("CONTROLLER_SERIAL_NUMBER", "BENCH", 1);
+  num_hardware_positions = 4;
+
+  InitializeConnectionPools();
+  db_watchdog.Start();
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  for (auto &connector : StartStartupConnectors(shutdown_fd)) {
+    connector.join();
+  }
+  db_lease lease = FetchConnection();
+  if (!lease) {
+    cout << "No connection to the fake server" << endl;
+    return 1;
+  }
+  connection *conn = lease->conn.get();
+  const char *code = "0123456789ABCDEF";
+  position_word access;
+
+  scan_timing literal = TimeScans([&] {
+    LiteralCardScanned(conn, code, strlen(code), &access);
+    server.ClearStatements();
+  });
+  scan_timing prepared = TimeScans([&] {
+    AuthCardScanned(conn, code, strlen(code), &access, chrono::steady_clock::now() + chrono::seconds(1));
+    server.ClearStatements();
+  });
+  printf("per scan     p50 us  p99 us  cpu us\n");
+  printf("literal SQL  %6.1f  %6.1f  %6.1f\n", literal.p50_us, literal.p99_us, literal.cpu_us);
+  printf("prepared     %6.1f  %6.1f  %6.1f\n", prepared.p50_us, prepared.p99_us, prepared.cpu_us);
+
+  lease = db_lease();
+  db_watchdog.Stop();
+  CloseConnectionPool();
+  close(shutdown_fd);
+  return 0;
+}
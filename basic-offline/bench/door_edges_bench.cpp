@@ -0,0 +1,75 @@
+// Long chain build, so every width below fits
+#define MAX_HARDWARE_POSITIONS 4096
+#include "../src/database.cpp"
+#include "../src/gpio_actor.cpp"
+
+#include <random>
+
+// Finding the doors that changed between two sensor samples: the per-position
+// vector<bool> comparison the GPIO thread used before packed samples, and
+// DetectDoorEdges on position_words, at a single board, a 256 position cabinet and
+// the longest chain, with no door changed and with three. A position_word always spans
+// MAX_HARDWARE_POSITIONS, so the packed time is the long chain build's at every width
+
+#define BENCH_ITERATIONS 200000
+#define BENCH_CHANGED 3
+
+size_t PerPositionDoorEdges(const vector<bool> *current, const vector<bool> *previous, size_t positions, chrono::steady_clock::time_point sampled_at) {
+  size_t edges = 0;
+  for (size_t i = 0; i < positions; i++) {
+    if (current->at(i) == previous->at(i)) continue;
+    door_edge edge = { .position = (HARDWARE_POSITIONS_TYPE)i, .opened = current->at(i) == DOOR_SENSOR_OPEN, .sampled_at = sampled_at };
+    asm volatile("" : : "r"(&edge) : "memory");
+    edges++;
+  }
+  return edges;
+}
+
+template <typename F>
+double NanosecondsPerCall(F detect) {
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ITERATIONS; i++) {
+    detect();
+  }
+  return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / BENCH_ITERATIONS;
+}
+
+int main() {
+  mt19937_64 rng(7);
+  auto sampled_at = chrono::steady_clock::now();
+  printf("positions  changed  per position ns  packed ns\n");
+  for (size_t positions : { 8, 256, 4096 }) {
+    for (size_t changed : { 0, BENCH_CHANGED }) {
+      vector<bool> previous(positions), current(positions);
+      position_word previous_word, current_word;
+      for (size_t i = 0; i < positions; i++) {
+        previous[i] = current[i] = rng() & 1;
+        previous_word.Set(i, previous[i]);
+        current_word.Set(i, current[i]);
+      }
+      for (size_t c = 0; c < changed; c++) {
+        size_t position = (c + 1) * positions / (changed + 1);
+        current[position] = !current[position];
+        current_word.Set(position, current[position]);
+      }
+
+      size_t edges = 0;
+      double per_position_ns = NanosecondsPerCall([&] {
+        edges = PerPositionDoorEdges(&current, &previous, positions, sampled_at);
+        asm volatile("" : : "r"(&edges) : "memory");
+      });
+      double packed_ns = NanosecondsPerCall([&] {
+        edges = DetectDoorEdges(&current_word, &previous_word, sampled_at, [](door_edge edge) {
+          asm volatile("" : : "r"(&edge) : "memory");
+        });
+        asm volatile("" : : "r"(&edges) : "memory");
+      });
+      if (edges != changed) {
+        printf("DetectDoorEdges found %zu edges, expected %zu\n", edges, changed);
+        return 1;
+      }
+      printf("%9zu  %7zu  %15.1f  %9.1f\n", positions, changed, per_position_ns, packed_ns);
+    }
+  }
+  return 0;
+}
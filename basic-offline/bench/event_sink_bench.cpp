@@ -0,0 +1,86 @@
+#include "../test/fake_postgres.cpp"
+#include "../src/database.cpp"
+#include "../src/gpio_actor.cpp"
+
+#include <stdlib.h>
+
+// Position events written to the in-process Postgres over loopback: one synchronous
+// call per event on its own connection, the way events were written before the sink,
+// against the pipelined sink draining a burst already in its journal
+
+#define BENCH_JOURNAL_CAPACITY 65536
+
+string journal_path;
+string sink_connection_string;
+
+// Events per second, one round trip each
+double OneByOne(int count) {
+  PGconn *conn = PQconnectdb(sink_connection_string.c_str());
+  PGresult *prepared = PQprepare(conn, "opened", "call \"eventInsertPositionOpened\"($1, $2)", 2, NULL);
+  PQclear(prepared);
+
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    string position = to_string(i % 64 + 1);
+    const char *values[2] = { "BENCH", position.c_str() };
+    PGresult *result = PQexecPrepared(conn, "opened", 2, values, NULL, NULL, 0);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+      cout << "Call failed: " << PQerrorMessage(conn) << endl;
+    }
+    PQclear(result);
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  PQfinish(conn);
+  return count / seconds;
+}
+
+// Events per second from the sink starting on a full burst to the last one acked
+double Pipelined(int count) {
+  if (OpenEventSink(sink_connection_string, "BENCH", journal_path.c_str(), BENCH_JOURNAL_CAPACITY)) {
+    cout << "Could not open the journal at " << journal_path << endl;
+    exit(1);
+  }
+  unsigned long acked = events_acked;
+  for (int i = 0; i < count; i++) {
+    QueuePositionEvent(i % 2 == 0 ? POSITION_EVENT_OPENED : POSITION_EVENT_CLOSED, i / 2 % 64 + 1, chrono::steady_clock::now());
+  }
+
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  auto start = chrono::steady_clock::now();
+  pthread_t thread;
+  pthread_create(&thread, NULL, EventSinkThreadTask, &shutdown_fd);
+  while (events_acked < acked + count) {
+    this_thread::sleep_for(chrono::microseconds(100));
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  eventfd_write(shutdown_fd, 1);
+  pthread_join(thread, NULL);
+  close(shutdown_fd);
+  CloseEventSink();
+  return count / seconds;
+}
+
+int main() {
+  fake_postgres server([](const fake_statement &) {
+    return fake_reply{ .columns = 0 };
+  });
+  sink_connection_string = "host=127.0.0.1 port=" + to_string(server.Port()) + " dbname=simsafe user=bench password=bench";
+  char path[] = "/tmp/event_sink_bench.XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  unlink(path);
+  journal_path = path;
+
+  printf("events  one by one/s  pipelined/s\n");
+  for (int count : { 64, 1024, 16384 }) {
+    double one_by_one = OneByOne(count);
+    server.ClearStatements();
+    double pipelined = Pipelined(count);
+    server.ClearStatements();
+    printf("%6d  %12.0f  %11.0f\n", count, one_by_one, pipelined);
+  }
+
+  unlink(journal_path.c_str());
+  return 0;
+}
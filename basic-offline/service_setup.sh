@@ -12,6 +12,8 @@ CWD=$(pwd)
 SERVICE_NAME="simsafe_firmware"
 EXECUTABLE_PATH="${CWD}/main.out"
 DESCRIPTION="SimSafe firmware for standalone lockers"
+# Holds the event journal, EVENT_JOURNAL_PATH defaults to a file in it
+STATE_DIRECTORY="/var/lib/simsafe"
 
 if [ ! -f "${EXECUTABLE_PATH}" ]; then
   echo "Error: Executable not found at ${EXECUTABLE_PATH}"
@@ -27,6 +29,9 @@ if systemctl list-unit-files | grep -q "^${SERVICE_NAME}.service"; then
   echo "Existing service removed."
 fi
 
+mkdir -p ${STATE_DIRECTORY}
+chmod 700 ${STATE_DIRECTORY}
+
 cat > /etc/systemd/system/${SERVICE_NAME}.service << EOF
 [Unit]
 Description=${DESCRIPTION}
@@ -0,0 +1,797 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <shared_mutex>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libpq-fe.h>
+
+using namespace std;
+
+// Local copy of every card's access on this controller, so a scan can unlock without
+// the network. The cards are loaded from the server into a perfect hash table that
+// lives in a memory mapped file. The table is usable from the moment the controller
+// starts, before the database has been reached. A lookup is one bucket read and one
+// slot read, and never more. Changes pushed with NOTIFY are held next to the table as
+// deltas, and the table is rebuilt once they pile up.
+//
+// The server side this expects:
+//   "cabinetAccessRules"(serialno) returning (code text, access text), one row per
+//     card with access, access in the same '0'/'1' form cardScanned() returns
+//   NOTIFY on channel access_rules_<serialno> with payload "<access>:<code>" when a
+//     card changes, an empty access when it loses all access, or "reload" to have the
+//     whole snapshot read again
+//
+// The replica only ever grants. A card it does not hold goes to the database as before.
+// It only grants while its sync connection is up, or for access_replica_max_age after it
+// was last known to match the server, so a table left by a run that lost the server a
+// long time ago does not go on granting revoked cards. While in sync the file is rewritten
+// every half of that, so a restart finds a table recent enough to use.
+// Codes are never stored, each card is filed under a keyed SipHash of its code and also
+// holds a verifier from the same hash, so a code is only granted a card's access when
+// all 128 bits match
+
+#define REPLICA_MAGIC 0x3141504552434341ULL
+#define REPLICA_VERSION 2
+// Average keys per bucket and percentage of slots in use, trades build time for size
+#define REPLICA_BUCKET_SIZE 4
+#define REPLICA_LOAD_FACTOR 90
+// Gives up on a bucket after this many displacements, only reachable with duplicate keys
+#define REPLICA_MAX_DISPLACEMENT (1 << 24)
+// Deltas held before the table is rebuilt, or one sixteenth of the table if that is more
+#define REPLICA_MAX_DELTAS 4096
+#define ACCESS_REPLICA_MAX_AGE 86400000
+// Wait before trying again to rewrite a table that could not be written
+#define REPLICA_REFRESH_RETRY 60000
+
+// SipHash key
+typedef struct _auth_hash_key {
+  uint64_t k0;
+  uint64_t k1;
+} auth_hash_key;
+
+// Both halves of a code's 128 bit SipHash. key picks the entry and verifier has to match
+// too before the entry's access is used
+typedef struct _auth_code_hash {
+  uint64_t key;
+  uint64_t verifier;
+} auth_code_hash;
+
+typedef struct _replica_header {
+  uint64_t magic;
+  uint32_t version;
+  // Words per access set, a file built for another MAX_HARDWARE_POSITIONS is not used
+  uint32_t word_count;
+  auth_hash_key hash_key;
+  uint32_t entry_count;
+  uint32_t bucket_count;
+  uint32_t slot_count;
+  uint32_t access_count;
+  // Nanoseconds since the epoch the cards in the file were last known to match the server
+  int64_t snapshot_at;
+  uint32_t checksum;
+  uint32_t padding;
+} replica_header;
+
+// An empty slot has key 0, keys always have their low bit set
+typedef struct _replica_slot {
+  uint64_t key;
+  uint64_t verifier;
+  // Index into the access sets, cards with the same access share one
+  uint32_t access;
+  uint32_t padding;
+} replica_slot;
+
+static_assert(sizeof(replica_header) % 8 == 0 && sizeof(replica_slot) == 24, "Replica file layout changed");
+
+auth_hash_key RandomAuthHashKey() {
+  random_device random;
+  return {
+    .k0 = random() | (uint64_t)random() << 32,
+    .k1 = random() | (uint64_t)random() << 32
+  };
+}
+
+#define SIPHASH_ROTATE(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPHASH_ROUND(v0, v1, v2, v3) \
+  v0 += v1; v1 = SIPHASH_ROTATE(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTATE(v0, 32); \
+  v2 += v3; v3 = SIPHASH_ROTATE(v3, 16); v3 ^= v2; \
+  v0 += v3; v3 = SIPHASH_ROTATE(v3, 21); v3 ^= v0; \
+  v2 += v1; v1 = SIPHASH_ROTATE(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTATE(v2, 32)
+
+// SipHash-2-4 with 128 bit output. Without the key nobody can pick a code that lands on
+// another card's entry, which the old unkeyed mixing allowed
+auth_code_hash HashAuthCode(string_view auth_code, const auth_hash_key &hash_key) {
+  uint64_t v0 = 0x736f6d6570736575ULL ^ hash_key.k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ hash_key.k1 ^ 0xee;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ hash_key.k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ hash_key.k1;
+
+  const uint8_t *data = (const uint8_t*)auth_code.data();
+  size_t length = auth_code.size(), end = length & ~(size_t)7;
+  uint64_t m;
+  for (size_t i = 0; i < end; i += 8) {
+    m = 0;
+    for (size_t b = 0; b < 8; b++) m |= (uint64_t)data[i + b] << (8 * b);
+    v3 ^= m;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  m = (uint64_t)length << 56;
+  for (size_t b = 0; end + b < length; b++) m |= (uint64_t)data[end + b] << (8 * b);
+  v3 ^= m;
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  v0 ^= m;
+
+  auth_code_hash hash;
+  v2 ^= 0xee;
+  for (int i = 0; i < 4; i++) {
+    SIPHASH_ROUND(v0, v1, v2, v3);
+  }
+  hash.key = v0 ^ v1 ^ v2 ^ v3;
+  v1 ^= 0xdd;
+  for (int i = 0; i < 4; i++) {
+    SIPHASH_ROUND(v0, v1, v2, v3);
+  }
+  hash.verifier = v0 ^ v1 ^ v2 ^ v3;
+  return hash;
+}
+
+// splitmix64 finaliser
+uint64_t MixReplicaKey(uint64_t key) {
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+  return key ^ (key >> 31);
+}
+
+uint32_t ReplicaRange(uint64_t hash, uint32_t range) {
+  return (uint32_t)(((unsigned __int128)hash * range) >> 64);
+}
+
+uint32_t ReplicaBucket(uint64_t key, uint32_t bucket_count) {
+  return ReplicaRange(MixReplicaKey(key), bucket_count);
+}
+
+uint32_t ReplicaSlot(uint64_t key, uint32_t displacement, uint32_t slot_count) {
+  return ReplicaRange(MixReplicaKey(key + (displacement + 1ULL) * 0x9e3779b97f4a7c15ULL), slot_count);
+}
+
+struct position_word_hash {
+  size_t operator()(const position_word &word) const {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t w = 0; w < position_word::WORD_COUNT; w++) {
+      hash = (hash ^ word.Word(w)) * 0x100000001b3ULL;
+    }
+    return hash;
+  }
+};
+
+// Collects cards for a new table, access sets are stored once however many cards share them
+class replica_builder {
+ public:
+  void Add(const auth_code_hash &hash, const position_word *access) {
+    auto found = access_index.try_emplace(*access, (uint32_t)accesses.size());
+    if (found.second) {
+      accesses.push_back(*access);
+    }
+    entries.push_back({ .key = hash.key, .verifier = hash.verifier, .access = found.first->second, .padding = 0 });
+  }
+
+  size_t Size() const {
+    return entries.size();
+  }
+
+  // Writes the table to path through a temporary file, so the file at path is always
+  // either the old table or the new one. A key that was added twice is left out, it is
+  // either a duplicate row or two codes sharing a hash and the database decides those
+  int Build(const char *path, const auth_hash_key &hash_key, int64_t snapshot_at) {
+    sort(entries.begin(), entries.end(), [](const replica_slot &a, const replica_slot &b) { return a.key < b.key; });
+    size_t kept = 0;
+    for (size_t i = 0; i < entries.size();) {
+      size_t j = i + 1;
+      while (j < entries.size() && entries[j].key == entries[i].key) j++;
+      if (j == i + 1) entries[kept++] = entries[i];
+      i = j;
+    }
+    entries.resize(kept);
+
+    replica_header header = {
+      .magic = REPLICA_MAGIC,
+      .version = REPLICA_VERSION,
+      .word_count = position_word::WORD_COUNT,
+      .hash_key = hash_key,
+      .entry_count = (uint32_t)entries.size(),
+      .bucket_count = (uint32_t)max((size_t)1, entries.size() / REPLICA_BUCKET_SIZE),
+      .slot_count = (uint32_t)(entries.size() * 100 / REPLICA_LOAD_FACTOR + 1),
+      .access_count = (uint32_t)accesses.size(),
+      .snapshot_at = snapshot_at,
+      .checksum = 0,
+      .padding = 0
+    };
+    header.checksum = Crc32c(&header, offsetof(replica_header, checksum));
+
+    // Buckets are placed biggest first, while there is still plenty of room
+    vector<uint32_t> bucket_of(entries.size()), bucket_start(header.bucket_count + 1, 0), order(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+      bucket_of[i] = ReplicaBucket(entries[i].key, header.bucket_count);
+      bucket_start[bucket_of[i] + 1]++;
+    }
+    for (uint32_t b = 0; b < header.bucket_count; b++) {
+      bucket_start[b + 1] += bucket_start[b];
+    }
+    vector<uint32_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+    for (size_t i = 0; i < entries.size(); i++) {
+      order[fill[bucket_of[i]]++] = i;
+    }
+    vector<uint32_t> buckets(header.bucket_count);
+    for (uint32_t b = 0; b < header.bucket_count; b++) {
+      buckets[b] = b;
+    }
+    stable_sort(buckets.begin(), buckets.end(), [&](uint32_t a, uint32_t b) {
+      return bucket_start[a + 1] - bucket_start[a] > bucket_start[b + 1] - bucket_start[b];
+    });
+
+    vector<uint32_t> displacements(header.bucket_count, 0);
+    vector<uint32_t> slot_entry(header.slot_count, UINT32_MAX);
+    vector<uint32_t> placed;
+    for (uint32_t bucket : buckets) {
+      uint32_t first = bucket_start[bucket], last = bucket_start[bucket + 1];
+      if (first == last) break;
+
+      uint32_t displacement = 0;
+      for (; displacement < REPLICA_MAX_DISPLACEMENT; displacement++) {
+        placed.clear();
+        for (uint32_t i = first; i < last; i++) {
+          uint32_t slot = ReplicaSlot(entries[order[i]].key, displacement, header.slot_count);
+          if (slot_entry[slot] != UINT32_MAX || find(placed.begin(), placed.end(), slot) != placed.end()) break;
+          placed.push_back(slot);
+        }
+        if (placed.size() == last - first) break;
+      }
+      if (displacement == REPLICA_MAX_DISPLACEMENT) {
+        cout << "Could not place access replica bucket " << bucket << endl;
+        return -1;
+      }
+
+      displacements[bucket] = displacement;
+      for (uint32_t i = first; i < last; i++) {
+        slot_entry[placed[i - first]] = order[i];
+      }
+    }
+
+    string temporary = string(path) + ".tmp";
+    int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      return -1;
+    }
+    size_t size = ReplicaFileSize(&header);
+    char *mapping = ftruncate(fd, size) < 0 ? (char*)MAP_FAILED : (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      unlink(temporary.c_str());
+      return -1;
+    }
+
+    memcpy(mapping, &header, sizeof(header));
+    memcpy(mapping + DisplacementOffset(), displacements.data(), displacements.size() * sizeof(uint32_t));
+    replica_slot *slots = (replica_slot*)(mapping + SlotOffset(&header));
+    for (uint32_t s = 0; s < header.slot_count; s++) {
+      slots[s] = slot_entry[s] == UINT32_MAX ? replica_slot{} : entries[slot_entry[s]];
+    }
+    uint64_t *words = (uint64_t*)(mapping + AccessOffset(&header));
+    for (size_t a = 0; a < accesses.size(); a++) {
+      for (size_t w = 0; w < position_word::WORD_COUNT; w++) {
+        words[a * position_word::WORD_COUNT + w] = accesses[a].Word(w);
+      }
+    }
+
+    bool ok = msync(mapping, size, MS_SYNC) == 0;
+    munmap(mapping, size);
+    ok = fsync(fd) == 0 && ok;
+    close(fd);
+    if (!ok || rename(temporary.c_str(), path) < 0) {
+      unlink(temporary.c_str());
+      return -1;
+    }
+    return 0;
+  }
+
+  static size_t DisplacementOffset() {
+    return sizeof(replica_header);
+  }
+
+  static size_t SlotOffset(const replica_header *header) {
+    return (DisplacementOffset() + (size_t)header->bucket_count * sizeof(uint32_t) + 15) & ~(size_t)15;
+  }
+
+  static size_t AccessOffset(const replica_header *header) {
+    return SlotOffset(header) + (size_t)header->slot_count * sizeof(replica_slot);
+  }
+
+  static size_t ReplicaFileSize(const replica_header *header) {
+    return AccessOffset(header) + (size_t)header->access_count * header->word_count * sizeof(uint64_t);
+  }
+
+ private:
+  vector<replica_slot> entries;
+  vector<position_word> accesses;
+  unordered_map<position_word, uint32_t, position_word_hash> access_index;
+};
+
+// A built table mapped read only
+class replica_table {
+ public:
+  ~replica_table() {
+    if (mapping != NULL) {
+      munmap(mapping, size);
+    }
+  }
+
+  int Open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -1;
+    }
+    struct stat info;
+    replica_header header;
+    bool valid = fstat(fd, &info) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 header.magic == REPLICA_MAGIC && header.version == REPLICA_VERSION &&
+                 header.word_count == position_word::WORD_COUNT && header.bucket_count > 0 && header.slot_count > 0 &&
+                 header.checksum == Crc32c(&header, offsetof(replica_header, checksum)) &&
+                 (size_t)info.st_size == replica_builder::ReplicaFileSize(&header);
+    if (!valid) {
+      close(fd);
+      return -1;
+    }
+
+    size = info.st_size;
+    mapping = (char*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      mapping = NULL;
+      return -1;
+    }
+    this->header = (const replica_header*)mapping;
+    displacements = (const uint32_t*)(mapping + replica_builder::DisplacementOffset());
+    slots = (const replica_slot*)(mapping + replica_builder::SlotOffset(this->header));
+    words = (const uint64_t*)(mapping + replica_builder::AccessOffset(this->header));
+    return 0;
+  }
+
+  bool Lookup(const auth_code_hash &hash, position_word *access) const {
+    uint32_t displacement = displacements[ReplicaBucket(hash.key, header->bucket_count)];
+    const replica_slot *slot = &slots[ReplicaSlot(hash.key, displacement, header->slot_count)];
+    if (slot->key != hash.key || slot->verifier != hash.verifier || slot->access >= header->access_count) {
+      return false;
+    }
+    for (size_t w = 0; w < position_word::WORD_COUNT; w++) {
+      access->SetWord(w, words[(size_t)slot->access * position_word::WORD_COUNT + w]);
+    }
+    return true;
+  }
+
+  // Hands every card to builder, except those in skip
+  template <typename Skip>
+  void CopyInto(replica_builder *builder, Skip skip) const {
+    position_word access;
+    for (uint32_t s = 0; s < header->slot_count; s++) {
+      auth_code_hash hash = { .key = slots[s].key, .verifier = slots[s].verifier };
+      if (hash.key != 0 && !skip(hash.key) && Lookup(hash, &access)) {
+        builder->Add(hash, &access);
+      }
+    }
+  }
+
+  auth_hash_key HashKey() const {
+    return header->hash_key;
+  }
+
+  uint32_t Entries() const {
+    return header->entry_count;
+  }
+
+  chrono::system_clock::time_point SnapshotAt() const {
+    return chrono::system_clock::time_point(chrono::duration_cast<chrono::system_clock::duration>(chrono::nanoseconds(header->snapshot_at)));
+  }
+
+ private:
+  char *mapping = NULL;
+  size_t size = 0;
+  const replica_header *header = NULL;
+  const uint32_t *displacements = NULL;
+  const replica_slot *slots = NULL;
+  const uint64_t *words = NULL;
+};
+
+string access_replica_path;
+string access_replica_connection_string;
+string access_replica_serial_number;
+// Codes are hashed with the key of the table on disk, so they stay valid across restarts
+auth_hash_key access_replica_hash_key;
+// Lookups share it, the sync thread takes it alone to swap the table or add a delta
+shared_mutex access_replica_mutex;
+unique_ptr<replica_table> access_replica;
+
+typedef struct _replica_delta {
+  uint64_t verifier;
+  // Empty when the card is gone
+  position_word access;
+} replica_delta;
+
+// Changes since the table was built, by key
+unordered_map<uint64_t, replica_delta> access_replica_deltas;
+
+chrono::milliseconds access_replica_max_age(ACCESS_REPLICA_MAX_AGE);
+// The sync connection is up and every change it was told about is applied
+atomic<bool> access_replica_synced{false};
+// Nanoseconds since the epoch the replica was last known to match the server
+atomic<int64_t> access_replica_confirmed_at{0};
+
+atomic<unsigned long> access_replica_deltas_applied{0};
+atomic<unsigned long> access_replica_rebuilds{0};
+// Cards the replica held but did not grant because it was out of sync for too long
+atomic<unsigned long> access_replica_expired{0};
+
+bool IsAccessReplicaEnabled() {
+  return !access_replica_path.empty();
+}
+
+// Milliseconds, 0 only grants while the sync connection is up
+bool SetAccessReplicaMaxAge(const char *age) {
+  if (age == NULL) return false;
+  char *end;
+  long ms = strtol(age, &end, 10);
+  if (*age == '\0' || *end != '\0' || ms < 0) return false;
+  access_replica_max_age = chrono::milliseconds(ms);
+  return true;
+}
+
+int64_t ReplicaClockNow() {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// A snapshot dated in the future has no age that can be trusted, it is not used
+bool IsAccessReplicaCurrent() {
+  if (access_replica_synced) {
+    return true;
+  }
+  auto age = chrono::nanoseconds(ReplicaClockNow() - access_replica_confirmed_at);
+  return age.count() >= 0 && age <= access_replica_max_age;
+}
+
+auth_code_hash AccessReplicaKey(string_view auth_code) {
+  auth_code_hash hash = HashAuthCode(auth_code, access_replica_hash_key);
+  hash.key |= 1;
+  return hash;
+}
+
+// Maps the table left by the last run, so cards are served before the database is reached
+int OpenAccessReplica(const string &connection_string, const string &serial_number, const char *path) {
+  access_replica_connection_string = connection_string;
+  access_replica_serial_number = serial_number;
+  access_replica_path = path;
+
+  auto started = chrono::steady_clock::now();
+  auto table = make_unique<replica_table>();
+  if (table->Open(path)) {
+    access_replica_hash_key = RandomAuthHashKey();
+    cout << "No usable access replica at " << path << ", waiting for the database" << endl;
+    return 0;
+  }
+
+  access_replica_hash_key = table->HashKey();
+  access_replica_confirmed_at = chrono::duration_cast<chrono::nanoseconds>(table->SnapshotAt().time_since_epoch()).count();
+  auto age = chrono::duration_cast<chrono::minutes>(chrono::system_clock::now() - table->SnapshotAt());
+  cout << "Access replica mapped in " << chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count()
+       << "us, " << table->Entries() << " cards, " << age.count() << " minutes old";
+  if (!IsAccessReplicaCurrent()) {
+    cout << ", too old to grant until it syncs";
+  }
+  cout << endl;
+  access_replica = std::move(table);
+  return 0;
+}
+
+void CloseAccessReplica() {
+  unique_lock<shared_mutex> lock(access_replica_mutex);
+  access_replica.reset();
+  access_replica_deltas.clear();
+}
+
+// False when the replica does not grant this card anything
+bool LookupAccessReplica(string_view auth_code, position_word *access) {
+  shared_lock<shared_mutex> lock(access_replica_mutex);
+  if (access_replica == NULL) {
+    return false;
+  }
+  if (!IsAccessReplicaCurrent()) {
+    access_replica_expired++;
+    return false;
+  }
+
+  auth_code_hash hash = AccessReplicaKey(auth_code);
+  auto delta = access_replica_deltas.find(hash.key);
+  if (delta != access_replica_deltas.end()) {
+    // Another code on the same key changed, this one is left to the database
+    if (delta->second.verifier != hash.verifier) {
+      return false;
+    }
+    *access = delta->second.access;
+    return access->Any();
+  }
+  return access_replica->Lookup(hash, access);
+}
+
+// Reads '0'/'1' access the way AuthCardScanned does
+void ParseAccess(const char *text, size_t length, position_word *access) {
+  access->Clear();
+  for (size_t i = 0; i < length && i < position_word::CAPACITY; i++) {
+    access->Set(i, text[i] == '1');
+  }
+}
+
+// Builds the table, maps it and swaps it in, dropping the deltas it took in
+bool InstallAccessReplica(replica_builder *builder, int64_t snapshot_at) {
+  auto started = chrono::steady_clock::now();
+  size_t cards = builder->Size();
+  if (builder->Build(access_replica_path.c_str(), access_replica_hash_key, snapshot_at)) {
+    cout << "Failed to write the access replica to " << access_replica_path << endl;
+    return false;
+  }
+  auto table = make_unique<replica_table>();
+  if (table->Open(access_replica_path.c_str())) {
+    cout << "Failed to map the access replica at " << access_replica_path << endl;
+    return false;
+  }
+
+  unique_lock<shared_mutex> lock(access_replica_mutex);
+  access_replica = std::move(table);
+  access_replica_deltas.clear();
+  access_replica_confirmed_at = snapshot_at;
+  access_replica_rebuilds++;
+  cout << "Access replica built from " << cards << " cards in "
+       << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count() << "ms" << endl;
+  return true;
+}
+
+// Reads every card from the server a row at a time, the result is never held whole.
+// Gives up when the shutdown eventfd becomes readable while waiting on rows
+bool LoadAccessSnapshot(PGconn *conn, int shutdown_fd) {
+  auto started = chrono::steady_clock::now();
+  int64_t snapshot_at = ReplicaClockNow();
+  const char *values[1] = { access_replica_serial_number.c_str() };
+  if (!PQsendQueryParams(conn, "select code, access from \"cabinetAccessRules\"($1)", 1, NULL, values, NULL, NULL, 0) ||
+      !PQsetSingleRowMode(conn)) {
+    return false;
+  }
+
+  replica_builder builder;
+  position_word access;
+  bool ok = true;
+  PGresult *result;
+  struct pollfd fds[2];
+  fds[0].fd = shutdown_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = PQsocket(conn);
+  fds[1].events = POLLIN;
+  while (true) {
+    while (PQisBusy(conn)) {
+      if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+        return false;
+      }
+      if (fds[0].revents & POLLIN) {
+        cout << "Access snapshot read stopped for shutdown" << endl;
+        return false;
+      }
+      if ((fds[1].revents & (POLLIN | POLLERR | POLLHUP)) && !PQconsumeInput(conn)) {
+        return false;
+      }
+    }
+    if ((result = PQgetResult(conn)) == NULL) {
+      break;
+    }
+    if (PQresultStatus(result) == PGRES_SINGLE_TUPLE) {
+      ParseAccess(PQgetvalue(result, 0, 1), PQgetlength(result, 0, 1), &access);
+      if (access.Any()) {
+        builder.Add(AccessReplicaKey(string_view(PQgetvalue(result, 0, 0), PQgetlength(result, 0, 0))), &access);
+      }
+    } else if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+      cout << "Failed to read access rules: " << PQresultErrorMessage(result);
+      ok = false;
+    }
+    PQclear(result);
+  }
+  if (!ok) {
+    return false;
+  }
+
+  cout << "Read " << builder.Size() << " access rules in "
+       << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count() << "ms" << endl;
+  return InstallAccessReplica(&builder, snapshot_at);
+}
+
+// Only the sync thread uses it
+chrono::system_clock::time_point access_replica_refresh_failed_at;
+
+// When the table on disk is next due to be rewritten while in sync, so it is never past
+// access_replica_max_age when the controller restarts
+chrono::system_clock::time_point AccessReplicaRefreshAt() {
+  return max(access_replica->SnapshotAt() + access_replica_max_age / 2,
+             access_replica_refresh_failed_at + chrono::milliseconds(REPLICA_REFRESH_RETRY));
+}
+
+// Folds the deltas into a new table once there are enough of them to slow lookups down,
+// or once the table on disk is due to be rewritten
+void CompactAccessReplica() {
+  size_t limit;
+  {
+    shared_lock<shared_mutex> lock(access_replica_mutex);
+    if (access_replica == NULL) {
+      return;
+    }
+    limit = max((size_t)REPLICA_MAX_DELTAS, (size_t)access_replica->Entries() / 16);
+    bool refresh = access_replica_max_age.count() > 0 && chrono::system_clock::now() >= AccessReplicaRefreshAt();
+    if (access_replica_deltas.size() < limit && !refresh) {
+      return;
+    }
+  }
+
+  // Only this thread changes the table and the deltas, reading them unlocked is safe here
+  replica_builder builder;
+  access_replica->CopyInto(&builder, [](uint64_t key) { return access_replica_deltas.count(key) > 0; });
+  for (auto &delta : access_replica_deltas) {
+    if (delta.second.access.Any()) {
+      builder.Add({ .key = delta.first, .verifier = delta.second.verifier }, &delta.second.access);
+    }
+  }
+  if (!InstallAccessReplica(&builder, ReplicaClockNow())) {
+    access_replica_refresh_failed_at = chrono::system_clock::now();
+  }
+}
+
+// Applies every notification that has arrived. Returns false when the snapshot has
+// to be read again
+bool ApplyAccessNotifications(PGconn *conn) {
+  PGnotify *notify;
+  bool reload = false;
+  position_word access;
+  while ((notify = PQnotifies(conn)) != NULL) {
+    const char *separator = strchr(notify->extra, ':');
+    if (strcmp(notify->extra, "reload") == 0) {
+      reload = true;
+    } else if (separator == NULL) {
+      cout << "Ignoring malformed access rule notification" << endl;
+    } else {
+      ParseAccess(notify->extra, separator - notify->extra, &access);
+      auth_code_hash hash = AccessReplicaKey(separator + 1);
+      unique_lock<shared_mutex> lock(access_replica_mutex);
+      access_replica_deltas[hash.key] = { .verifier = hash.verifier, .access = access };
+      access_replica_deltas_applied++;
+    }
+    PQfreemem(notify);
+  }
+  return !reload;
+}
+
+// LISTEN goes first, so no change made while the snapshot is read is missed. Changes
+// that were already in the snapshot are applied a second time, which is harmless
+PGconn *ConnectAccessReplica(int shutdown_fd) {
+  PGconn *conn = PQconnectdb(access_replica_connection_string.c_str());
+  bool ok = PQstatus(conn) == CONNECTION_OK;
+
+  string channel = "access_rules_" + access_replica_serial_number;
+  char *identifier = ok ? PQescapeIdentifier(conn, channel.c_str(), channel.size()) : NULL;
+  if (identifier != NULL) {
+    PGresult *result = PQexec(conn, ("listen " + string(identifier)).c_str());
+    ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    PQclear(result);
+    PQfreemem(identifier);
+  }
+  ok = ok && identifier != NULL && LoadAccessSnapshot(conn, shutdown_fd) && ApplyAccessNotifications(conn);
+
+  if (!ok) {
+    // Failures that are not the connection's, like a shutdown mid read, were reported already
+    if (*PQerrorMessage(conn) != '\0') {
+      cout << "Access replica failed to sync: " << PQerrorMessage(conn);
+    }
+    PQfinish(conn);
+    return NULL;
+  }
+  access_replica_synced = true;
+  return conn;
+}
+
+// The replica matched the server up to now, it ages from here
+void LoseAccessReplicaSync() {
+  access_replica_confirmed_at = ReplicaClockNow();
+  access_replica_synced = false;
+}
+
+void PrintAccessReplicaStats() {
+  cout << "Access replica: " << access_replica_rebuilds << " builds, " << access_replica_deltas_applied << " changes applied, "
+       << access_replica_expired << " cards not granted while too far out of sync" << endl;
+}
+
+// Keeps the replica in step with the server on its own connection.
+// Exits when the shutdown eventfd passed as arg becomes readable
+void *AccessReplicaThreadTask(void *arg) {
+  int shutdown_fd = *(int*)arg;
+
+  PGconn *conn = NULL;
+  unsigned int failed_attempts = 0;
+  auto next_attempt = chrono::steady_clock::now();
+
+  struct pollfd fds[2];
+  fds[0].fd = shutdown_fd;
+  fds[0].events = POLLIN;
+
+  while (true) {
+    if (conn == NULL && chrono::steady_clock::now() >= next_attempt) {
+      conn = ConnectAccessReplica(shutdown_fd);
+      if (conn == NULL) {
+        next_attempt = chrono::steady_clock::now() + ConnectBackoff(failed_attempts++);
+      } else {
+        failed_attempts = 0;
+      }
+    }
+
+    int timeout = -1;
+    fds[1].fd = -1;
+    if (conn != NULL) {
+      fds[1].fd = PQsocket(conn);
+      fds[1].events = POLLIN;
+      if (access_replica_max_age.count() > 0) {
+        timeout = max(0L, (long)chrono::ceil<chrono::milliseconds>(AccessReplicaRefreshAt() - chrono::system_clock::now()).count());
+      }
+    } else {
+      timeout = max(0L, (long)chrono::ceil<chrono::milliseconds>(next_attempt - chrono::steady_clock::now()).count());
+    }
+
+    if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+      cout << "Access replica thread failed to poll, stopping" << endl;
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      break;
+    }
+
+    if (conn != NULL && (fds[1].revents & (POLLIN | POLLERR | POLLHUP))) {
+      bool ok = PQconsumeInput(conn) == 1;
+      if (ok && !ApplyAccessNotifications(conn)) {
+        ok = LoadAccessSnapshot(conn, shutdown_fd) && ApplyAccessNotifications(conn);
+      }
+      if (!ok) {
+        cout << "Access replica lost its database connection: " << PQerrorMessage(conn);
+        LoseAccessReplicaSync();
+        PQfinish(conn);
+        conn = NULL;
+        next_attempt = chrono::steady_clock::now() + ConnectBackoff(failed_attempts++);
+        continue;
+      }
+    }
+    if (conn != NULL) {
+      CompactAccessReplica();
+    }
+  }
+
+  if (conn != NULL) {
+    LoseAccessReplicaSync();
+    PQfinish(conn);
+  }
+  return NULL;
+}
@@ -0,0 +1,221 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+
+using namespace std;
+
+// Scans that go to the database while others are already waiting on it share one
+// cardScanned() round trip. Callers queue their code and one of them leads: it takes a
+// connection, sends every code pending by then as one batch and hands each caller its
+// access back. A scan with no batch in flight is sent straight away on its own. Only
+// while a batch is in flight does the next leader hold its batch open, for up to
+// auth_batch_max_wait or until it is full, so a lone scan never waits for company
+
+#define AUTH_BATCH_SIZE 16
+#define AUTH_BATCH_MAX_WAIT 5
+// Round trips in a row that were cut at their deadline or lost their connection before
+// scans stop waiting on the database and get the outage mode straight away, until a
+// probe gets an answer again. An error the server raises does not count, it is up
+#define AUTH_BREAKER_THRESHOLD 3
+
+typedef enum _auth_request_state {
+  AUTH_REQUEST_PENDING,
+  // Taken into a batch, the leader fills access in and marks it done
+  AUTH_REQUEST_SENT,
+  AUTH_REQUEST_DONE
+} auth_request_state;
+
+typedef struct _auth_request {
+  string_view auth_code;
+  position_word *access;
+  chrono::steady_clock::time_point deadline;
+  auth_request_state state;
+  bool answered;
+} auth_request;
+
+chrono::milliseconds auth_batch_max_wait(AUTH_BATCH_MAX_WAIT);
+
+atomic<unsigned long> auth_batches_sent{0};
+atomic<unsigned long> auth_batched_codes{0};
+// Batches that were not answered and had their codes sent again one at a time
+atomic<unsigned long> auth_batches_split{0};
+atomic<unsigned int> auth_breaker_failures{0};
+atomic<bool> auth_breaker_open{false};
+atomic<unsigned long> auth_breaker_trips{0};
+
+// Milliseconds, 0 only batches the scans that piled up waiting for a connection
+bool SetAuthBatchMaxWait(const char *wait) {
+  if (wait == NULL) return false;
+  char *end;
+  long ms = strtol(wait, &end, 10);
+  if (*wait == '\0' || *end != '\0' || ms < 0) return false;
+  auth_batch_max_wait = chrono::milliseconds(ms);
+  return true;
+}
+
+// One sample per round trip to the database, whatever number of scans rode on it
+void RecordDatabaseAnswer(bool answered) {
+  if (answered) {
+    auth_breaker_failures = 0;
+    if (auth_breaker_open.exchange(false)) {
+      cout << "Database answering again, scans go to it again" << endl;
+    }
+    return;
+  }
+  if (++auth_breaker_failures >= AUTH_BREAKER_THRESHOLD && !auth_breaker_open.exchange(true)) {
+    auth_breaker_trips++;
+    cout << "Database did not answer " << AUTH_BREAKER_THRESHOLD << " times in a row, scans no longer wait on it" << endl;
+  }
+}
+
+class auth_batcher {
+ public:
+  // Blocks until auth_code's access is in, NULL when the database did not answer by deadline
+  position_word *Fetch(string_view auth_code, position_word *access, chrono::steady_clock::time_point deadline) {
+    auth_request request = { auth_code, access, deadline, AUTH_REQUEST_PENDING, false };
+
+    unique_lock<mutex> lock(mutex_);
+    pending.push_back(&request);
+    if (pending.size() >= AUTH_BATCH_SIZE) {
+      filled.notify_all();
+    }
+
+    // Wait to be answered by another leader, or for the lead to come free
+    while (request.state == AUTH_REQUEST_SENT || (request.state == AUTH_REQUEST_PENDING && leading)) {
+      if (request.state == AUTH_REQUEST_SENT) {
+        // The leader's query is cut at its deadline, it always comes back
+        answered.wait(lock);
+      } else if (answered.wait_until(lock, deadline) == cv_status::timeout && request.state == AUTH_REQUEST_PENDING) {
+        erase(pending, &request);
+        return NULL;
+      }
+    }
+    if (request.state == AUTH_REQUEST_DONE) {
+      return request.answered ? access : NULL;
+    }
+    if (chrono::steady_clock::now() >= deadline) {
+      erase(pending, &request);
+      return NULL;
+    }
+
+    leading = true;
+    lock.unlock();
+
+    auto wait = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+    auto conn = FetchConnection(clamp(wait, chrono::milliseconds(0), chrono::milliseconds(DB_FETCH_TIMEOUT)));
+
+    lock.lock();
+    if (!conn) {
+      // Only this caller gave up, whoever is pending leads next with their own deadline
+      erase(pending, &request);
+      leading = false;
+      answered.notify_all();
+      return NULL;
+    }
+
+    if (in_flight > 0 && auth_batch_max_wait.count() > 0) {
+      auto open_until = min(chrono::steady_clock::now() + auth_batch_max_wait, deadline);
+      filled.wait_until(lock, open_until, [&] { return pending.size() >= AUTH_BATCH_SIZE || in_flight == 0; });
+    }
+
+    // The leader always goes in its own batch, then whoever queued first
+    vector<auth_request*> batch = { &request };
+    erase(pending, &request);
+    while (batch.size() < AUTH_BATCH_SIZE && !pending.empty()) {
+      batch.push_back(pending.front());
+      pending.pop_front();
+    }
+    for (auto sent : batch) {
+      sent->state = AUTH_REQUEST_SENT;
+    }
+    leading = false;
+    in_flight++;
+    // Anyone left over leads the next batch
+    answered.notify_all();
+    lock.unlock();
+
+    Send(&conn, batch);
+
+    lock.lock();
+    for (auto sent : batch) {
+      sent->state = AUTH_REQUEST_DONE;
+    }
+    in_flight--;
+    answered.notify_all();
+    filled.notify_all();
+
+    return request.answered ? access : NULL;
+  }
+
+ private:
+  // The batch's query is cut at the earliest deadline in it, no caller waits past theirs.
+  // When the batch is not answered each code is sent again on its own within its own
+  // deadline, so one bad code or one early deadline does not sink the rest. Sets each
+  // request's answered, every round trip is one breaker sample
+  void Send(db_lease *conn, const vector<auth_request*> &batch) {
+    auth_batches_sent++;
+    auth_batched_codes += batch.size();
+
+    if (batch.size() > 1) {
+      vector<string> codes;
+      vector<position_word*> outputs;
+      auto deadline = batch[0]->deadline;
+      for (auto sent : batch) {
+        codes.emplace_back(sent->auth_code);
+        outputs.push_back(sent->access);
+        deadline = min(deadline, sent->deadline);
+      }
+      db_call_result result = AuthCardsScanned((*conn)->conn.get(), codes, outputs.data(), deadline);
+      RecordDatabaseAnswer(result != DB_CALL_UNREACHABLE);
+      if (result == DB_CALL_ANSWERED) {
+        for (auto sent : batch) {
+          sent->answered = true;
+        }
+        return;
+      }
+      auth_batches_split++;
+    }
+
+    for (auto sent : batch) {
+      // Past its deadline, or the breaker opened on the way and the rest get the outage mode
+      auto wait = chrono::duration_cast<chrono::milliseconds>(sent->deadline - chrono::steady_clock::now());
+      if (wait.count() <= 0 || (batch.size() > 1 && auth_breaker_open)) {
+        continue;
+      }
+      // A batch that was cut took its connection down with it
+      if (!*conn || !(*conn)->conn->is_open()) {
+        *conn = FetchConnection(min(wait, chrono::milliseconds(DB_FETCH_TIMEOUT)));
+        if (!*conn) {
+          continue;
+        }
+      }
+      db_call_result result = AuthCardScanned((*conn)->conn.get(), sent->auth_code.data(), sent->auth_code.size(), sent->access, sent->deadline);
+      RecordDatabaseAnswer(result != DB_CALL_UNREACHABLE);
+      sent->answered = result == DB_CALL_ANSWERED;
+    }
+  }
+
+  mutex mutex_;
+  condition_variable answered;
+  condition_variable filled;
+  deque<auth_request*> pending;
+  // A caller is taking a connection and will send what is pending
+  bool leading = false;
+  size_t in_flight = 0;
+};
+
+auth_batcher auth_batches;
+
+void PrintAuthBatcherStats() {
+  unsigned long batches = auth_batches_sent, codes = auth_batched_codes;
+  cout << "Auth batches: " << codes << " codes in " << batches << " round trips";
+  if (batches > 0) {
+    cout << " (" << (double)codes / batches << " per round trip)";
+  }
+  cout << ", " << auth_batches_split << " batches resent one code at a time" << endl;
+}
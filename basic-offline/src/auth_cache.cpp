@@ -0,0 +1,411 @@
+#include <iostream>
+#include <unordered_map>
+#include <mutex>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <random>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "access_replica.cpp"
+#include "auth_batcher.cpp"
+
+using namespace std;
+
+// Access returned by cardScanned() is kept per auth code so a scan can unlock without
+// waiting on the database. Entries are keyed by a keyed SipHash of the code and never
+// hold the code itself, only a verifier from the same hash that a scan has to match
+// before the entry's access is used. A scan that hits an entry younger than the TTL unlocks
+// straight away. A revoked card is therefore honoured for at most the TTL and one more
+// scan. Older entries are only used when the database cannot be reached and the outage
+// mode allows it. Where the access replica is kept, cards it grants never reach the cache
+//
+// Every scan that is granted without the database answering it, from the replica, the
+// cache or a stale entry, is appended to the scan journal first and is only granted
+// if that worked. The audit thread reads the journal back and makes the cardScanned()
+// call for each scan, so it is recorded and the cache picks up any change in access.
+// Scans wait in the journal while the database is away and across restarts, the
+// cursor only moves past a scan once the database answered or refused it. The journal
+// has to hold the code itself to replay it, it is created 0600 under the state directory
+
+// Entries held, the oldest is evicted past this
+#define AUTH_CACHE_SIZE 1024
+#define AUTH_CACHE_TTL 10000
+#define AUTH_CACHE_STALE_LIMIT 86400000
+// How often the maintenance loop pings the database while the breaker is open
+#define AUTH_BREAKER_PROBE_PERIOD 5000
+// Longest code the scan journal holds, a longer one is only granted by the database
+#define AUTH_AUDIT_CODE_SIZE 224
+#define AUTH_AUDIT_DEFAULT_CAPACITY 16384
+#define AUTH_AUDIT_DEFAULT_PATH "/var/lib/simsafe/scans.journal"
+// How long the audit thread leaves the database alone after it could not be reached
+#define AUTH_AUDIT_RETRY_PERIOD 1000
+// New scans and the cursor are synced to disk at most this often
+#define AUTH_AUDIT_SYNC_PERIOD 100
+
+typedef enum _auth_outage_mode {
+  // A scan that misses while the database is unreachable opens nothing
+  AUTH_OUTAGE_DENY,
+  // It is served from an entry up to auth_cache_stale_limit old
+  AUTH_OUTAGE_STALE
+} auth_outage_mode;
+
+typedef struct _auth_cache_entry {
+  uint64_t verifier;
+  position_word access;
+  chrono::steady_clock::time_point fetched_at;
+} auth_cache_entry;
+
+typedef struct _scan_audit_record {
+  // Same layout rules as journal_record
+  uint64_t sequence;
+  // Nanoseconds since the epoch
+  int64_t scanned_at;
+  uint16_t length;
+  uint16_t reserved;
+  uint32_t reserved2;
+  char code[AUTH_AUDIT_CODE_SIZE];
+  uint32_t checksum;
+  uint32_t padding;
+} scan_audit_record;
+
+static_assert(sizeof(scan_audit_record) == 256, "Scan journal records must stay 256 bytes, the file format depends on it");
+
+chrono::milliseconds auth_cache_ttl(AUTH_CACHE_TTL);
+chrono::milliseconds auth_cache_stale_limit(AUTH_CACHE_STALE_LIMIT);
+auth_outage_mode auth_cache_outage_mode = AUTH_OUTAGE_DENY;
+auth_hash_key auth_cache_hash_key = RandomAuthHashKey();
+
+mutex auth_cache_mutex;
+unordered_map<uint64_t, auth_cache_entry> auth_cache;
+journal<scan_audit_record> auth_audit_journal;
+int auth_audit_event_fd = -1;
+
+atomic<unsigned long> auth_replica_hits{0};
+atomic<unsigned long> auth_cache_hits{0};
+atomic<unsigned long> auth_cache_misses{0};
+// Served past the TTL because the database was unreachable
+atomic<unsigned long> auth_cache_stale_hits{0};
+atomic<unsigned long> auth_audits_recorded{0};
+// Refused by the database, these are not retried
+atomic<unsigned long> auth_audits_failed{0};
+// Could not be journaled, so they went to the database instead of being granted locally
+atomic<unsigned long> auth_audits_unjournaled{0};
+// Scans that went to the outage mode without asking the database
+atomic<unsigned long> auth_breaker_skipped{0};
+// Only the maintenance loop probes
+chrono::steady_clock::time_point auth_breaker_next_probe;
+// Scan to access decided, split by where the access came from
+latency_histogram auth_replica_latency;
+latency_histogram auth_hit_latency;
+latency_histogram auth_miss_latency;
+// Scan to cardScanned() answered, replayed scans include the time the controller was off
+latency_histogram auth_audit_latency;
+
+// Milliseconds, 0 always asks the database first
+bool SetAuthCacheTTL(const char *ttl) {
+  if (ttl == NULL) return false;
+  char *end;
+  long ms = strtol(ttl, &end, 10);
+  if (*ttl == '\0' || *end != '\0' || ms < 0) return false;
+  auth_cache_ttl = chrono::milliseconds(ms);
+  return true;
+}
+
+bool SetAuthCacheStaleLimit(const char *limit) {
+  if (limit == NULL) return false;
+  char *end;
+  long ms = strtol(limit, &end, 10);
+  if (*limit == '\0' || *end != '\0' || ms < 0) return false;
+  auth_cache_stale_limit = chrono::milliseconds(ms);
+  return true;
+}
+
+// Accepts "deny" or "stale", anything else leaves the mode as is
+bool SetAuthCacheOutageMode(const char *mode) {
+  if (mode == NULL) return false;
+  if (strcmp(mode, "deny") == 0) auth_cache_outage_mode = AUTH_OUTAGE_DENY;
+  else if (strcmp(mode, "stale") == 0) auth_cache_outage_mode = AUTH_OUTAGE_STALE;
+  else return false;
+  return true;
+}
+
+auth_code_hash AuthCacheKey(string_view auth_code) {
+  return HashAuthCode(auth_code, auth_cache_hash_key);
+}
+
+// Copies the access out if the entry is this code's and no older than max_age
+bool AuthCacheLookup(const auth_code_hash &hash, chrono::milliseconds max_age, position_word *access) {
+  lock_guard<mutex> lock(auth_cache_mutex);
+  auto entry = auth_cache.find(hash.key);
+  if (entry == auth_cache.end() || entry->second.verifier != hash.verifier ||
+      chrono::steady_clock::now() - entry->second.fetched_at > max_age) {
+    return false;
+  }
+  *access = entry->second.access;
+  return true;
+}
+
+// Codes with no access are not kept, so a card that was just granted access is asked
+// about on its next scan instead of waiting out the TTL
+void AuthCacheStore(const auth_code_hash &hash, const position_word *access) {
+  lock_guard<mutex> lock(auth_cache_mutex);
+  if (!access->Any()) {
+    auth_cache.erase(hash.key);
+    return;
+  }
+
+  if (auth_cache.size() >= AUTH_CACHE_SIZE && auth_cache.find(hash.key) == auth_cache.end()) {
+    auto oldest = auth_cache.begin();
+    for (auto entry = auth_cache.begin(); entry != auth_cache.end(); entry++) {
+      if (entry->second.fetched_at < oldest->second.fetched_at) {
+        oldest = entry;
+      }
+    }
+    auth_cache.erase(oldest);
+  }
+  auth_cache[hash.key] = { .verifier = hash.verifier, .access = *access, .fetched_at = chrono::steady_clock::now() };
+}
+
+// Asks the database, NULL when it could not answer by deadline. Waiting for a
+// connection, and for a batch to go with, comes out of the same deadline. A scan that
+// gave up waiting for a connection is not held against the database
+position_word *FetchAccess(string_view auth_code, position_word *access, chrono::steady_clock::time_point deadline) {
+  return auth_batches.Fetch(auth_code, access, deadline);
+}
+
+// Run from the maintenance loop, checks whether the database answers again while scans
+// are not going to it
+void ProbeAuthBreaker() {
+  auto now = chrono::steady_clock::now();
+  if (!auth_breaker_open || now < auth_breaker_next_probe) {
+    return;
+  }
+  auth_breaker_next_probe = now + chrono::milliseconds(AUTH_BREAKER_PROBE_PERIOD);
+
+  auto deadline = now + db_auth_deadline;
+  auto conn = FetchConnection(min(db_auth_deadline, chrono::milliseconds(DB_FETCH_TIMEOUT)));
+  if (conn && PingDatabase(conn->conn.get(), deadline)) {
+    RecordDatabaseAnswer(true);
+  }
+}
+
+// Appends the scan for the audit thread to record, false when it could not be kept and
+// the scan must not be granted without the database
+bool JournalScan(string_view auth_code, chrono::steady_clock::time_point scanned_at) {
+  if (auth_code.size() > AUTH_AUDIT_CODE_SIZE) {
+    auth_audits_unjournaled++;
+    return false;
+  }
+  auto wall_scanned_at = chrono::duration_cast<chrono::nanoseconds>(
+    chrono::system_clock::now().time_since_epoch() - (chrono::steady_clock::now() - scanned_at));
+
+  scan_audit_record record = {
+    .sequence = 0,
+    .scanned_at = wall_scanned_at.count(),
+    .length = (uint16_t)auth_code.size(),
+    .reserved = 0,
+    .reserved2 = 0,
+    .code = {},
+    .checksum = 0,
+    .padding = 0
+  };
+  memcpy(record.code, auth_code.data(), auth_code.size());
+  if (!auth_audit_journal.Append(record)) {
+    auth_audits_unjournaled++;
+    return false;
+  }
+  eventfd_write(auth_audit_event_fd, 1);
+  return true;
+}
+
+// Decides what auth_code opens, within db_auth_deadline of scanned_at. Returns false
+// when there is nothing to go on, the database did not answer and no entry may be used
+bool AuthorizeScan(string_view auth_code, chrono::steady_clock::time_point scanned_at, position_word *access) {
+  if (IsAccessReplicaEnabled() && LookupAccessReplica(auth_code, access)) {
+    if (JournalScan(auth_code, scanned_at)) {
+      auth_replica_hits++;
+      auth_replica_latency.Record(chrono::steady_clock::now() - scanned_at);
+      return true;
+    }
+    access->Clear();
+  }
+
+  auth_code_hash key = AuthCacheKey(auth_code);
+
+  if (auth_cache_ttl.count() > 0 && AuthCacheLookup(key, auth_cache_ttl, access)) {
+    if (JournalScan(auth_code, scanned_at)) {
+      auth_cache_hits++;
+      auth_hit_latency.Record(chrono::steady_clock::now() - scanned_at);
+      return true;
+    }
+    access->Clear();
+  }
+
+  auth_cache_misses++;
+  if (auth_breaker_open) {
+    auth_breaker_skipped++;
+  } else if (FetchAccess(auth_code, access, scanned_at + db_auth_deadline) != NULL) {
+    auth_miss_latency.Record(chrono::steady_clock::now() - scanned_at);
+    AuthCacheStore(key, access);
+    return true;
+  }
+
+  if (auth_cache_outage_mode == AUTH_OUTAGE_STALE && AuthCacheLookup(key, auth_cache_stale_limit, access)) {
+    if (!JournalScan(auth_code, scanned_at)) {
+      access->Clear();
+      return false;
+    }
+    auth_cache_stale_hits++;
+    cout << "Database unreachable, serving cached access" << endl;
+    return true;
+  }
+  return false;
+}
+
+// Maps the scan journal at path, see journal::Open for capacity
+int OpenAuthCache(const char *journal_path, uint32_t journal_capacity) {
+  if (auth_audit_journal.Open(journal_path, journal_capacity)) {
+    return -1;
+  }
+  auth_audit_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  return auth_audit_event_fd < 0 ? -1 : 0;
+}
+
+void CloseAuthCache() {
+  close(auth_audit_event_fd);
+  auth_audit_event_fd = -1;
+  auth_audit_journal.Close();
+}
+
+void PrintAuthCacheStats() {
+  unsigned long hits = auth_cache_hits, misses = auth_cache_misses;
+  if (IsAccessReplicaEnabled()) {
+    cout << "Auth replica: " << auth_replica_hits << " scans answered locally" << endl;
+    PrintAccessReplicaStats();
+    PrintHistogram("Scan to access, replica", &auth_replica_latency);
+  }
+  cout << "Auth cache: " << hits << " hits, " << misses << " misses";
+  if (hits + misses > 0) {
+    cout << " (" << hits * 100 / (hits + misses) << "% hit rate)";
+  }
+  cout << ", " << auth_cache_stale_hits << " served stale" << endl;
+  cout << "Scan journal: recorded=" << auth_audits_recorded << " failed=" << auth_audits_failed
+       << " unjournaled=" << auth_audits_unjournaled << " lost=" << auth_audit_journal.Lost() << endl;
+  cout << "Auth deadline: breaker tripped " << auth_breaker_trips << " times, " << auth_breaker_skipped
+       << " scans did not wait on the database, " << db_queries_cut << " queries cut" << endl;
+  PrintAuthBatcherStats();
+  if (access_length_mismatches > 0) {
+    cout << "Access: " << access_length_mismatches << " answers did not cover the " << num_hardware_positions << " positions on the chain" << endl;
+  }
+  if (access_unreadable > 0) {
+    cout << "Access: " << access_unreadable << " answers could not be read and opened nothing" << endl;
+  }
+  PrintHistogram("Scan to access, cached", &auth_hit_latency);
+  PrintHistogram("Scan to access, database", &auth_miss_latency);
+  PrintHistogram("Scan to recorded", &auth_audit_latency);
+}
+
+// Makes the cardScanned() call for every journaled scan, oldest first. A scan the
+// database refused is counted and passed over, one it could not be reached for stays at
+// the cursor and is tried again after AUTH_AUDIT_RETRY_PERIOD or once the breaker closes.
+// Exits when the shutdown eventfd passed as arg becomes readable, whatever is left stays
+// in the journal for the next start
+void *AuthAuditThreadTask(void *arg) {
+  int shutdown_fd = *(int*)arg;
+
+  uint64_t next_read = auth_audit_journal.Flushed();
+  uint64_t synced_head = auth_audit_journal.Head(), synced_flushed = auth_audit_journal.Flushed();
+  auto next_sync = chrono::steady_clock::now();
+  auto next_attempt = chrono::steady_clock::now();
+  scan_audit_record record;
+  position_word access;
+  eventfd_t event_count;
+
+  struct pollfd fds[2];
+  fds[0].fd = auth_audit_event_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = shutdown_fd;
+  fds[1].events = POLLIN;
+
+  while (true) {
+    auto now = chrono::steady_clock::now();
+    bool waiting = false;
+
+    while (auth_audit_journal.Next(&next_read, &record)) {
+      if (auth_breaker_open || now < next_attempt) {
+        waiting = true;
+        break;
+      }
+      auto deadline = chrono::steady_clock::now() + db_auth_deadline;
+      db_lease conn = FetchConnection(min(db_auth_deadline, chrono::milliseconds(DB_FETCH_TIMEOUT)));
+      db_call_result result = DB_CALL_UNREACHABLE;
+      access.Clear();
+      if (conn) {
+        result = AuthCardScanned(conn->conn.get(), record.code, record.length, &access, deadline);
+        RecordDatabaseAnswer(result != DB_CALL_UNREACHABLE);
+      }
+      if (result == DB_CALL_UNREACHABLE) {
+        next_attempt = chrono::steady_clock::now() + chrono::milliseconds(AUTH_AUDIT_RETRY_PERIOD);
+        waiting = true;
+        break;
+      }
+
+      if (result == DB_CALL_ANSWERED) {
+        auth_audits_recorded++;
+        auth_audit_latency.Record(chrono::system_clock::now().time_since_epoch() - chrono::nanoseconds(record.scanned_at));
+        AuthCacheStore(AuthCacheKey(string_view(record.code, record.length)), &access);
+      } else {
+        auth_audits_failed++;
+      }
+      next_read++;
+      auth_audit_journal.MarkFlushed(next_read);
+    }
+
+    // Sleep until the next journal sync or retry, or until a scan is journaled
+    now = chrono::steady_clock::now();
+    auto wake = chrono::steady_clock::time_point::max();
+    if (auth_audit_journal.Head() != synced_head || auth_audit_journal.Flushed() != synced_flushed) {
+      if (now >= next_sync) {
+        if (auth_audit_journal.Sync()) {
+          cout << "Failed to sync the scan journal: " << strerror(errno) << endl;
+        }
+        synced_head = auth_audit_journal.Head();
+        synced_flushed = auth_audit_journal.Flushed();
+        next_sync = now + chrono::milliseconds(AUTH_AUDIT_SYNC_PERIOD);
+      } else {
+        wake = next_sync;
+      }
+    }
+    if (waiting) {
+      // The breaker is closed by the maintenance loop's probe, look again after a retry period
+      wake = min(wake, max(next_attempt, now + chrono::milliseconds(auth_breaker_open ? AUTH_AUDIT_RETRY_PERIOD : 0)));
+    }
+
+    int timeout = -1;
+    if (wake != chrono::steady_clock::time_point::max()) {
+      timeout = max(0L, (long)chrono::ceil<chrono::milliseconds>(wake - now).count());
+    }
+
+    if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+      cout << "Auth audit thread failed to poll, stopping" << endl;
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      eventfd_read(auth_audit_event_fd, &event_count);
+    }
+  }
+
+  auth_audit_journal.Sync();
+  uint64_t left = auth_audit_journal.Head() - auth_audit_journal.Flushed();
+  if (left > 0) {
+    cout << left << " scans left in the scan journal for the next start" << endl;
+  }
+
+  return NULL;
+}
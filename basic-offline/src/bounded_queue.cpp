@@ -0,0 +1,75 @@
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+// Fixed capacity lock-free queue, any number of producers and consumers.
+// Each cell carries a sequence number that says whether it is free for the
+// producer at that position or holds a value for the consumer at that position,
+// so neither side ever takes a lock or allocates after construction
+template <typename T, size_t Capacity>
+class bounded_queue {
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+ public:
+  bounded_queue() {
+    for (size_t i = 0; i < Capacity; i++) {
+      cells[i].sequence.store(i, memory_order_relaxed);
+    }
+  }
+
+  // Returns false without touching value when the queue is full
+  bool TryPush(T &&value) {
+    cell *target;
+    size_t pos = enqueue_pos.load(memory_order_relaxed);
+
+    while (true) {
+      target = &cells[pos & (Capacity - 1)];
+      intptr_t diff = (intptr_t)target->sequence.load(memory_order_acquire) - (intptr_t)pos;
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(memory_order_relaxed);
+      }
+    }
+
+    target->value = std::move(value);
+    target->sequence.store(pos + 1, memory_order_release);
+    return true;
+  }
+
+  // Returns false when the queue is empty
+  bool TryPop(T *value) {
+    cell *target;
+    size_t pos = dequeue_pos.load(memory_order_relaxed);
+
+    while (true) {
+      target = &cells[pos & (Capacity - 1)];
+      intptr_t diff = (intptr_t)target->sequence.load(memory_order_acquire) - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(memory_order_relaxed);
+      }
+    }
+
+    *value = std::move(target->value);
+    target->sequence.store(pos + Capacity, memory_order_release);
+    return true;
+  }
+
+ private:
+  struct cell {
+    atomic<size_t> sequence;
+    T value;
+  };
+
+  cell cells[Capacity];
+  alignas(64) atomic<size_t> enqueue_pos{0};
+  alignas(64) atomic<size_t> dequeue_pos{0};
+};
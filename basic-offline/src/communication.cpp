@@ -4,49 +4,61 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <gpiod.hpp>
 #include <string.h>
+#include <chrono>
+#include "metrics.cpp"
+#include "frame_decoder.cpp"
+#include "position_word.cpp"
+#include "line_driver.cpp"
 
 using namespace std;
 
-#define HARDWARE_POSITIONS_TYPE u_int16_t
 HARDWARE_POSITIONS_TYPE num_hardware_positions = 0;
 struct gpiod_chip *gpio_chip;
 struct gpiod_line_request_config gpio_config;
 struct gpiod_line_bulk gpio_lines_output;
 struct gpiod_line_bulk gpio_lines_input;
-#define NUM_GPIO_OUTPUT 8
 unsigned int gpio_output_offsets[] = { 17, 27, 22, 23, 24, 5, 16, 26 };
-#define NUM_GPIO_INPUT 1
 unsigned int gpio_input_offsets[] = { 6 };
 int gpio_output_values[] = { 1, 1, 0, 0, 0, 0, 1, 1 };
 int gpio_input_values[] = { 0 };
 
-#define GPIO_OUTPUT_OE 0
-#define GPIO_OUTPUT_SRCLR 1
-#define GPIO_OUTPUT_SRCLK 2
-#define GPIO_OUTPUT_RCLK 3
-#define GPIO_OUTPUT_SER 4
+gpiod_line_driver gpio_chip_driver(&gpio_lines_output, &gpio_lines_input);
+line_driver *gpio_driver = &gpio_chip_driver;
+simulated_line_driver *gpio_simulated_driver = NULL;
 
-#define GPIO_INPUT_CLK 5
-#define GPIO_INPUT_CLR 6
-#define GPIO_INPUT_LD 7
-#define GPIO_INPUT_DATA 0
+// One step of a shift-out waveform, the levels of SRCLK, SER and RCLK for one bank write.
+// Every other output line keeps whatever level it has when the waveform is played
+#define WAVEFORM_SRCLK 0x1
+#define WAVEFORM_SER 0x2
+#define WAVEFORM_RCLK 0x4
+
+typedef struct _shift_out_stats {
+  unsigned long bulk_calls;
+  chrono::nanoseconds duration;
+} shift_out_stats;
+
+vector<u_int8_t> shift_out_waveform;
+position_word shift_out_waveform_word;
+shift_out_stats last_shift_out_stats = { 0, chrono::nanoseconds(0) };
+// When the sensors were last loaded into the 165 chain by ReadGPIO or ExchangeGPIO
+chrono::steady_clock::time_point last_sample_time;
 
 void ReadDipSwitchIntoGlobal(void) {
+  if (gpio_simulated_driver != NULL) {
+    num_hardware_positions = min(gpio_simulated_driver->ChainLength(), (size_t)MAX_HARDWARE_POSITIONS);
+    return;
+  }
   // TODO: Implement
   num_hardware_positions = 8;
 }
 
-vector<bool>* FetchPositionStates(vector<bool> *states) {
+position_word* FetchPositionStates(position_word *states) {
   // TODO: Implement
-  if (states->size() < num_hardware_positions) {
-    for (HARDWARE_POSITIONS_TYPE i = 0, n = num_hardware_positions - states->size(); i < n; i++) {
-      states->push_back(false);
-    }
-  }
   for (HARDWARE_POSITIONS_TYPE i = 0; i < num_hardware_positions; i++) {
-    states->at(i) = rand() > (INT32_MAX / 2);
+    states->Set(i, rand() > (INT32_MAX / 2));
   }
   return states;
 }
@@ -60,7 +72,29 @@ int OpenSerialPort(const char* portname) {
   return fd;
 }
 
-bool ConfigureSerialPort(int fd, int speed) {
+// termios speed for a baud rate, B0 when readers do not run at that rate
+speed_t SerialSpeed(long baud) {
+  switch (baud) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    default: return B0;
+  }
+}
+
+bool ConfigureSerialPort(int fd, long baud) {
+  speed_t speed = SerialSpeed(baud);
+  if (speed == B0) {
+    cerr << "Unsupported baud rate " << baud << endl;
+    return false;
+  }
+
   struct termios tty;
   if (tcgetattr(fd, &tty) != 0) {
     cerr << "Error from tcgetattr" << endl;
@@ -102,6 +136,14 @@ void CloseSerialPort(int fd) {
   close(fd);
 }
 
+// Runs everything against an in-process model of the shift register chains instead of a chip
+int OpenSimulatedGPIO(HARDWARE_POSITIONS_TYPE chain_length) {
+  if (chain_length < 1 || chain_length > MAX_HARDWARE_POSITIONS) return -1;
+  gpio_simulated_driver = new simulated_line_driver(chain_length, gpio_output_values);
+  gpio_driver = gpio_simulated_driver;
+  return 0;
+}
+
 int OpenGPIOChip(const char *name) {
   gpio_chip = gpiod_chip_open(name);
   if (gpio_chip == NULL) return -1;
@@ -141,30 +183,31 @@ void ResetGPIO() {
   gpio_output_values[GPIO_OUTPUT_RCLK] = 0;
   gpio_output_values[GPIO_OUTPUT_SER] = 0;
   gpio_output_values[GPIO_INPUT_CLR] = 0;
-  gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+  gpio_driver->SetOutputs(gpio_output_values);
 
   gpio_output_values[GPIO_OUTPUT_SRCLR] = 0;
   gpio_output_values[GPIO_OUTPUT_SRCLK] = 1;
   gpio_output_values[GPIO_INPUT_CLR] = 1;
-  gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+  gpio_driver->SetOutputs(gpio_output_values);
 
   gpio_output_values[GPIO_OUTPUT_SRCLR] = 1;
   gpio_output_values[GPIO_OUTPUT_SRCLK] = 0;
   gpio_output_values[GPIO_OUTPUT_RCLK] = 1;
-  gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+  gpio_driver->SetOutputs(gpio_output_values);
 
   gpio_output_values[GPIO_OUTPUT_RCLK] = 0;
-  gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+  gpio_driver->SetOutputs(gpio_output_values);
 }
 
 int OpenGPIOOutput() {
+  trace_scope trace(TRACE_GPIO_LATCH);
   gpio_output_values[GPIO_OUTPUT_OE] = 0;
-  return gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+  return gpio_driver->SetOutputs(gpio_output_values);
 }
 
 int CloseGPIOOutput() {
   gpio_output_values[GPIO_OUTPUT_OE] = 1;
-  return gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+  return gpio_driver->SetOutputs(gpio_output_values);
 }
 
 void CloseGPIOChipOnly() {
@@ -177,60 +220,142 @@ void CloseGPIOOutputLines() {
 }
 
 void CloseGPIO() {
+  if (gpio_simulated_driver != NULL) {
+    gpio_driver = &gpio_chip_driver;
+    delete gpio_simulated_driver;
+    gpio_simulated_driver = NULL;
+    return;
+  }
   gpiod_line_release_bulk(&gpio_lines_output);
   gpiod_line_release_bulk(&gpio_lines_input);
   gpiod_chip_close(gpio_chip);
 }
 
-void SendWordToGPIO(const vector<bool> *values) {
+// SER for each bit goes out on the same write as the previous bit's SRCLK falling edge,
+// and the last falling edge shares its write with RCLK rising. That is 2 writes per
+// bit plus 2 to latch, against up to 3 per bit when SER is set on its own
+void CompileShiftOutWaveform(const position_word *values, vector<u_int8_t> *waveform) {
+  waveform->clear();
+  waveform->reserve(2 * num_hardware_positions + 2);
+
+  for (HARDWARE_POSITIONS_TYPE i = num_hardware_positions; i > 0; i--) {
+    u_int8_t ser = values->Test(i - 1) ? WAVEFORM_SER : 0;
+    waveform->push_back(ser);
+    waveform->push_back(ser | WAVEFORM_SRCLK);
+  }
+
+  waveform->push_back(WAVEFORM_RCLK);
+  waveform->push_back(0);
+}
+
+shift_out_stats PlayShiftOutWaveform(const vector<u_int8_t> *waveform) {
+  auto calls_before = gpio_driver->set_calls.load(memory_order_relaxed);
+  auto start = chrono::steady_clock::now();
+
+  for (u_int8_t step : *waveform) {
+    gpio_output_values[GPIO_OUTPUT_SRCLK] = (step & WAVEFORM_SRCLK) != 0;
+    gpio_output_values[GPIO_OUTPUT_SER] = (step & WAVEFORM_SER) != 0;
+    gpio_output_values[GPIO_OUTPUT_RCLK] = (step & WAVEFORM_RCLK) != 0;
+    gpio_driver->SetOutputs(gpio_output_values);
+  }
+
+  return shift_out_stats {
+    .bulk_calls = gpio_driver->set_calls.load(memory_order_relaxed) - calls_before,
+    .duration = chrono::steady_clock::now() - start
+  };
+}
+
+void SendWordToGPIO(const position_word *values) {
+  trace_scope trace(TRACE_GPIO_SHIFT_OUT);
   try {
-    for (HARDWARE_POSITIONS_TYPE i = num_hardware_positions; i > 0; i--) {
-      if (values->at(i - 1)) {
-        gpio_output_values[GPIO_OUTPUT_SER] = 1;
-        gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
-      } else {
-        gpio_output_values[GPIO_OUTPUT_SER] = 0;
-      }
-  
-      gpio_output_values[GPIO_OUTPUT_SRCLK] = 1;
-      gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
-      gpio_output_values[GPIO_OUTPUT_SRCLK] = 0;
-      gpio_output_values[GPIO_OUTPUT_SER] = 0;
-      gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+    // Relocking and reopening the same word is common, only recompile when it changes
+    if (shift_out_waveform.empty() || shift_out_waveform_word != *values) {
+      CompileShiftOutWaveform(values, &shift_out_waveform);
+      shift_out_waveform_word = *values;
     }
-  
-    gpio_output_values[GPIO_OUTPUT_RCLK] = 1;
-    gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
-    gpio_output_values[GPIO_OUTPUT_RCLK] = 0;
-    gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+
+    last_shift_out_stats = PlayShiftOutWaveform(&shift_out_waveform);
   } catch (exception const *e) {
     cout << "Exception while writing GPIO: " << e->what() << endl;
   }
 }
 
-void ReadGPIO(vector<bool> *output) {
+void ReadGPIO(position_word *output) {
   try {
     gpio_output_values[GPIO_INPUT_CLR] = 0;
-    gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+    gpio_driver->SetOutputs(gpio_output_values);
     gpio_output_values[GPIO_INPUT_CLR] = 1;
-    gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+    gpio_driver->SetOutputs(gpio_output_values);
     gpio_output_values[GPIO_INPUT_LD] = 0;
-    gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+    gpio_driver->SetOutputs(gpio_output_values);
+    last_sample_time = chrono::steady_clock::now();
     gpio_output_values[GPIO_INPUT_CLK] = 1;
-    gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+    gpio_driver->SetOutputs(gpio_output_values);
     gpio_output_values[GPIO_INPUT_LD] = 1;
     gpio_output_values[GPIO_INPUT_CLK] = 0;
-    gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+    gpio_driver->SetOutputs(gpio_output_values);
     
     for (HARDWARE_POSITIONS_TYPE i = num_hardware_positions; i > 0; i--) {
-      gpiod_line_get_value_bulk(&gpio_lines_input, gpio_input_values);
-      output->at(i - 1) = gpio_input_values[GPIO_INPUT_DATA];
+      gpio_driver->GetInputs(gpio_input_values);
+      output->Set(i - 1, gpio_input_values[GPIO_INPUT_DATA]);
       gpio_output_values[GPIO_INPUT_CLK] = 1;
-      gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+      gpio_driver->SetOutputs(gpio_output_values);
       gpio_output_values[GPIO_INPUT_CLK] = 0;
-      gpiod_line_set_value_bulk(&gpio_lines_output, gpio_output_values);
+      gpio_driver->SetOutputs(gpio_output_values);
     }
   } catch (exception const *e) {
     cout << "Exception while reading GPIO: " << e->what() << endl;
   }
 }
+
+// Shifts values into the 595 chain and samples the 165 chain in the same pass.
+// Both chains share the output bank, so each write drives SRCLK and CLK together
+// and the sensor word is loaded at a single point just before the new word latches
+void ExchangeGPIO(const position_word *values, position_word *output) {
+  trace_scope trace(TRACE_GPIO_SHIFT_OUT);
+  try {
+    auto calls_before = gpio_driver->set_calls.load(memory_order_relaxed);
+    auto start = chrono::steady_clock::now();
+
+    gpio_output_values[GPIO_OUTPUT_SRCLK] = 0;
+    gpio_output_values[GPIO_OUTPUT_RCLK] = 0;
+    gpio_output_values[GPIO_INPUT_CLK] = 0;
+    gpio_output_values[GPIO_INPUT_CLR] = 0;
+    gpio_driver->SetOutputs(gpio_output_values);
+    gpio_output_values[GPIO_INPUT_CLR] = 1;
+    gpio_output_values[GPIO_INPUT_LD] = 0;
+    gpio_driver->SetOutputs(gpio_output_values);
+    last_sample_time = chrono::steady_clock::now();
+    gpio_output_values[GPIO_INPUT_LD] = 1;
+    gpio_output_values[GPIO_OUTPUT_SER] = values->Test(num_hardware_positions - 1);
+    gpio_driver->SetOutputs(gpio_output_values);
+
+    for (HARDWARE_POSITIONS_TYPE i = num_hardware_positions; i > 0; i--) {
+      gpio_driver->GetInputs(gpio_input_values);
+      output->Set(i - 1, gpio_input_values[GPIO_INPUT_DATA]);
+      gpio_output_values[GPIO_OUTPUT_SRCLK] = 1;
+      gpio_output_values[GPIO_INPUT_CLK] = 1;
+      gpio_driver->SetOutputs(gpio_output_values);
+      // Falling edge carries the next bit's SER, or the latch after the last bit
+      gpio_output_values[GPIO_OUTPUT_SRCLK] = 0;
+      gpio_output_values[GPIO_INPUT_CLK] = 0;
+      if (i > 1) {
+        gpio_output_values[GPIO_OUTPUT_SER] = values->Test(i - 2);
+      } else {
+        gpio_output_values[GPIO_OUTPUT_SER] = 0;
+        gpio_output_values[GPIO_OUTPUT_RCLK] = 1;
+      }
+      gpio_driver->SetOutputs(gpio_output_values);
+    }
+
+    gpio_output_values[GPIO_OUTPUT_RCLK] = 0;
+    gpio_driver->SetOutputs(gpio_output_values);
+
+    last_shift_out_stats = shift_out_stats {
+      .bulk_calls = gpio_driver->set_calls.load(memory_order_relaxed) - calls_before,
+      .duration = chrono::steady_clock::now() - start
+    };
+  } catch (exception const *e) {
+    cout << "Exception while exchanging GPIO: " << e->what() << endl;
+  }
+}
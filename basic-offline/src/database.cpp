@@ -2,19 +2,209 @@
 #include <pqxx/pqxx>
 #include <unistd.h>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <poll.h>
+#include <random>
+#include <map>
+#include <array>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
 #include "communication.cpp"
 
 using namespace pqxx;
 
 typedef struct _db_connection {
-  connection conn;
+  // NULL until the slot is first opened, the pool only grows into its slots when busy
+  unique_ptr<connection> conn;
   bool in_use;
+  // Lost its server, kept out of the free list until RepairBrokenConnections reconnects it
+  bool broken;
+  // Claimed by a thread that is opening it, nobody else touches conn meanwhile
+  bool connecting;
+  unsigned int failed_attempts;
+  chrono::steady_clock::time_point next_attempt;
 } db_connection;
 
 unique_ptr<vector<db_connection>> _connections = make_unique<vector<db_connection>>(0);
 #define DB_CONNECTION_COUNT 10
+#define DB_FETCH_TIMEOUT 2000
+// Connections opened side by side at boot, the rest are opened when scans have to wait
+#define DB_STARTUP_CONNECTIONS 2
+// Retry delay after a failed connect doubles from DB_BACKOFF_INITIAL up to DB_BACKOFF_MAX,
+// with half of it randomised so a cabinet full of controllers does not retry in step
+#define DB_BACKOFF_INITIAL 250
+#define DB_BACKOFF_MAX 30000
+// Time a scan has to be answered in, from the frame arriving to cardScanned() returning.
+// The server stops statements that run longer on its own
+#define DB_AUTH_DEADLINE 1500
+// A query still running this long past its deadline has its socket cut, the server or
+// the network has stopped answering and nothing else would get it back
+#define DB_DEADLINE_GRACE 250
+size_t db_pool_size = DB_CONNECTION_COUNT;
+
+typedef enum _access_format {
+  // "cardScanned"() returns text, one '0'/'1' character per position
+  ACCESS_FORMAT_TEXT,
+  // "cardScannedBitmap"() returns bytea, position i is bit i % 8 of byte i / 8
+  ACCESS_FORMAT_BITMAP
+} access_format;
+
+access_format auth_access_format = ACCESS_FORMAT_TEXT;
+// Answers that did not cover exactly num_hardware_positions, the cabinet in the
+// database and the chain disagree on how many positions there are
+atomic<unsigned long> access_length_mismatches{0};
+// Answers that were null or not in auth_access_format, taken as no access
+atomic<unsigned long> access_unreadable{0};
+
+// How a cardScanned() call ended, only an unreachable server counts against the breaker
+typedef enum _db_call_result {
+  // The server answered, an answer that could not be read opens nothing
+  DB_CALL_ANSWERED,
+  // The server is up but the call raised an error, nothing was answered
+  DB_CALL_FAILED,
+  // Cut at its deadline, by the server's statement_timeout or the watchdog, or the
+  // connection was lost
+  DB_CALL_UNREACHABLE
+} db_call_result;
+// Guards the slot flags and _free_connections, _connections is sized once before any thread uses it
+mutex _pool_mutex;
+condition_variable _pool_available;
+// Wakes the pool maintenance loop early when a caller found no idle connection
+int _pool_grow_event_fd = -1;
+bool _pool_grow_requested = false;
+vector<size_t> _free_connections;
+string _connection_string;
 long cabinetid = 0;
+// Read once at startup, it never changes while running
+string controller_serial_number;
+
+// Pool health, connections found dead, connections brought back and total time with none usable
+atomic<unsigned long> db_connections_lost{0};
+atomic<unsigned long> db_reconnects{0};
+atomic<unsigned long> db_pool_unavailable_ms{0};
+chrono::steady_clock::time_point _pool_unavailable_since;
+bool _pool_unavailable = false;
+// Set by the first connection to open, the pool only grows past the startup connections after that
+bool _pool_serving = false;
+chrono::milliseconds db_auth_deadline(DB_AUTH_DEADLINE);
+// Queries whose socket the watchdog had to cut
+atomic<unsigned long> db_queries_cut{0};
+
+// Milliseconds, anything that is not a positive number leaves it as is
+bool SetAuthDeadline(const char *deadline) {
+  if (deadline == NULL) return false;
+  char *end;
+  long ms = strtol(deadline, &end, 10);
+  if (*deadline == '\0' || *end != '\0' || ms <= 0) return false;
+  db_auth_deadline = chrono::milliseconds(ms);
+  return true;
+}
+
+// Cuts the socket of a watched query that is still running DB_DEADLINE_GRACE past its
+// deadline. The blocked call then fails at once and the connection goes to repair.
+// Only shutdown() is used, PQcancel would open a connection to the same server that
+// is not answering and could block the watchdog for as long
+class query_watchdog {
+ public:
+  void Start() {
+    stopping = false;
+    worker = thread(&query_watchdog::Run, this);
+  }
+
+  void Stop() {
+    {
+      lock_guard<mutex> lock(watch_mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+
+  uint64_t Watch(int socket, chrono::steady_clock::time_point deadline) {
+    uint64_t id;
+    {
+      lock_guard<mutex> lock(watch_mutex);
+      id = next_id++;
+      watched[id] = { socket, deadline + chrono::milliseconds(DB_DEADLINE_GRACE) };
+    }
+    wake.notify_one();
+    return id;
+  }
+
+  // Once this returns the socket is no longer touched, the connection can be handed on
+  void Unwatch(uint64_t id) {
+    lock_guard<mutex> lock(watch_mutex);
+    watched.erase(id);
+  }
+
+ private:
+  void Run() {
+    unique_lock<mutex> lock(watch_mutex);
+    while (!stopping) {
+      auto now = chrono::steady_clock::now();
+      auto next = chrono::steady_clock::time_point::max();
+      for (auto entry = watched.begin(); entry != watched.end();) {
+        if (entry->second.second <= now) {
+          shutdown(entry->second.first, SHUT_RDWR);
+          db_queries_cut++;
+          entry = watched.erase(entry);
+          continue;
+        }
+        next = min(next, entry->second.second);
+        entry++;
+      }
+      if (watched.empty()) {
+        wake.wait(lock);
+      } else {
+        wake.wait_until(lock, next);
+      }
+    }
+  }
 
+  mutex watch_mutex;
+  condition_variable wake;
+  // Socket and when to cut it by watch id
+  map<uint64_t, pair<int, chrono::steady_clock::time_point>> watched;
+  uint64_t next_id = 0;
+  bool stopping = false;
+  thread worker;
+};
+
+query_watchdog db_watchdog;
+
+// Watches the query run on conn while it is in scope
+class db_deadline {
+ public:
+  db_deadline(connection *conn, chrono::steady_clock::time_point deadline) : id(db_watchdog.Watch(conn->sock(), deadline)) {}
+  ~db_deadline() {
+    db_watchdog.Unwatch(id);
+  }
+
+ private:
+  uint64_t id;
+};
+
+// Every pooled connection prepares these once when it connects, so scans only send the statement name and parameters
+#define STATEMENT_CABINET_ID "cabinet_id"
+#define STATEMENT_CABINET_POSITION_COUNT "cabinet_position_count"
+#define STATEMENT_CARD_SCANNED "card_scanned"
+#define STATEMENT_CARDS_SCANNED "cards_scanned"
+
+void PrepareStatements(connection *conn) noexcept(false) {
+  string card_scanned = auth_access_format == ACCESS_FORMAT_BITMAP ? "\"cardScannedBitmap\"" : "\"cardScanned\"";
+  conn->prepare(STATEMENT_CABINET_ID, "select cabinetid from cabinet where controller_serialno = $1");
+  conn->prepare(STATEMENT_CABINET_POSITION_COUNT, "select count(1) from cabinet c join position p on p.cabinetid = c.cabinetid where c.cabinetid = $1");
+  conn->prepare(STATEMENT_CARD_SCANNED, "select " + card_scanned + "($1, $2)");
+  // One row per code, in the order the codes were given
+  conn->prepare(STATEMENT_CARDS_SCANNED, "select " + card_scanned + "($1, scan.code) from unnest($2::text[]) with ordinality as scan(code, n) order by scan.n");
+}
+
+// Builds the connection string and the empty slots, nothing is connected yet.
+// Must run before any other pool function and before any thread uses the pool
 void InitializeConnectionPools(void) noexcept(true) {
   string connection_string = "host=";
   try {
@@ -31,47 +221,344 @@ void InitializeConnectionPools(void) noexcept(true) {
     connection_string = "host=localhost dbname=simsafe user=postgres password=postgres";
   }
 
-  cout << "Connecting to database..." << endl;
+  // Let the kernel notice a dead server or a pulled cable on idle connections, and
+  // never let one unreachable host hold a connect attempt for longer than a few seconds
+  connection_string.append(" keepalives=1 keepalives_idle=10 keepalives_interval=5 keepalives_count=3 connect_timeout=5");
+  _connection_string = connection_string;
 
-  bool connected = false;
-  _connections.get()->clear();
+  controller_serial_number = getenv("CONTROLLER_SERIAL_NUMBER");
 
-  for (long unsigned int i = 0; i < DB_CONNECTION_COUNT; i++) {
-    connected = false;
-    while (!connected) {
-      try {
-        _connections.get()->push_back(db_connection {
-          .conn = connection(connection_string),
-          .in_use = false
-        }); 
-        connected = true;
-      } catch (exception const &e) {
-        cout << "Failed to connect to database: " << e.what() << "Retrying in 5 seconds..." << endl;
-        this_thread::sleep_for(chrono::seconds(5));
-      }
-    }
+  if (getenv("DATABASE_POOL_SIZE") != NULL && atoi(getenv("DATABASE_POOL_SIZE")) > 0) {
+    db_pool_size = atoi(getenv("DATABASE_POOL_SIZE"));
   }
 
-  cout << "Database connection successful!" << endl;
+  if (_pool_grow_event_fd < 0) {
+    _pool_grow_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  }
+
+  lock_guard<mutex> lock(_pool_mutex);
+  _connections.get()->clear();
+  _connections.get()->resize(db_pool_size);
+  _free_connections.clear();
+  _free_connections.reserve(db_pool_size);
 }
 
 void CloseConnectionPool(void) noexcept(true) {
   for (long unsigned int i = 0; i < _connections.get()->size(); i++) {
     try {
-      _connections.get()->at(i).conn.close();
+      if (_connections.get()->at(i).conn != NULL) {
+        _connections.get()->at(i).conn->close();
+      }
     } catch (exception const &e) {}
   }
 }
 
-db_connection* FetchConnection(void) {
-  for (long unsigned int i = 0; i < _connections.get()->size(); i++) {
-    if (!_connections.get()->at(i).in_use) {
-      _connections.get()->at(i).in_use = true;
-      return &_connections.get()->at(i);
+chrono::milliseconds ConnectBackoff(unsigned int failed_attempts) {
+  thread_local minstd_rand random(random_device{}());
+  long ceiling = DB_BACKOFF_INITIAL << min(failed_attempts, 16U);
+  ceiling = min(ceiling, (long)DB_BACKOFF_MAX);
+  return chrono::milliseconds(ceiling / 2 + uniform_int_distribution<long>(0, ceiling / 2)(random));
+}
+
+// Claims a slot that needs opening and whose backoff has run out, only one thread
+// may be connecting a slot at a time
+bool ClaimSlot(size_t index, chrono::steady_clock::time_point now) {
+  lock_guard<mutex> lock(_pool_mutex);
+  db_connection *slot = &_connections.get()->at(index);
+  if (slot->connecting || slot->in_use || (slot->conn != NULL && !slot->broken) || now < slot->next_attempt) {
+    return false;
+  }
+  slot->connecting = true;
+  return true;
+}
+
+void UnclaimSlot(size_t index) {
+  lock_guard<mutex> lock(_pool_mutex);
+  _connections.get()->at(index).connecting = false;
+}
+
+// One connect attempt on a claimed slot. On success the connection goes straight into
+// the free list, on failure the slot's next attempt is pushed back by the backoff
+bool OpenSlot(size_t index) noexcept(true) {
+  db_connection *slot = &_connections.get()->at(index);
+  unique_ptr<connection> conn;
+
+  try {
+    // Pooled connections only run short lookups, the server stops anything that runs
+    // past a scan's deadline. The other connections run long queries and do without
+    conn = make_unique<connection>(_connection_string + " options='-c statement_timeout=" + to_string(db_auth_deadline.count()) + " -c bytea_output=hex'");
+    db_deadline watch(conn.get(), chrono::steady_clock::now() + db_auth_deadline);
+    PrepareStatements(conn.get());
+  } catch (exception const &e) {
+    lock_guard<mutex> lock(_pool_mutex);
+    auto delay = ConnectBackoff(slot->failed_attempts++);
+    slot->next_attempt = chrono::steady_clock::now() + delay;
+    cout << "Failed to connect database connection " << index << ": " << e.what()
+         << "Retrying in " << delay.count() << "ms..." << endl;
+    return false;
+  }
+
+  bool reconnected;
+  {
+    lock_guard<mutex> lock(_pool_mutex);
+    reconnected = slot->broken;
+    // The dead connection is swapped out so it is freed after the lock is dropped
+    slot->conn.swap(conn);
+    slot->broken = false;
+    slot->failed_attempts = 0;
+    _pool_serving = true;
+    _free_connections.push_back(index);
+  }
+  _pool_available.notify_one();
+
+  if (reconnected) {
+    db_reconnects++;
+    cout << "Database connection " << index << " reconnected" << endl;
+  } else {
+    cout << "Database connection " << index << " opened" << endl;
+  }
+  return true;
+}
+
+// Keeps trying to open the slot until it connects or shutdown_fd becomes readable,
+// sleeping out the backoff between attempts
+bool ConnectWithBackoff(size_t index, int shutdown_fd) noexcept(true) {
+  struct pollfd shutdown_poll;
+  shutdown_poll.fd = shutdown_fd;
+  shutdown_poll.events = POLLIN;
+
+  while (true) {
+    if (ClaimSlot(index, chrono::steady_clock::now())) {
+      bool opened = OpenSlot(index);
+      UnclaimSlot(index);
+      if (opened) {
+        return true;
+      }
+    }
+
+    chrono::steady_clock::time_point next_attempt;
+    {
+      lock_guard<mutex> lock(_pool_mutex);
+      db_connection *slot = &_connections.get()->at(index);
+      // Someone else opened it in the meantime
+      if (slot->conn != NULL && !slot->broken) {
+        return true;
+      }
+      next_attempt = slot->next_attempt;
+    }
+
+    auto wait = chrono::ceil<chrono::milliseconds>(next_attempt - chrono::steady_clock::now());
+    if (poll(&shutdown_poll, 1, max(wait.count(), 1L)) > 0) {
+      return false;
+    }
+  }
+}
+
+// Starts opening the first DB_STARTUP_CONNECTIONS slots side by side. Each goes into
+// service the moment it connects, so the pool serves as soon as the first one is up.
+// The connectors return once connected or on shutdown, the caller joins them
+vector<thread> StartStartupConnectors(int shutdown_fd) noexcept(true) {
+  vector<thread> connectors;
+  for (size_t i = 0; i < min((size_t)DB_STARTUP_CONNECTIONS, db_pool_size); i++) {
+    connectors.emplace_back(ConnectWithBackoff, i, shutdown_fd);
+  }
+  return connectors;
+}
+
+// Checked out connection, goes back to the pool when the lease is destroyed
+class db_lease {
+ public:
+  db_lease() : slot(NULL), index(0) {}
+  db_lease(db_connection *slot, size_t index) : slot(slot), index(index) {}
+  db_lease(db_lease &&other) : slot(other.slot), index(other.index) {
+    other.slot = NULL;
+  }
+  db_lease &operator=(db_lease &&other) {
+    if (this != &other) {
+      Release();
+      slot = other.slot;
+      index = other.index;
+      other.slot = NULL;
     }
+    return *this;
+  }
+  db_lease(const db_lease &) = delete;
+  db_lease &operator=(const db_lease &) = delete;
+
+  ~db_lease() {
+    Release();
+  }
+
+  db_connection *operator->() const {
+    return slot;
+  }
+
+  explicit operator bool() const {
+    return slot != NULL;
   }
 
-  return NULL;
+  void Release() {
+    if (slot == NULL) {
+      return;
+    }
+    // A connection that died under its user goes to repair instead of the next caller
+    bool alive = slot->conn->is_open();
+    {
+      lock_guard<mutex> lock(_pool_mutex);
+      slot->in_use = false;
+      if (alive) {
+        _free_connections.push_back(index);
+      } else {
+        slot->broken = true;
+        db_connections_lost++;
+      }
+    }
+    if (alive) {
+      _pool_available.notify_one();
+    }
+    slot = NULL;
+  }
+
+ private:
+  db_connection *slot;
+  size_t index;
+};
+
+// Waits up to timeout for an idle connection, the lease is empty if none came free.
+// Having to wait at all asks the maintenance loop to open another slot
+db_lease FetchConnection(chrono::milliseconds timeout = chrono::milliseconds(DB_FETCH_TIMEOUT)) {
+  trace_scope trace(TRACE_DB_CHECKOUT);
+  unique_lock<mutex> lock(_pool_mutex);
+  if (_free_connections.empty() && _pool_serving && !_pool_grow_requested) {
+    _pool_grow_requested = true;
+    eventfd_write(_pool_grow_event_fd, 1);
+  }
+  if (!_pool_available.wait_for(lock, timeout, [] { return !_free_connections.empty(); })) {
+    return db_lease();
+  }
+
+  size_t index = _free_connections.back();
+  _free_connections.pop_back();
+  db_connection *slot = &_connections.get()->at(index);
+  slot->in_use = true;
+  return db_lease(slot, index);
+}
+
+// Local check on an idle connection's socket, no round trip to the server.
+// A readable socket is not dead by itself, the server also sends a changed setting or a
+// notice to idle sessions. Whatever is there is read off, and only end of file or a read
+// error leaves the connection closed
+bool IsConnectionAlive(connection *conn) noexcept(true) {
+  try {
+    if (!conn->is_open()) {
+      return false;
+    }
+
+    struct pollfd socket_poll;
+    socket_poll.fd = conn->sock();
+    socket_poll.events = POLLIN;
+    if (socket_poll.fd < 0 || poll(&socket_poll, 1, 0) < 0) {
+      return false;
+    }
+    if (socket_poll.revents == 0) {
+      return true;
+    }
+
+    // PQconsumeInput underneath, throws broken_connection once the server has hung up
+    conn->get_notifs();
+    return conn->is_open();
+  } catch (exception const &e) {
+    return false;
+  }
+}
+
+// Moves every idle connection that fails IsConnectionAlive out of the free list
+void ProbeIdleConnections(void) noexcept(true) {
+  lock_guard<mutex> lock(_pool_mutex);
+  for (size_t i = 0; i < _free_connections.size();) {
+    db_connection *slot = &_connections.get()->at(_free_connections[i]);
+    if (IsConnectionAlive(slot->conn.get())) {
+      i++;
+      continue;
+    }
+    slot->broken = true;
+    db_connections_lost++;
+    _free_connections.erase(_free_connections.begin() + i);
+  }
+}
+
+// Sleeps up to timeout, returning early when a caller has asked for the pool to grow.
+// False once shutdown_fd is readable, the maintenance loop stops then
+bool WaitForPoolMaintenance(int shutdown_fd, chrono::milliseconds timeout) {
+  struct pollfd fds[2];
+  fds[0].fd = _pool_grow_event_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = shutdown_fd;
+  fds[1].events = POLLIN;
+  if (poll(fds, 2, timeout.count()) < 0 && errno != EINTR) {
+    return true;
+  }
+
+  if (fds[1].revents & POLLIN) {
+    return false;
+  }
+  if (fds[0].revents & POLLIN) {
+    eventfd_t event_count;
+    eventfd_read(_pool_grow_event_fd, &event_count);
+  }
+  return true;
+}
+
+// Reconnects broken connections one at a time while the healthy ones keep serving, and
+// opens one more slot if a caller had to wait for a connection since the last call.
+// Broken and unopened slots are neither leased nor free, so nothing else touches them meanwhile
+void RepairBrokenConnections(void) noexcept(true) {
+  size_t healthy = 0;
+  bool grow, serving;
+  {
+    lock_guard<mutex> lock(_pool_mutex);
+    serving = _pool_serving;
+    grow = _pool_grow_requested;
+    _pool_grow_requested = false;
+  }
+
+  auto now = chrono::steady_clock::now();
+  for (size_t i = 0; i < _connections.get()->size(); i++) {
+    bool unopened;
+    {
+      lock_guard<mutex> lock(_pool_mutex);
+      db_connection *slot = &_connections.get()->at(i);
+      if (slot->conn != NULL && !slot->broken) {
+        healthy++;
+        continue;
+      }
+      unopened = slot->conn == NULL;
+    }
+
+    if ((unopened && !grow) || !ClaimSlot(i, now)) {
+      continue;
+    }
+    if (OpenSlot(i)) {
+      healthy++;
+    }
+    UnclaimSlot(i);
+    if (unopened) {
+      grow = false;
+    }
+  }
+
+  // Time before the very first connection is boot time, not an outage
+  now = chrono::steady_clock::now();
+  if (healthy == 0 && serving && !_pool_unavailable) {
+    cout << "No database connections available" << endl;
+    _pool_unavailable = true;
+    _pool_unavailable_since = now;
+  } else if (healthy > 0 && _pool_unavailable) {
+    auto unavailable = chrono::duration_cast<chrono::milliseconds>(now - _pool_unavailable_since);
+    cout << "Database available again after " << unavailable.count() << "ms" << endl;
+    db_pool_unavailable_ms += unavailable.count();
+    _pool_unavailable = false;
+  }
 }
 
 bool DoesCabinetExist(connection *conn) noexcept(true) {
@@ -82,7 +569,7 @@ bool DoesCabinetExist(connection *conn) noexcept(true) {
 
   try {
     work tx{*conn};
-    tx.query_value<int>("select cabinetid from cabinet where controller_serialno = " + tx.quote(getenv("CONTROLLER_SERIAL_NUMBER")));
+    tx.exec(prepped{STATEMENT_CABINET_ID}, params{controller_serial_number}).one_field();
   } catch (exception const &e) {
     return false;
   }
@@ -97,7 +584,7 @@ void ReadCabinetIdIntoGlobal(connection *conn) {
 
   try {
     work tx{*conn};
-    cabinetid = tx.query_value<long>("select cabinetid from cabinet where controller_serialno = " + tx.quote(getenv("CONTROLLER_SERIAL_NUMBER")));
+    cabinetid = tx.exec(prepped{STATEMENT_CABINET_ID}, params{controller_serial_number}).one_field().as<long>();
   } catch (exception const &e) {}
 }
 
@@ -108,7 +595,7 @@ bool DoesCabinetPositionMatchHardwarePositionCount(connection *conn) noexcept(tr
 
   try {
     work tx{*conn};
-    HARDWARE_POSITIONS_TYPE count = tx.query_value<u_int32_t>("select count(1) from cabinet c join position p on p.cabinetid = c.cabinetid where c.cabinetid = " + to_string(cabinetid));
+    HARDWARE_POSITIONS_TYPE count = tx.exec(prepped{STATEMENT_CABINET_POSITION_COUNT}, params{cabinetid}).one_field().as<u_int32_t>();
     if (count != num_hardware_positions) return false;
   } catch (exception const &e) {
     return false;
@@ -117,49 +604,189 @@ bool DoesCabinetPositionMatchHardwarePositionCount(connection *conn) noexcept(tr
   return true;
 }
 
-void CreatePositionOpenedEvent(connection *conn, u_int16_t index) noexcept(false) {
-  if (conn == NULL || index < 1) {
+// "text" or "bitmap", bitmap needs "cardScannedBitmap" on the server
+bool SetAccessFormat(const char *format) {
+  if (format == NULL) return false;
+  if (strcmp(format, "text") == 0) {
+    auth_access_format = ACCESS_FORMAT_TEXT;
+  } else if (strcmp(format, "bitmap") == 0) {
+    auth_access_format = ACCESS_FORMAT_BITMAP;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Value of every hex digit, 0xff for any other character
+constexpr array<uint8_t, 256> HEX_DIGITS = [] {
+  array<uint8_t, 256> digits;
+  digits.fill(0xff);
+  for (uint8_t i = 0; i < 10; i++) digits['0' + i] = i;
+  for (uint8_t i = 0; i < 6; i++) digits['a' + i] = digits['A' + i] = 10 + i;
+  return digits;
+}();
+
+// Both formats drop anything past the chain's positions and leave the positions they
+// do not cover closed. Access is put together a word at a time and stored with one
+// SetWord per 64 positions
+
+// One '0'/'1' per position, empty when the code opens nothing and output is left untouched
+void ReadAccessText(string_view text, size_t chain_positions, position_word *output) {
+  if (text.empty()) {
     return;
   }
+  if (text.size() != chain_positions) {
+    access_length_mismatches++;
+  }
 
-  work tx{*conn};
-  tx.exec("call \"eventInsertPositionOpened\"(" + tx.quote(getenv("CONTROLLER_SERIAL_NUMBER")) + "," + to_string(index) + ")");
-  tx.commit();
+  size_t positions = min(text.size(), chain_positions);
+  output->Clear();
+  for (size_t w = 0; w * 64 < positions; w++) {
+    const char *characters = text.data() + w * 64;
+    size_t count = min((size_t)64, positions - w * 64);
+    uint64_t word = 0;
+    for (size_t b = 0; b < count; b++) {
+      word |= (uint64_t)(characters[b] == '1') << b;
+    }
+    output->SetWord(w, word);
+  }
 }
 
-void CreatePositionClosedEvent(connection *conn, u_int16_t index) noexcept(false) {
-  if (conn == NULL || index < 1) {
-    return;
+// bytea in hex output, "\x" then two digits per byte. With position i in bit i % 8 of
+// byte i / 8, every 8 bytes are one little endian word of the position word. An empty
+// bitmap opens nothing and output is left untouched. Returns false when it is not a
+// hex bytea, output is left as is then
+bool ReadAccessBitmap(string_view text, size_t chain_positions, position_word *output) {
+  if (text.size() < 2 || text[0] != '\\' || text[1] != 'x' || text.size() % 2 != 0) {
+    return false;
+  }
+
+  const char *hex = text.data() + 2;
+  size_t bytes = (text.size() - 2) / 2;
+  if (bytes == 0) {
+    return true;
+  }
+  size_t expected = (chain_positions + 7) / 8;
+  if (bytes != expected) {
+    access_length_mismatches++;
+  }
+  bytes = min(bytes, expected);
+
+  position_word access;
+  for (size_t w = 0; w * 8 < bytes; w++) {
+    size_t count = min((size_t)8, bytes - w * 8);
+    uint64_t word = 0;
+    for (size_t b = 0; b < count; b++) {
+      const char *digits = hex + (w * 8 + b) * 2;
+      uint8_t high = HEX_DIGITS[(uint8_t)digits[0]], low = HEX_DIGITS[(uint8_t)digits[1]];
+      if ((high | low) > 0xf) {
+        return false;
+      }
+      word |= (uint64_t)(high << 4 | low) << (b * 8);
+    }
+    access.SetWord(w, word);
+  }
+
+  // The last byte can carry bits past the end of the chain
+  if (chain_positions % 64 != 0) {
+    size_t last = chain_positions / 64;
+    access.SetWord(last, access.Word(last) & ((1ULL << (chain_positions % 64)) - 1));
   }
 
-  work tx{*conn};
-  tx.exec("call \"eventInsertPositionClosed\"(" + tx.quote(getenv("CONTROLLER_SERIAL_NUMBER")) + "," + to_string(index) + ")");
-  tx.commit();
+  *output = access;
+  return true;
 }
 
-vector<bool> *AuthCardScanned(connection *conn, const char *auth_code, int length, vector<bool> *output) noexcept(true) {
-  if (conn == NULL || output == NULL || length < 1) {
-    return output;
+// Reads access in auth_access_format, an answer that cannot be read opens nothing
+void ReadAccess(const field &access, position_word *output) {
+  bool read;
+  if (access.is_null()) {
+    read = false;
+  } else if (auth_access_format == ACCESS_FORMAT_BITMAP) {
+    read = ReadAccessBitmap(access.view(), num_hardware_positions, output);
+  } else {
+    ReadAccessText(access.view(), num_hardware_positions, output);
+    read = true;
+  }
+  if (!read) {
+    access_unreadable++;
+    output->Clear();
   }
+}
 
-  char buffer[513] = {0};
+// A call that was cut or lost its connection, as opposed to one the server refused
+db_call_result ClassifyFailure(connection *conn, exception const &e) {
+  if (!conn->is_open() || dynamic_cast<const broken_connection*>(&e) != NULL || dynamic_cast<const query_canceled*>(&e) != NULL) {
+    return DB_CALL_UNREACHABLE;
+  }
+  return DB_CALL_FAILED;
+}
 
-  memcpy(buffer, auth_code, length);
+// Output is only touched when the server answered. A code with no access is an
+// answer, output is left untouched then
+db_call_result AuthCardScanned(connection *conn, const char *auth_code, int length, position_word *output, chrono::steady_clock::time_point deadline) noexcept(true) {
+  if (conn == NULL || output == NULL) {
+    return DB_CALL_FAILED;
+  }
+  if (length < 1) {
+    return DB_CALL_ANSWERED;
+  }
 
   try {
+    trace_scope trace(TRACE_DB_CARD_SCANNED);
+    db_deadline watch(conn, deadline);
     work tx{*conn};
-    string access_string = tx.query_value<string>("select \"cardScanned\"(" + tx.quote(getenv("CONTROLLER_SERIAL_NUMBER")) + "," + tx.quote(buffer) + ")");
+    result access = tx.exec(prepped{STATEMENT_CARD_SCANNED}, params{controller_serial_number, string_view(auth_code, length)});
     tx.commit();
-  
-    if (access_string.empty()) {
-      return output;
+
+    ReadAccess(access.one_field(), output);
+  } catch (exception const &e) {
+    return ClassifyFailure(conn, e);
+  }
+
+  return DB_CALL_ANSWERED;
+}
+
+// cardScanned() for every code in one round trip and one transaction, outputs[i] gets
+// codes[i]'s access. Outputs are only touched when the server answered for every code
+db_call_result AuthCardsScanned(connection *conn, const vector<string> &codes, position_word **outputs, chrono::steady_clock::time_point deadline) noexcept(true) {
+  if (conn == NULL) {
+    return DB_CALL_FAILED;
+  }
+
+  try {
+    trace_scope trace(TRACE_DB_CARD_SCANNED);
+    db_deadline watch(conn, deadline);
+    work tx{*conn};
+    result rows = tx.exec(prepped{STATEMENT_CARDS_SCANNED}, params{controller_serial_number, codes});
+    if (rows.size() != codes.size()) {
+      return DB_CALL_FAILED;
     }
-  
-    for (size_t i = 0; i < access_string.length(); i++) {
-      output->at(i) = access_string[i] == '1';
+    tx.commit();
+
+    for (size_t i = 0; i < codes.size(); i++) {
+      ReadAccess(rows[i][0], outputs[i]);
     }
-  } catch (exception const &e) {}
+  } catch (exception const &e) {
+    return ClassifyFailure(conn, e);
+  }
+
+  return DB_CALL_ANSWERED;
+}
 
+// Cheapest round trip there is, false when the server did not answer by deadline
+bool PingDatabase(connection *conn, chrono::steady_clock::time_point deadline) noexcept(true) {
+  if (conn == NULL) {
+    return false;
+  }
 
-  return output;
-}
\ No newline at end of file
+  try {
+    db_deadline watch(conn, deadline);
+    nontransaction tx{*conn};
+    tx.exec("select 1");
+  } catch (exception const &e) {
+    return false;
+  }
+
+  return true;
+}
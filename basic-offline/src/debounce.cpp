@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <bit>
+#include <stdint.h>
+
+using namespace std;
+
+// Counter planes, the longest settle time is (1 << DEBOUNCE_MAX_PLANES) - 1 samples
+#define DEBOUNCE_MAX_PLANES 8
+
+// Debounces 64 positions per word with vertical counters. Plane j holds bit j of every
+// input's counter, so one pass of bitwise ops over the planes counts all 64 at once.
+// An input's counter runs while its raw level differs from its debounced level and
+// resets as soon as they agree, the debounced level only flips once the raw level has
+// held for settle_samples samples in a row. Cost per sample is a few ops per plane
+// per word, whatever the inputs are doing
+class vertical_debouncer {
+ public:
+  explicit vertical_debouncer(unsigned int settle_samples = 1) {
+    SetSettleSamples(settle_samples);
+  }
+
+  // 0 and 1 pass every sample straight through
+  void SetSettleSamples(unsigned int settle_samples) {
+    settle = min(settle_samples, (1U << DEBOUNCE_MAX_PLANES) - 1);
+    planes = bit_width(settle);
+  }
+
+  unsigned int SettleSamples() const {
+    return settle;
+  }
+
+  // Starts from these levels as already settled
+  void Reset(const position_word *raw) {
+    state = *raw;
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+      counters[i] = 0;
+    }
+  }
+
+  // Replaces the raw sample in words with the debounced levels
+  void Filter(position_word *words) {
+    if (settle <= 1) {
+      return;
+    }
+
+    for (size_t w = 0; w < position_word::WORD_COUNT; w++) {
+      uint64_t *counter = &counters[w * DEBOUNCE_MAX_PLANES];
+      uint64_t level = state.Word(w);
+      uint64_t differs = words->Word(w) ^ level;
+
+      // Count up where the raw level differs, back to zero where it agrees
+      uint64_t carry = differs;
+      for (unsigned int j = 0; j < planes; j++) {
+        uint64_t sum = (counter[j] & differs) ^ carry;
+        carry &= counter[j];
+        counter[j] = sum;
+      }
+
+      // Inputs whose counter just reached settle take the raw level and start over
+      uint64_t settled = differs;
+      for (unsigned int j = 0; j < planes; j++) {
+        settled &= (settle >> j) & 1 ? counter[j] : ~counter[j];
+      }
+      level ^= settled;
+      for (unsigned int j = 0; j < planes; j++) {
+        counter[j] &= ~settled;
+      }
+
+      state.SetWord(w, level);
+      words->SetWord(w, level);
+    }
+  }
+
+ private:
+  unsigned int settle = 1;
+  unsigned int planes = 1;
+  position_word state;
+  uint64_t counters[position_word::WORD_COUNT * DEBOUNCE_MAX_PLANES] = {};
+};
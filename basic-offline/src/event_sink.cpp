@@ -0,0 +1,464 @@
+#include <iostream>
+#include <deque>
+#include <set>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <libpq-fe.h>
+#include "journal.cpp"
+
+using namespace std;
+
+// Position events are written by their own thread on their own connection in libpq
+// pipeline mode. Producers only append to the on-disk journal, the sink reads it back,
+// keeps sending without waiting for replies and matches the replies up as they come
+// back. Only once an event is committed does the journal's flushed cursor move past it,
+// so events survive the database being away, a crash or a power cut and are sent again
+// on the next start. Delivery is at least once: an event committed just before a crash
+// whose cursor had not reached the disk yet is sent a second time
+//
+// The server side this expects:
+//   "eventInsertPositionOpened"(serialno, position, happened_at timestamptz) and
+//   "eventInsertPositionClosed" with the same arguments, happened_at being when the
+//     edge was sampled rather than when it reached the database
+// Procedures deployed before happened_at was added take only (serialno, position). The
+// sink finds that out when it prepares the calls and leaves the time to the database
+
+// Events read out of the journal and held in memory at once
+#define EVENT_SINK_QUEUE_SIZE 1024
+// Events sent between two syncs run as one implicit transaction, so they commit or
+// roll back together and are only acknowledged once their sync comes back. Only one
+// batch is in flight at a time: a failed batch is sent again before anything after it,
+// so an opened is never written after its closed
+#define EVENT_SINK_BATCH_SIZE 64
+// How long shutdown waits for events that are already queued or sent
+#define EVENT_SINK_DRAIN_TIMEOUT 1000
+// New records and the cursor are synced to disk at most this often
+#define EVENT_JOURNAL_SYNC_PERIOD 100
+
+#define STATEMENT_POSITION_OPENED "position_opened"
+#define STATEMENT_POSITION_CLOSED "position_closed"
+
+typedef enum _position_event_type {
+  POSITION_EVENT_OPENED,
+  POSITION_EVENT_CLOSED
+} position_event_type;
+
+typedef struct _position_event {
+  uint64_t sequence;
+  position_event_type type;
+  // 1 based, the numbering the stored procedures use
+  u_int16_t position;
+  chrono::system_clock::time_point recorded_at;
+} position_event;
+
+journal<journal_record> event_journal;
+int event_sink_event_fd = -1;
+string event_sink_connection_string;
+string event_sink_serial_number;
+
+atomic<unsigned long> events_queued{0};
+// Journal was full, the database has been away for too long
+atomic<unsigned long> events_dropped{0};
+atomic<unsigned long> events_acked{0};
+// Rejected by the database, these are not retried
+atomic<unsigned long> events_failed{0};
+// Rolled back with their batch or lost with the connection and sent again
+atomic<unsigned long> events_resent{0};
+// Recorded to committed, replayed events include the time the controller was off
+latency_histogram event_ack_latency;
+
+int OpenEventSink(const string &connection_string, const string &serial_number, const char *journal_path, uint32_t journal_capacity) {
+  event_sink_connection_string = connection_string;
+  event_sink_serial_number = serial_number;
+  if (event_journal.Open(journal_path, journal_capacity)) {
+    return -1;
+  }
+  event_sink_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  return event_sink_event_fd < 0 ? -1 : 0;
+}
+
+void CloseEventSink() {
+  close(event_sink_event_fd);
+  event_sink_event_fd = -1;
+  event_journal.Close();
+}
+
+void PrintEventSinkStats() {
+  cout << "Position events: queued=" << events_queued << " acked=" << events_acked << " failed=" << events_failed
+       << " resent=" << events_resent << " dropped=" << events_dropped << " lost=" << event_journal.Lost() << endl;
+  PrintHistogram("Event recorded to committed", &event_ack_latency);
+}
+
+// Never blocks or touches the disk, safe to call from the GPIO thread. Returns false
+// when the event was dropped. happened_at is when the edge was sampled, it is stored
+// as wall clock time so replays after a restart keep the right time
+bool QueuePositionEvent(position_event_type type, u_int16_t position, chrono::steady_clock::time_point happened_at) {
+  auto recorded_at = chrono::duration_cast<chrono::nanoseconds>(
+    chrono::system_clock::now().time_since_epoch() - (chrono::steady_clock::now() - happened_at));
+
+  journal_record record = {
+    .sequence = 0,
+    .recorded_at = recorded_at.count(),
+    .type = (uint16_t)type,
+    .position = position,
+    .reserved = 0,
+    .checksum = 0,
+    .padding = 0
+  };
+  if (!event_journal.Append(record)) {
+    events_dropped++;
+    return false;
+  }
+
+  events_queued++;
+  eventfd_write(event_sink_event_fd, 1);
+  return true;
+}
+
+typedef struct _event_sink_state {
+  PGconn *conn;
+  // Not sent yet, requeued events go back on the front
+  deque<position_event> pending;
+  // Sent and waiting for their own result, in the order they were sent
+  deque<position_event> in_flight;
+  // Succeeded but not acknowledged until the sync that ends their batch comes back
+  deque<position_event> batch_done;
+  // Skipped after a failure earlier in their batch, in the order they were sent
+  deque<position_event> batch_aborted;
+  // Next journal record to read
+  uint64_t next_read;
+  // Sequences read from the journal and not yet committed or given up on
+  set<uint64_t> outstanding;
+  // Journal head and cursor as of the last sync to disk
+  uint64_t synced_head;
+  uint64_t synced_flushed;
+  chrono::steady_clock::time_point next_journal_sync;
+  bool batch_failed;
+  // Arguments each prepared call takes, by position_event_type. 2 on a server whose
+  // procedures have no happened_at
+  int statement_params[2];
+  size_t unsynced;
+  size_t syncs_outstanding;
+  unsigned int failed_attempts;
+  chrono::steady_clock::time_point next_attempt;
+} event_sink_state;
+
+void RequeueEvents(event_sink_state *sink, deque<position_event> *events) {
+  events_resent += events->size();
+  sink->pending.insert(sink->pending.begin(), events->begin(), events->end());
+  events->clear();
+}
+
+// Everything sent on a lost connection may or may not have committed, it is sent again
+void DropEventSinkConnection(event_sink_state *sink) {
+  cout << "Event sink lost its database connection: " << PQerrorMessage(sink->conn);
+  // Each requeue goes in front of the last, so they end up in the order they were sent
+  RequeueEvents(sink, &sink->in_flight);
+  RequeueEvents(sink, &sink->batch_aborted);
+  RequeueEvents(sink, &sink->batch_done);
+  PQfinish(sink->conn);
+  sink->conn = NULL;
+  sink->batch_failed = false;
+  sink->unsynced = 0;
+  sink->syncs_outstanding = 0;
+  sink->next_attempt = chrono::steady_clock::now() + ConnectBackoff(sink->failed_attempts++);
+}
+
+bool ConnectEventSink(event_sink_state *sink) {
+  sink->conn = PQconnectdb(event_sink_connection_string.c_str());
+
+  bool ok = PQstatus(sink->conn) == CONNECTION_OK;
+  // By position_event_type, with happened_at and without it
+  const char *statements[][3] = {
+    { STATEMENT_POSITION_OPENED, "call \"eventInsertPositionOpened\"($1, $2, $3::timestamptz)", "call \"eventInsertPositionOpened\"($1, $2)" },
+    { STATEMENT_POSITION_CLOSED, "call \"eventInsertPositionClosed\"($1, $2, $3::timestamptz)", "call \"eventInsertPositionClosed\"($1, $2)" }
+  };
+  for (size_t i = 0; ok && i < 2; i++) {
+    PGresult *result = PQprepare(sink->conn, statements[i][0], statements[i][1], 3, NULL);
+    sink->statement_params[i] = 3;
+    const char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+    if (sqlstate != NULL && strcmp(sqlstate, "42883") == 0) {
+      PQclear(result);
+      result = PQprepare(sink->conn, statements[i][0], statements[i][2], 2, NULL);
+      sink->statement_params[i] = 2;
+      cout << "Event sink: " << statements[i][0] << " takes no happened_at on this server, the database times those events" << endl;
+    }
+    ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    PQclear(result);
+  }
+  ok = ok && PQenterPipelineMode(sink->conn) == 1 && PQsetnonblocking(sink->conn, 1) == 0;
+
+  if (!ok) {
+    auto delay = ConnectBackoff(sink->failed_attempts++);
+    cout << "Event sink failed to connect: " << PQerrorMessage(sink->conn) << "Retrying in " << delay.count() << "ms..." << endl;
+    PQfinish(sink->conn);
+    sink->conn = NULL;
+    sink->next_attempt = chrono::steady_clock::now() + delay;
+    return false;
+  }
+
+  sink->failed_attempts = 0;
+  cout << "Event sink connected" << endl;
+  return true;
+}
+
+// recorded_at as a UTC timestamptz literal to the microsecond
+void FormatEventTime(chrono::system_clock::time_point recorded_at, char *text, size_t size) {
+  auto micros = chrono::duration_cast<chrono::microseconds>(recorded_at.time_since_epoch()).count();
+  time_t seconds = micros / 1000000;
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  size_t length = strftime(text, size, "%Y-%m-%d %H:%M:%S", &utc);
+  snprintf(text + length, size - length, ".%06ld+00", (long)(micros % 1000000));
+}
+
+// Sends the next batch of pending events and its sync once the last batch's sync is back
+bool SendPendingEvents(event_sink_state *sink) {
+  string position;
+  char happened_at[40];
+  const char *values[3];
+  values[0] = event_sink_serial_number.c_str();
+
+  if (sink->syncs_outstanding > 0) {
+    return PQflush(sink->conn) >= 0;
+  }
+
+  while (!sink->pending.empty() && sink->unsynced < EVENT_SINK_BATCH_SIZE) {
+    position_event *event = &sink->pending.front();
+    position = to_string(event->position);
+    values[1] = position.c_str();
+    FormatEventTime(event->recorded_at, happened_at, sizeof(happened_at));
+    values[2] = happened_at;
+
+    const char *statement = event->type == POSITION_EVENT_OPENED ? STATEMENT_POSITION_OPENED : STATEMENT_POSITION_CLOSED;
+    if (!PQsendQueryPrepared(sink->conn, statement, sink->statement_params[event->type], values, NULL, NULL, 0)) {
+      return false;
+    }
+    sink->in_flight.push_back(*event);
+    sink->pending.pop_front();
+    sink->unsynced++;
+  }
+
+  // A part batch goes out straight away, events are not held back waiting for company
+  if (sink->unsynced > 0) {
+    if (!PQpipelineSync(sink->conn)) return false;
+    sink->syncs_outstanding++;
+    sink->unsynced = 0;
+  }
+
+  return PQflush(sink->conn) >= 0;
+}
+
+// Matches every result that has arrived to the event it belongs to. Results come back
+// in the order the events were sent, each followed by a NULL, and each batch ends in
+// a sync result. A failed event aborts the rest of its batch and rolls back the events
+// before it, so those are sent again while the failed one is given up on
+bool ReadEventResults(event_sink_state *sink) {
+  if (!PQconsumeInput(sink->conn)) {
+    return false;
+  }
+
+  // A NULL ends one event's results. A second one in a row means nothing more has
+  // arrived, libpq is not busy while it waits for a sync, so wait on the socket again
+  bool ended = false;
+  while (!PQisBusy(sink->conn)) {
+    PGresult *result = PQgetResult(sink->conn);
+    if (result == NULL) {
+      if (ended) break;
+      ended = true;
+      continue;
+    }
+    ended = false;
+
+    auto now = chrono::system_clock::now();
+    switch (PQresultStatus(result)) {
+      case PGRES_COMMAND_OK:
+      case PGRES_TUPLES_OK:
+        sink->batch_done.push_back(sink->in_flight.front());
+        sink->in_flight.pop_front();
+        break;
+      case PGRES_PIPELINE_ABORTED:
+        sink->batch_aborted.push_back(sink->in_flight.front());
+        sink->in_flight.pop_front();
+        break;
+      case PGRES_PIPELINE_SYNC:
+        if (sink->batch_failed) {
+          // Rolled back and skipped events go out again as one run, in the order they were
+          // first sent, so an opened is never written after its closed
+          sink->batch_done.insert(sink->batch_done.end(), sink->batch_aborted.begin(), sink->batch_aborted.end());
+          sink->batch_aborted.clear();
+          RequeueEvents(sink, &sink->batch_done);
+        }
+        for (auto &event : sink->batch_done) {
+          event_ack_latency.Record(now - event.recorded_at);
+          sink->outstanding.erase(event.sequence);
+        }
+        events_acked += sink->batch_done.size();
+        sink->batch_done.clear();
+        sink->batch_failed = false;
+        sink->syncs_outstanding--;
+        break;
+      default:
+        // An error with nothing left in flight is the batch failing to commit
+        if (!sink->in_flight.empty()) {
+          cout << "Position " << sink->in_flight.front().position << " event rejected: " << PQresultErrorMessage(result);
+          events_failed++;
+          sink->outstanding.erase(sink->in_flight.front().sequence);
+          sink->in_flight.pop_front();
+        }
+        sink->batch_failed = true;
+        break;
+    }
+    PQclear(result);
+  }
+
+  // The cursor can only pass events that are done with, the oldest outstanding one holds it back
+  event_journal.MarkFlushed(sink->outstanding.empty() ? sink->next_read : *sink->outstanding.begin());
+  return true;
+}
+
+// Reads journal records into pending until the in-memory limit
+void ReadJournal(event_sink_state *sink) {
+  journal_record record;
+  while (sink->pending.size() < EVENT_SINK_QUEUE_SIZE && event_journal.Next(&sink->next_read, &record)) {
+    sink->pending.push_back(position_event {
+      .sequence = record.sequence,
+      .type = (position_event_type)record.type,
+      .position = record.position,
+      .recorded_at = chrono::system_clock::time_point(chrono::duration_cast<chrono::system_clock::duration>(chrono::nanoseconds(record.recorded_at)))
+    });
+    sink->outstanding.insert(record.sequence);
+    sink->next_read++;
+  }
+}
+
+// Syncs new records and the moved cursor to disk, at most once per EVENT_JOURNAL_SYNC_PERIOD.
+// Returns the time of the next sync that is due, or max when nothing is waiting
+chrono::steady_clock::time_point SyncJournal(event_sink_state *sink, chrono::steady_clock::time_point now) {
+  uint64_t head = event_journal.Head();
+  uint64_t flushed = event_journal.Flushed();
+  if (head == sink->synced_head && flushed == sink->synced_flushed) {
+    return chrono::steady_clock::time_point::max();
+  }
+  if (now < sink->next_journal_sync) {
+    return sink->next_journal_sync;
+  }
+
+  if (event_journal.Sync()) {
+    cout << "Failed to sync the event journal: " << strerror(errno) << endl;
+  }
+  sink->synced_head = head;
+  sink->synced_flushed = flushed;
+  sink->next_journal_sync = now + chrono::milliseconds(EVENT_JOURNAL_SYNC_PERIOD);
+  return chrono::steady_clock::time_point::max();
+}
+
+// Exits when the shutdown eventfd passed as arg becomes readable, after giving the
+// events already journaled EVENT_SINK_DRAIN_TIMEOUT to be written. Whatever is left
+// stays in the journal for the next start
+void *EventSinkThreadTask(void *arg) {
+  int shutdown_fd = *(int*)arg;
+
+  event_sink_state sink = {
+    .conn = NULL,
+    .pending = deque<position_event>(),
+    .in_flight = deque<position_event>(),
+    .batch_done = deque<position_event>(),
+    .batch_aborted = deque<position_event>(),
+    .next_read = event_journal.Flushed(),
+    .outstanding = set<uint64_t>(),
+    .synced_head = event_journal.Head(),
+    .synced_flushed = event_journal.Flushed(),
+    .next_journal_sync = chrono::steady_clock::now(),
+    .batch_failed = false,
+    .statement_params = { 3, 3 },
+    .unsynced = 0,
+    .syncs_outstanding = 0,
+    .failed_attempts = 0,
+    .next_attempt = chrono::steady_clock::now()
+  };
+  eventfd_t event_count;
+  bool draining = false;
+  chrono::steady_clock::time_point drain_deadline;
+
+  struct pollfd fds[3];
+  fds[0].fd = event_sink_event_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = shutdown_fd;
+  fds[1].events = POLLIN;
+
+  while (true) {
+    auto now = chrono::steady_clock::now();
+
+    ReadJournal(&sink);
+
+    if (draining && (sink.outstanding.empty() || now >= drain_deadline)) {
+      break;
+    }
+
+    if (sink.conn == NULL && !draining && now >= sink.next_attempt) {
+      ConnectEventSink(&sink);
+    }
+
+    if (sink.conn != NULL && !SendPendingEvents(&sink)) {
+      DropEventSinkConnection(&sink);
+    }
+
+    // Sleep until the connection needs us, the next reconnect, the next journal sync or the end of the drain
+    auto wake = SyncJournal(&sink, now);
+    fds[2].fd = -1;
+    if (sink.conn != NULL) {
+      fds[2].fd = PQsocket(sink.conn);
+      fds[2].events = POLLIN;
+      // Whatever libpq could not write without blocking is still in its buffer
+      if (PQflush(sink.conn) == 1) {
+        fds[2].events |= POLLOUT;
+      }
+    } else if (!draining) {
+      wake = min(wake, sink.next_attempt);
+    }
+    if (draining) {
+      wake = min(wake, drain_deadline);
+    }
+
+    int timeout = -1;
+    if (wake != chrono::steady_clock::time_point::max()) {
+      timeout = max(0L, (long)chrono::ceil<chrono::milliseconds>(wake - now).count());
+    }
+
+    if (poll(fds, 3, timeout) < 0 && errno != EINTR) {
+      cout << "Event sink failed to poll, stopping" << endl;
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      eventfd_read(event_sink_event_fd, &event_count);
+    }
+
+    if (!draining && (fds[1].revents & POLLIN)) {
+      draining = true;
+      drain_deadline = chrono::steady_clock::now() + chrono::milliseconds(EVENT_SINK_DRAIN_TIMEOUT);
+      // The shutdown event stays readable, stop watching it
+      fds[1].fd = -1;
+    }
+
+    if (sink.conn != NULL && (fds[2].revents & (POLLIN | POLLHUP | POLLERR)) && !ReadEventResults(&sink)) {
+      DropEventSinkConnection(&sink);
+    }
+  }
+
+  if (sink.conn != NULL) {
+    PQfinish(sink.conn);
+  }
+
+  event_journal.Sync();
+  uint64_t left = event_journal.Head() - event_journal.Flushed();
+  if (left > 0) {
+    cout << left << " position events left in the journal for the next start" << endl;
+  }
+
+  return NULL;
+}
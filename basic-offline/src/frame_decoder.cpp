@@ -0,0 +1,97 @@
+#include <string_view>
+#include <string.h>
+
+using namespace std;
+
+#define FRAME_DECODER_CAPACITY 1024
+#define FRAME_MAX_LENGTH 512
+#define FRAME_DELIMITER '\n'
+
+// Incremental splitter for newline terminated reader frames.
+// Bytes are read straight into the decoder's buffer and complete frames are
+// handed out as views into that same buffer, so nothing is copied unless a
+// partial frame has to be slid back to the front to make room for the next read.
+// Views stay valid until the next call to WritePointer
+class frame_decoder {
+ public:
+  char *WritePointer() {
+    if (head == tail) {
+      head = scan = tail = 0;
+    } else if (FRAME_DECODER_CAPACITY - tail < FRAME_MAX_LENGTH) {
+      memmove(buffer, &buffer[head], tail - head);
+      scan -= head;
+      tail -= head;
+      head = 0;
+    }
+    return &buffer[tail];
+  }
+
+  size_t WriteCapacity() const {
+    return FRAME_DECODER_CAPACITY - tail;
+  }
+
+  void Commit(size_t bytes) {
+    tail += bytes;
+  }
+
+  // Returns false once no complete frame is left. A trailing '\r' is stripped,
+  // empty frames (e.g. the second half of "\r\n\r\n") are skipped and frames
+  // longer than FRAME_MAX_LENGTH are dropped and counted as overflows
+  bool NextFrame(string_view *frame) {
+    while (scan < tail) {
+      char *delimiter = (char *)memchr(&buffer[scan], FRAME_DELIMITER, tail - scan);
+      if (delimiter == NULL) {
+        break;
+      }
+
+      size_t start = head, end = delimiter - buffer;
+      head = scan = end + 1;
+
+      if (discarding) {
+        // Tail end of an overlong frame, drop it and resync on this delimiter
+        discarding = false;
+        continue;
+      }
+
+      if (end > start && buffer[end - 1] == '\r') {
+        end--;
+      }
+
+      if (end - start > FRAME_MAX_LENGTH) {
+        overflows++;
+      } else if (end > start) {
+        *frame = string_view(&buffer[start], end - start);
+        return true;
+      }
+    }
+
+    scan = tail;
+
+    if (tail - head > FRAME_MAX_LENGTH + 1) {
+      // No delimiter within the max frame length (plus '\r'), this is line noise rather than a card
+      overflows++;
+      discarding = true;
+      head = scan = tail = 0;
+    }
+
+    return false;
+  }
+
+  // Bytes of a frame still waiting for its delimiter
+  size_t Buffered() const {
+    return tail - head;
+  }
+
+  unsigned long Overflows() const {
+    return overflows;
+  }
+
+ private:
+  char buffer[FRAME_DECODER_CAPACITY];
+  // buffer[head, tail) is unconsumed, buffer[head, scan) is known to hold no delimiter
+  size_t head = 0;
+  size_t scan = 0;
+  size_t tail = 0;
+  bool discarding = false;
+  unsigned long overflows = 0;
+};
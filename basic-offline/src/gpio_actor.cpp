@@ -0,0 +1,403 @@
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <semaphore>
+#include <chrono>
+#include <bit>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "bounded_queue.cpp"
+#include "timer_wheel.cpp"
+#include "event_sink.cpp"
+#include "debounce.cpp"
+
+using namespace std;
+
+// The GPIO thread is the only one that touches the lines. Every other thread
+// submits a command here and, if it cares, waits on the completion for the result
+
+#define GPIO_SAMPLE_PERIOD 10
+#define GPIO_COMMAND_QUEUE_SIZE 64
+#define LOCK_OPEN_TIMEOUT 5000
+// Sensor level of a door that is open
+#define DOOR_SENSOR_OPEN 1
+// How long a door sensor must hold a new level before it counts, in ms
+#define DOOR_SENSOR_SETTLE_TIME 30
+
+// When a position is relocked before LOCK_OPEN_TIMEOUT runs out
+typedef enum _lock_relock_mode {
+  // Never early, the lock stays energized for the whole timeout
+  LOCK_RELOCK_ON_TIMEOUT,
+  // As soon as the door opens, for latch-release locks that only need a pulse
+  LOCK_RELOCK_ON_OPEN,
+  // Once the door has been opened and closed again
+  LOCK_RELOCK_ON_CLOSE
+} lock_relock_mode_type;
+
+#define DOOR_IDLE 0
+#define DOOR_AWAITING_OPEN 1
+#define DOOR_OPENED 2
+
+typedef enum _gpio_command_type {
+  // Open every position set in word for LOCK_OPEN_TIMEOUT, restarting the
+  // timeout of any that are already open
+  GPIO_COMMAND_UNLOCK,
+  // Close every position straight away
+  GPIO_COMMAND_RELOCK,
+  // Take a fresh sensor sample and hand it back
+  GPIO_COMMAND_SAMPLE
+} gpio_command_type;
+
+typedef struct _gpio_completion {
+  binary_semaphore done{0};
+  int result = 0;
+  shift_out_stats stats = { 0, chrono::nanoseconds(0) };
+  position_word sample;
+} gpio_completion;
+
+typedef struct _gpio_command {
+  gpio_command_type type;
+  position_word word;
+  shared_ptr<gpio_completion> completion;
+} gpio_command;
+
+bounded_queue<gpio_command, GPIO_COMMAND_QUEUE_SIZE> gpio_commands;
+int gpio_command_event_fd = -1;
+lock_relock_mode_type lock_relock_mode = LOCK_RELOCK_ON_TIMEOUT;
+unsigned int door_sensor_settle_samples = (DOOR_SENSOR_SETTLE_TIME + GPIO_SAMPLE_PERIOD - 1) / GPIO_SAMPLE_PERIOD;
+
+// Unlock to door open, door open to door closed and unlock to relock
+latency_histogram door_open_latency;
+latency_histogram door_close_latency;
+latency_histogram lock_on_time;
+
+// Accepts "timeout", "open" or "close", anything else leaves the mode as is
+bool SetLockRelockMode(const char *mode) {
+  if (mode == NULL) return false;
+  if (strcmp(mode, "timeout") == 0) lock_relock_mode = LOCK_RELOCK_ON_TIMEOUT;
+  else if (strcmp(mode, "open") == 0) lock_relock_mode = LOCK_RELOCK_ON_OPEN;
+  else if (strcmp(mode, "close") == 0) lock_relock_mode = LOCK_RELOCK_ON_CLOSE;
+  else return false;
+  return true;
+}
+
+// Settle time in ms, rounded up to whole samples. Anything that is not a number in
+// range leaves it as is
+bool SetDoorSensorSettleTime(const char *settle_time) {
+  if (settle_time == NULL) return false;
+  char *end;
+  long ms = strtol(settle_time, &end, 10);
+  if (*settle_time == '\0' || *end != '\0' || ms < 0 || ms > ((1 << DEBOUNCE_MAX_PLANES) - 1) * GPIO_SAMPLE_PERIOD) return false;
+  door_sensor_settle_samples = (ms + GPIO_SAMPLE_PERIOD - 1) / GPIO_SAMPLE_PERIOD;
+  return true;
+}
+
+void PrintLockLatencies() {
+  PrintHistogram("Unlock to door open", &door_open_latency);
+  PrintHistogram("Door open to closed", &door_close_latency);
+  PrintHistogram("Lock on time", &lock_on_time);
+}
+
+int OpenGPIOActor() {
+  gpio_command_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  return gpio_command_event_fd < 0 ? -1 : 0;
+}
+
+void CloseGPIOActor() {
+  close(gpio_command_event_fd);
+  gpio_command_event_fd = -1;
+}
+
+// Returns NULL when the queue is full, the command is dropped in that case
+shared_ptr<gpio_completion> SubmitGPIOCommand(gpio_command_type type, const position_word *word) {
+  auto completion = make_shared<gpio_completion>();
+  gpio_command command = {
+    .type = type,
+    .word = word == NULL ? position_word() : *word,
+    .completion = completion
+  };
+
+  if (!gpio_commands.TryPush(std::move(command))) {
+    return NULL;
+  }
+
+  eventfd_write(gpio_command_event_fd, 1);
+  return completion;
+}
+
+// Submits and waits for the GPIO thread to carry the command out
+bool RunGPIOCommand(gpio_command_type type, const position_word *word, chrono::milliseconds timeout, shared_ptr<gpio_completion> *result) {
+  auto completion = SubmitGPIOCommand(type, word);
+  if (completion == NULL || !completion->done.try_acquire_for(timeout)) {
+    return false;
+  }
+  if (result != NULL) {
+    *result = completion;
+  }
+  return completion->result == 0;
+}
+
+void PrintSensors(const position_word *sensor_word) {
+  for (HARDWARE_POSITIONS_TYPE i = 0; i < num_hardware_positions; i++) {
+    if (sensor_word->Test(i))
+      cout << '1';
+    else
+      cout << '0';
+  }
+  cout << endl;
+}
+
+// A door that changed between two samples
+typedef struct _door_edge {
+  HARDWARE_POSITIONS_TYPE position;
+  bool opened;
+  // When the sample that saw the change was loaded
+  chrono::steady_clock::time_point sampled_at;
+} door_edge;
+
+// Calls emit for every position that differs between two samples, lowest first.
+// Unchanged words cost one XOR, changed ones only visit their set bits. Returns the number of edges
+template <typename F>
+size_t DetectDoorEdges(const position_word *current, const position_word *previous, chrono::steady_clock::time_point sampled_at, F emit) {
+  size_t edges = 0;
+  (*current ^ *previous).ForEach([&](HARDWARE_POSITIONS_TYPE position) {
+    emit(door_edge {
+      .position = position,
+      .opened = current->Test(position) == DOOR_SENSOR_OPEN,
+      .sampled_at = sampled_at
+    });
+    edges++;
+  });
+  return edges;
+}
+
+// Positions whose lock is energized, with their timeouts and what their doors have done since
+typedef struct _lock_state {
+  position_word open_positions;
+  HARDWARE_POSITIONS_TYPE open_count;
+  timer_wheel timeouts;
+  vector<u_int8_t> door_states;
+  vector<chrono::steady_clock::time_point> unlocked_at;
+  vector<chrono::steady_clock::time_point> opened_at;
+} lock_state;
+
+void OpenPosition(lock_state *locks, HARDWARE_POSITIONS_TYPE position, chrono::steady_clock::time_point now) {
+  if (!locks->open_positions.Test(position)) {
+    locks->open_positions.Set(position);
+    locks->open_count++;
+    locks->door_states.at(position) = DOOR_AWAITING_OPEN;
+    locks->unlocked_at.at(position) = now;
+  }
+  locks->timeouts.Schedule(position, LOCK_OPEN_TIMEOUT / GPIO_SAMPLE_PERIOD);
+}
+
+// Leaves the timer alone, callers either cancel it or are called from its expiry
+void ClosePosition(lock_state *locks, HARDWARE_POSITIONS_TYPE position) {
+  locks->open_positions.Set(position, false);
+  locks->open_count--;
+  locks->door_states.at(position) = DOOR_IDLE;
+}
+
+// Shifts out the open positions and drives OE to match, sampling the sensors on the way
+shift_out_stats LatchOpenPositions(const lock_state *locks, position_word *data) {
+  ExchangeGPIO(&locks->open_positions, data);
+  if (locks->open_count > 0) {
+    OpenGPIOOutput();
+  } else {
+    CloseGPIOOutput();
+  }
+  return last_shift_out_stats;
+}
+
+// Follows each open position's door through open and closed on the debounced sensor
+// words. Returns true when a position should be relocked before its timeout under the
+// configured relock mode
+bool TrackDoors(lock_state *locks, const position_word *sensor_word, chrono::steady_clock::time_point now) {
+  bool changed = false;
+
+  locks->open_positions.ForEach([&](HARDWARE_POSITIONS_TYPE i) {
+    bool door_open = sensor_word->Test(i) == DOOR_SENSOR_OPEN;
+    bool relock = false;
+
+    if (locks->door_states.at(i) == DOOR_AWAITING_OPEN && door_open) {
+      locks->door_states.at(i) = DOOR_OPENED;
+      locks->opened_at.at(i) = now;
+      door_open_latency.Record(now - locks->unlocked_at.at(i));
+      relock = lock_relock_mode == LOCK_RELOCK_ON_OPEN;
+    } else if (locks->door_states.at(i) == DOOR_OPENED && !door_open) {
+      // Once per unlock, the door is not followed again until the position reopens
+      locks->door_states.at(i) = DOOR_IDLE;
+      door_close_latency.Record(now - locks->opened_at.at(i));
+      relock = lock_relock_mode == LOCK_RELOCK_ON_CLOSE;
+    }
+
+    if (relock) {
+      cout << "Position " << i + 1 << " relocked after "
+           << chrono::duration_cast<chrono::milliseconds>(now - locks->unlocked_at.at(i)).count() << "ms" << endl;
+      lock_on_time.Record(now - locks->unlocked_at.at(i));
+      locks->timeouts.Cancel(i);
+      ClosePosition(locks, i);
+      changed = true;
+    }
+  });
+
+  return changed;
+}
+
+// Samples the sensors on a fixed GPIO_SAMPLE_PERIOD schedule and carries out commands as
+// soon as they arrive. Each open position has its own timeout on a timer wheel that
+// ticks once per sample, and is relocked early if its door sensor says the user is done.
+// The lock word is only shifted out again when the set of open positions changes.
+// Exits when the shutdown eventfd passed as arg becomes readable
+void *GPIOActorThreadTask(void *arg) {
+  int shutdown_fd = *(int*)arg;
+
+  position_word data, sensor_word, prev_sensor_word;
+  vertical_debouncer debouncer(door_sensor_settle_samples);
+  lock_state locks = {
+    .open_positions = position_word(),
+    .open_count = 0,
+    .timeouts = timer_wheel(num_hardware_positions),
+    .door_states = vector<u_int8_t>(num_hardware_positions, DOOR_IDLE),
+    .unlocked_at = vector<chrono::steady_clock::time_point>(num_hardware_positions),
+    .opened_at = vector<chrono::steady_clock::time_point>(num_hardware_positions)
+  };
+  gpio_command command;
+  // The first sample has nothing to compare against, doors already open are not events
+  bool sampled, ticked, changed, first_sample = true;
+  // Unlocks drained together are latched as one word, their completions wait for it
+  vector<shared_ptr<gpio_completion>> unlocked;
+  unlocked.reserve(GPIO_COMMAND_QUEUE_SIZE);
+  auto latch_unlocked = [&]() {
+    if (unlocked.empty()) return;
+    shift_out_stats stats = LatchOpenPositions(&locks, &data);
+    sampled = true;
+    for (auto &completion : unlocked) {
+      completion->stats = stats;
+      completion->done.release();
+    }
+    unlocked.clear();
+  };
+  eventfd_t event_count;
+
+  struct pollfd fds[2];
+  fds[0].fd = gpio_command_event_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = shutdown_fd;
+  fds[1].events = POLLIN;
+
+  auto period = chrono::milliseconds(GPIO_SAMPLE_PERIOD);
+  auto start = chrono::steady_clock::now();
+  auto next_sample = start;
+
+  while (true) {
+    auto wait = chrono::ceil<chrono::milliseconds>(next_sample - chrono::steady_clock::now());
+    if (poll(fds, 2, wait.count() > 0 ? wait.count() : 0) < 0 && errno != EINTR) {
+      cout << "GPIO thread failed to poll, stopping" << endl;
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      eventfd_read(gpio_command_event_fd, &event_count);
+    }
+
+    sampled = false;
+    ticked = false;
+    auto now = chrono::steady_clock::now();
+
+    while (gpio_commands.TryPop(&command)) {
+      switch (command.type) {
+        case GPIO_COMMAND_UNLOCK:
+          changed = false;
+          command.word.ForEach([&](HARDWARE_POSITIONS_TYPE i) {
+            if (i >= num_hardware_positions) return;
+            changed = changed || !locks.open_positions.Test(i);
+            OpenPosition(&locks, i, now);
+          });
+          // Held back until the queue is drained, so every unlock that came in
+          // together goes out in one word
+          if (changed) {
+            unlocked.push_back(std::move(command.completion));
+            continue;
+          }
+          break;
+        case GPIO_COMMAND_RELOCK:
+          latch_unlocked();
+          locks.open_positions.ForEach([&](HARDWARE_POSITIONS_TYPE i) {
+            locks.timeouts.Cancel(i);
+            ClosePosition(&locks, i);
+          });
+          command.completion->stats = LatchOpenPositions(&locks, &data);
+          sampled = true;
+          break;
+        case GPIO_COMMAND_SAMPLE:
+          latch_unlocked();
+          if (!sampled) {
+            ReadGPIO(&data);
+            sampled = true;
+          }
+          command.completion->sample = data;
+          break;
+      }
+      command.completion->done.release();
+      command.completion.reset();
+    }
+    // The sample rides along with the new word at no extra bulk writes
+    latch_unlocked();
+
+    now = chrono::steady_clock::now();
+    if (now >= next_sample) {
+      changed = false;
+      locks.timeouts.Advance((now - start) / period, [&](size_t i) {
+        lock_on_time.Record(now - locks.unlocked_at.at(i));
+        ClosePosition(&locks, i);
+        changed = true;
+      });
+
+      if (changed) {
+        LatchOpenPositions(&locks, &data);
+        sampled = true;
+      } else if (!sampled) {
+        ReadGPIO(&data);
+        sampled = true;
+      }
+      // Stay on the original schedule, skipping any periods that were missed
+      while (next_sample <= now) {
+        next_sample += period;
+      }
+      ticked = true;
+    }
+
+    // The debouncer counts samples, so it only sees one per period. Samples taken
+    // between ticks while latching would settle a bouncing switch early
+    if (ticked) {
+      // Everything past here sees the debounced levels, a bouncing reed switch
+      // neither relocks a door early nor floods the journal
+      sensor_word = data;
+      if (first_sample) {
+        debouncer.Reset(&sensor_word);
+      }
+      debouncer.Filter(&sensor_word);
+
+      // Each edge is only queued, the database is written by the event sink thread
+      if (!first_sample && DetectDoorEdges(&sensor_word, &prev_sensor_word, last_sample_time, [](door_edge edge) {
+            QueuePositionEvent(edge.opened ? POSITION_EVENT_OPENED : POSITION_EVENT_CLOSED, edge.position + 1, edge.sampled_at);
+          }) > 0) {
+        PrintSensors(&sensor_word);
+      }
+
+      if (locks.open_count > 0 && TrackDoors(&locks, &sensor_word, now)) {
+        LatchOpenPositions(&locks, &data);
+      }
+      first_sample = false;
+      prev_sensor_word = sensor_word;
+    }
+  }
+
+  return NULL;
+}
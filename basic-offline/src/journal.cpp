@@ -0,0 +1,258 @@
+#include <iostream>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Append-only journal of fixed size records in a memory mapped file, used as a ring.
+// Appending is a copy into the mapping, so producers never make a system call or
+// wait on the disk. The owner syncs the mapping to disk and moves the flushed
+// cursor in the header forward once records are safely somewhere else. A record's
+// slot is only reused after the cursor has passed it, so the journal never holds
+// more than its capacity and nothing before the cursor is overwritten.
+// record_type starts with its uint64_t sequence and has its uint32_t checksum after
+// everything the checksum covers
+
+#define JOURNAL_MAGIC 0x4c4e524a45464153ULL
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE 4096
+#define JOURNAL_DEFAULT_CAPACITY 65536
+// Under the service's state directory, so it does not depend on where the firmware is started from
+#define JOURNAL_DEFAULT_PATH "/var/lib/simsafe/events.journal"
+
+typedef struct _journal_record {
+  // Stored last, a record is only valid once its sequence matches its slot and checksum.
+  // Sequences start at 1 so a zeroed slot is never valid
+  uint64_t sequence;
+  // Nanoseconds since the epoch
+  int64_t recorded_at;
+  uint16_t type;
+  uint16_t position;
+  uint32_t reserved;
+  uint32_t checksum;
+  uint32_t padding;
+} journal_record;
+
+static_assert(sizeof(journal_record) == 32, "Journal records must stay 32 bytes, the file format depends on it");
+
+typedef struct _journal_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  // Every record before this sequence has been flushed
+  uint64_t flushed;
+  uint32_t checksum;
+} journal_header;
+
+// CRC-32C, table driven
+constexpr auto CRC32C_TABLE = [] {
+  struct { uint32_t entries[256]; } table = {};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+    }
+    table.entries[i] = crc;
+  }
+  return table;
+}();
+
+uint32_t Crc32c(const void *data, size_t length) {
+  const uint8_t *bytes = (const uint8_t*)data;
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < length; i++) {
+    crc = CRC32C_TABLE.entries[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+template<typename record_type>
+class journal {
+ public:
+  ~journal() {
+    Close();
+  }
+
+  // Maps the journal at path, creating it with room for capacity records if it does
+  // not exist. An existing journal keeps the capacity it was created with, and every
+  // valid record from its flushed cursor on is handed out again by Next
+  int Open(const char *path, uint32_t capacity) {
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      return -1;
+    }
+
+    journal_header existing;
+    bool valid_header = pread(fd, &existing, sizeof(existing), 0) == sizeof(existing) &&
+                        existing.magic == JOURNAL_MAGIC && existing.version == JOURNAL_VERSION &&
+                        existing.capacity > 0 && existing.checksum == HeaderChecksum(&existing);
+    if (valid_header && existing.capacity != capacity) {
+      cout << "Journal " << path << " keeps its capacity of " << existing.capacity << " records" << endl;
+      capacity = existing.capacity;
+    }
+
+    this->capacity = capacity;
+    size = JOURNAL_HEADER_SIZE + (size_t)capacity * sizeof(record_type);
+    struct stat info;
+    if (fstat(fd, &info) < 0 || ((size_t)info.st_size != size && ftruncate(fd, size) < 0)) {
+      Close();
+      return -1;
+    }
+
+    void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      Close();
+      return -1;
+    }
+    header = (journal_header*)mapping;
+    records = (record_type*)((char*)mapping + JOURNAL_HEADER_SIZE);
+
+    Recover(valid_header ? existing.flushed : 0);
+    return 0;
+  }
+
+  void Close() {
+    if (header != NULL) {
+      msync(header, size, MS_SYNC);
+      munmap(header, size);
+      header = NULL;
+      records = NULL;
+    }
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  // Any number of threads may append, the record's sequence and checksum are filled in
+  // here. Returns false when the journal is full, that is when the record capacity
+  // places ahead would not have been flushed yet
+  bool Append(record_type record) {
+    uint64_t sequence = head.load(memory_order_relaxed);
+    do {
+      if (sequence - flushed.load(memory_order_acquire) >= capacity) {
+        return false;
+      }
+    } while (!head.compare_exchange_weak(sequence, sequence + 1, memory_order_relaxed));
+
+    record.sequence = sequence;
+    record.checksum = 0;
+    record.checksum = RecordChecksum(&record);
+
+    record_type *slot = &records[sequence % capacity];
+    memcpy((char*)slot + sizeof(slot->sequence), (char*)&record + sizeof(record.sequence), sizeof(record) - sizeof(record.sequence));
+    atomic_ref<uint64_t>(slot->sequence).store(sequence, memory_order_release);
+    return true;
+  }
+
+  // Copies out the record at *sequence if it is complete. Records lost to a power cut
+  // before the last start are skipped over, *sequence is left on the record returned
+  bool Next(uint64_t *sequence, record_type *record) {
+    while (*sequence < head.load(memory_order_acquire)) {
+      record_type *slot = &records[*sequence % capacity];
+      if (atomic_ref<uint64_t>(slot->sequence).load(memory_order_acquire) == *sequence) {
+        *record = *slot;
+        if (record->checksum == RecordChecksum(record)) {
+          return true;
+        }
+      }
+      if (*sequence >= recovered_head) {
+        // Still being appended
+        return false;
+      }
+      lost++;
+      (*sequence)++;
+    }
+    return false;
+  }
+
+  // Next sequence to be appended
+  uint64_t Head() const {
+    return head.load(memory_order_acquire);
+  }
+
+  uint64_t Flushed() const {
+    return flushed.load(memory_order_acquire);
+  }
+
+  // Only the flushing thread calls this, reaches disk with the next Sync
+  void MarkFlushed(uint64_t sequence) {
+    if (sequence <= Flushed()) {
+      return;
+    }
+    flushed.store(sequence, memory_order_release);
+    header->flushed = sequence;
+    header->checksum = HeaderChecksum(header);
+  }
+
+  int Sync() {
+    return msync(header, size, MS_SYNC);
+  }
+
+  // Records found torn or missing after a power cut
+  unsigned long Lost() const {
+    return lost;
+  }
+
+ private:
+  static uint32_t RecordChecksum(const record_type *record) {
+    return Crc32c(record, offsetof(record_type, checksum));
+  }
+
+  static uint32_t HeaderChecksum(const journal_header *header) {
+    return Crc32c(header, offsetof(journal_header, checksum));
+  }
+
+  // Finds the newest valid record to carry on appending after it. Without a valid
+  // cursor everything still in the file is replayed
+  void Recover(uint64_t cursor) {
+    uint64_t newest = 0, oldest = UINT64_MAX;
+    for (uint32_t i = 0; i < capacity; i++) {
+      record_type *record = &records[i];
+      if (record->sequence == 0 || record->sequence % capacity != i || record->checksum != RecordChecksum(record)) {
+        continue;
+      }
+      newest = max(newest, record->sequence);
+      oldest = min(oldest, record->sequence);
+    }
+
+    uint64_t next = newest == 0 ? max(cursor, (uint64_t)1) : newest + 1;
+    if (cursor == 0 || cursor > next) {
+      cursor = oldest == UINT64_MAX ? next : oldest;
+    }
+    // A cursor further back than one capacity points at slots that were since reused
+    cursor = max(cursor, next > capacity ? next - capacity : 1);
+
+    head.store(next, memory_order_relaxed);
+    recovered_head = next;
+    flushed.store(cursor, memory_order_relaxed);
+    header->magic = JOURNAL_MAGIC;
+    header->version = JOURNAL_VERSION;
+    header->capacity = capacity;
+    header->flushed = cursor;
+    header->checksum = HeaderChecksum(header);
+    Sync();
+
+    if (next > cursor) {
+      cout << "Journal has " << next - cursor << " unflushed records to replay" << endl;
+    }
+  }
+
+  int fd = -1;
+  size_t size = 0;
+  uint32_t capacity = 0;
+  journal_header *header = NULL;
+  record_type *records = NULL;
+  atomic<uint64_t> head{1};
+  atomic<uint64_t> flushed{1};
+  // Anything before this that is not valid was lost before the last start, not in progress
+  uint64_t recovered_head = 1;
+  // Counted by the flushing thread, read by whoever prints the stats
+  atomic<unsigned long> lost{0};
+};
@@ -0,0 +1,176 @@
+#include <vector>
+#include <atomic>
+#include <gpiod.hpp>
+
+using namespace std;
+
+#define NUM_GPIO_OUTPUT 8
+#define NUM_GPIO_INPUT 1
+
+#define GPIO_OUTPUT_OE 0
+#define GPIO_OUTPUT_SRCLR 1
+#define GPIO_OUTPUT_SRCLK 2
+#define GPIO_OUTPUT_RCLK 3
+#define GPIO_OUTPUT_SER 4
+
+#define GPIO_INPUT_CLK 5
+#define GPIO_INPUT_CLR 6
+#define GPIO_INPUT_LD 7
+#define GPIO_INPUT_DATA 0
+
+// Drives the whole output bank and samples the whole input bank in one call each.
+// Every bank access made by the shift register code goes through here, so the
+// call counters are the number of bulk ioctls the real hardware would see
+class line_driver {
+ public:
+  virtual ~line_driver() {}
+
+  int SetOutputs(const int *values) {
+    set_calls.fetch_add(1, memory_order_relaxed);
+    return WriteOutputs(values);
+  }
+
+  int GetInputs(int *values) {
+    get_calls.fetch_add(1, memory_order_relaxed);
+    return ReadInputs(values);
+  }
+
+  atomic<unsigned long> set_calls{0};
+  atomic<unsigned long> get_calls{0};
+
+ protected:
+  virtual int WriteOutputs(const int *values) = 0;
+  virtual int ReadInputs(int *values) = 0;
+};
+
+// Real hardware, the bulks must already be requested from the chip
+class gpiod_line_driver : public line_driver {
+ public:
+  gpiod_line_driver(struct gpiod_line_bulk *output_lines, struct gpiod_line_bulk *input_lines)
+    : output_lines(output_lines), input_lines(input_lines) {}
+
+ protected:
+  int WriteOutputs(const int *values) override {
+    return gpiod_line_set_value_bulk(output_lines, values);
+  }
+
+  int ReadInputs(int *values) override {
+    return gpiod_line_get_value_bulk(input_lines, values);
+  }
+
+ private:
+  struct gpiod_line_bulk *output_lines;
+  struct gpiod_line_bulk *input_lines;
+};
+
+// In-process model of the 74HC595 lock chain and 74HC165 sensor chain.
+// Each SetOutputs is treated as one instant: every line takes its new level at
+// once and the chips react to the edges between the previous and new levels.
+// Bit i of either chain is position i, the same order SendWordToGPIO and ReadGPIO use
+class simulated_line_driver : public line_driver {
+ public:
+  // initial_values plays the role of the default values given when requesting the lines
+  simulated_line_driver(size_t chain_length, const int *initial_values)
+    : output_shift(chain_length), output_storage(chain_length),
+      input_shift(chain_length), sensors(chain_length) {
+    for (int i = 0; i < NUM_GPIO_OUTPUT; i++) {
+      lines[i] = initial_values[i];
+    }
+  }
+
+  size_t ChainLength() const {
+    return sensors.size();
+  }
+
+  // What the door sensors on the 165 parallel inputs currently read
+  void SetSensors(const vector<bool> *values) {
+    for (size_t i = 0; i < sensors.size() && i < values->size(); i++) {
+      sensors[i] = values->at(i);
+    }
+  }
+
+  // What the 595 outputs drive, all locks are off while OE is high
+  bool IsLockEnergized(size_t position) const {
+    return lines[GPIO_OUTPUT_OE] == 0 && output_storage.at(position);
+  }
+
+  const vector<bool> *LatchedWord() const {
+    return &output_storage;
+  }
+
+  unsigned long srclk_edges = 0;
+  unsigned long rclk_edges = 0;
+  unsigned long clk_edges = 0;
+  unsigned long loads = 0;
+  // SER or DATA changed in the same write as the clock edge that samples it
+  unsigned long setup_violations = 0;
+
+ protected:
+  int WriteOutputs(const int *values) override {
+    // 595: SRCLR is an active low asynchronous clear of the shift register.
+    // RCLK is handled first so a simultaneous SRCLK edge is latched one clock late,
+    // which is what the chip does when both clocks rise together
+    if (Rising(values, GPIO_OUTPUT_RCLK)) {
+      rclk_edges++;
+      output_storage = output_shift;
+    }
+
+    if (values[GPIO_OUTPUT_SRCLR] == 0) {
+      output_shift.assign(output_shift.size(), false);
+    } else if (Rising(values, GPIO_OUTPUT_SRCLK)) {
+      srclk_edges++;
+      if (values[GPIO_OUTPUT_SER] != lines[GPIO_OUTPUT_SER]) {
+        setup_violations++;
+      }
+      Shift(&output_shift, lines[GPIO_OUTPUT_SER]);
+    }
+
+    // 165: CLR clears the sensor register, LD low loads it from the sensors and
+    // holds it there, CLK only shifts once LD is back high
+    if (values[GPIO_INPUT_CLR] == 0) {
+      input_shift.assign(input_shift.size(), false);
+    } else if (values[GPIO_INPUT_LD] == 0) {
+      if (lines[GPIO_INPUT_LD] != 0) {
+        loads++;
+      }
+      input_shift = sensors;
+    } else if (Rising(values, GPIO_INPUT_CLK)) {
+      clk_edges++;
+      if (lines[GPIO_INPUT_LD] == 0) {
+        setup_violations++;
+      }
+      Shift(&input_shift, 0);
+    }
+
+    for (int i = 0; i < NUM_GPIO_OUTPUT; i++) {
+      lines[i] = values[i];
+    }
+
+    return 0;
+  }
+
+  int ReadInputs(int *values) override {
+    values[GPIO_INPUT_DATA] = input_shift.empty() ? 0 : input_shift.back();
+    return 0;
+  }
+
+ private:
+  bool Rising(const int *values, int line) const {
+    return lines[line] == 0 && values[line] != 0;
+  }
+
+  static void Shift(vector<bool> *chain, int serial_in) {
+    for (size_t i = chain->size(); i > 1; i--) {
+      chain->at(i - 1) = chain->at(i - 2);
+    }
+    if (!chain->empty()) {
+      chain->at(0) = serial_in != 0;
+    }
+  }
+
+  int lines[NUM_GPIO_OUTPUT];
+  vector<bool> output_shift;
+  vector<bool> output_storage;
+  vector<bool> input_shift;
+  vector<bool> sensors;
+};
@@ -2,16 +2,25 @@
 #include <pqxx/pqxx>
 #include <csignal>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <thread>
 #include <chrono>
 #include "../include/dotenv/dotenv.h"
 #include "database.cpp"
+#include "gpio_actor.cpp"
+#include "auth_cache.cpp"
+#include "scan_queue.cpp"
+#include "serial_readers.cpp"
 
 vector<pthread_t> work_threads;
-atomic<bool> lock_timeout_thread_active{false};
-pthread_t lock_timeout_thread;
-int fd;
-#define LOCK_OPEN_TIMEOUT 5000
+int shutdown_event_fd = -1;
+#define GPIO_REQUEST_TIMEOUT 1000
+
+bool IsGPIOSimulated() noexcept(true) {
+  const char *driver = getenv("GPIO_DRIVER");
+  return driver != NULL && strcmp(driver, "simulated") == 0;
+}
 
 void LoadEnv() noexcept(true) {
   cout << "Loading environment..." << endl;
@@ -37,7 +46,7 @@ void LoadEnv() noexcept(true) {
     cout << "DATABASE_HOST env variable required" << endl;
     exit(1);
   }
-  if (getenv("GPIO_CHIP_NAME") == NULL) {
+  if (!IsGPIOSimulated() && getenv("GPIO_CHIP_NAME") == NULL) {
     cout << "GPIO_CHIP_NAME env variable required" << endl;
     exit(1);
   }
@@ -45,144 +54,239 @@ void LoadEnv() noexcept(true) {
     cout << "CONTROLLER_SERIAL_NUMBER env variable required" << endl;
     exit(1);
   }
+  if (getenv("LOCK_RELOCK_MODE") != NULL && !SetLockRelockMode(getenv("LOCK_RELOCK_MODE"))) {
+    cout << "LOCK_RELOCK_MODE must be timeout, open or close" << endl;
+    exit(1);
+  }
+  if (getenv("DOOR_SENSOR_SETTLE_MS") != NULL && !SetDoorSensorSettleTime(getenv("DOOR_SENSOR_SETTLE_MS"))) {
+    cout << "DOOR_SENSOR_SETTLE_MS must be a number of milliseconds up to " << ((1 << DEBOUNCE_MAX_PLANES) - 1) * GPIO_SAMPLE_PERIOD << endl;
+    exit(1);
+  }
+  if (getenv("SERIAL_READERS") != NULL && !SetSerialReaders(getenv("SERIAL_READERS"))) {
+    cout << "SERIAL_READERS must be up to " << SERIAL_MAX_READERS << " comma separated [id=]path[@baud] with distinct ids and paths" << endl;
+    exit(1);
+  }
+  if (getenv("SCAN_WORKERS") != NULL && !SetScanWorkers(getenv("SCAN_WORKERS"))) {
+    cout << "SCAN_WORKERS must be a number from 1 to " << SCAN_QUEUE_SIZE << endl;
+    exit(1);
+  }
+  if (getenv("SCAN_DEDUP_MS") != NULL && !SetScanDedupWindow(getenv("SCAN_DEDUP_MS"))) {
+    cout << "SCAN_DEDUP_MS must be a number of milliseconds" << endl;
+    exit(1);
+  }
+  if (getenv("AUTH_DEADLINE_MS") != NULL && !SetAuthDeadline(getenv("AUTH_DEADLINE_MS"))) {
+    cout << "AUTH_DEADLINE_MS must be a positive number of milliseconds" << endl;
+    exit(1);
+  }
+  if (getenv("AUTH_ACCESS_FORMAT") != NULL && !SetAccessFormat(getenv("AUTH_ACCESS_FORMAT"))) {
+    cout << "AUTH_ACCESS_FORMAT must be text or bitmap" << endl;
+    exit(1);
+  }
+  if (getenv("AUTH_BATCH_MAX_WAIT_MS") != NULL && !SetAuthBatchMaxWait(getenv("AUTH_BATCH_MAX_WAIT_MS"))) {
+    cout << "AUTH_BATCH_MAX_WAIT_MS must be a number of milliseconds" << endl;
+    exit(1);
+  }
+  if (getenv("AUTH_CACHE_TTL_MS") != NULL && !SetAuthCacheTTL(getenv("AUTH_CACHE_TTL_MS"))) {
+    cout << "AUTH_CACHE_TTL_MS must be a number of milliseconds" << endl;
+    exit(1);
+  }
+  if (getenv("AUTH_CACHE_OUTAGE_MODE") != NULL && !SetAuthCacheOutageMode(getenv("AUTH_CACHE_OUTAGE_MODE"))) {
+    cout << "AUTH_CACHE_OUTAGE_MODE must be deny or stale" << endl;
+    exit(1);
+  }
+  if (getenv("AUTH_CACHE_STALE_MS") != NULL && !SetAuthCacheStaleLimit(getenv("AUTH_CACHE_STALE_MS"))) {
+    cout << "AUTH_CACHE_STALE_MS must be a number of milliseconds" << endl;
+    exit(1);
+  }
+  if (getenv("ACCESS_REPLICA_MAX_AGE_MS") != NULL && !SetAccessReplicaMaxAge(getenv("ACCESS_REPLICA_MAX_AGE_MS"))) {
+    cout << "ACCESS_REPLICA_MAX_AGE_MS must be a number of milliseconds" << endl;
+    exit(1);
+  }
+  if (getenv("METRICS_PATH") != NULL) {
+    metrics_path = getenv("METRICS_PATH");
+  }
   cout << "Environment loaded!" << endl;
 }
 
-void *AwaitAndCloseLocksThreadTask(void *arg) {
-  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-  this_thread::sleep_for(chrono::milliseconds(LOCK_OPEN_TIMEOUT));
-  CloseGPIOOutput();
-  lock_timeout_thread_active = false;
-  return NULL;
-}
+void AuthCodeRead(string_view auth_code, size_t reader, chrono::steady_clock::time_point scanned_at) {
+  cout << "Auth code read on " << serial_readers[reader]->id << ": " << auth_code << endl;
 
-void AuthCodeRead(const char *auth_code, int length) {
-  cout << "Auth code read: ";
-  for (int i = 0; i < length; i++) {
-    cout << auth_code[i];
-  }
-  cout << endl;
+  position_word output;
 
-  if (lock_timeout_thread_active) {
-    cout << "Locks already opened, discarding input";
+  // A scan that opens nothing does not hold back the same card scanned again
+  if (!AuthorizeScan(auth_code, scanned_at, &output)) {
+    cout << "Database unreachable and no cached access, discarding input" << endl;
+    serial_readers[reader]->deduplicator.Forget(auth_code, scanned_at);
     return;
   }
-
-  auto conn = FetchConnection();
-  vector<bool> output(num_hardware_positions);
-
-  AuthCardScanned(&conn->conn, auth_code, length, &output);
-
-  conn->in_use = false;
+  if (!output.Any()) {
+    serial_readers[reader]->deduplicator.Forget(auth_code, scanned_at);
+  }
 
   cout << "Access received: ";
   for (HARDWARE_POSITIONS_TYPE i = 0; i < num_hardware_positions; i++) {
-    if (output.at(i))
+    if (output.Test(i))
       cout << '1';
     else
       cout << '0';
   }
   cout << endl;
 
-  lock_timeout_thread_active = true;
-  SendWordToGPIO(&output);
-  OpenGPIOOutput();
-  if (pthread_create(&lock_timeout_thread, nullptr, AwaitAndCloseLocksThreadTask, nullptr) != 0) {
-    CloseGPIOOutput();
-    lock_timeout_thread_active = false; 
+  shared_ptr<gpio_completion> unlocked;
+  if (RunGPIOCommand(GPIO_COMMAND_UNLOCK, &output, chrono::milliseconds(GPIO_REQUEST_TIMEOUT), &unlocked)) {
+    // Denied scans and scans for positions already open latch nothing, they would
+    // only pull the scan to latch latency down
+    if (output.Any() && unlocked->stats.bulk_calls > 0) {
+      boot.Mark("First unlock");
+      serial_readers[reader]->scan_to_unlock.Record(chrono::steady_clock::now() - scanned_at);
+      Trace(TRACE_SCAN_TO_LATCH, scanned_at);
+      cout << "Word latched in " << unlocked->stats.bulk_calls << " bulk writes, "
+           << chrono::duration_cast<chrono::microseconds>(unlocked->stats.duration).count() << "us" << endl;
+    } else {
+      serial_readers[reader]->unlatched_scans++;
+      cout << "No new positions to latch" << endl;
+    }
+  } else {
+    cout << "GPIO did not latch the word in time" << endl;
+    serial_readers[reader]->deduplicator.Forget(auth_code, scanned_at);
   }
 }
 
-void *ReadSerialThreadTask(void *arg) {
-  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
-  
-  int fd = *(int*)arg;
+// Authorizes queued scans, scan_workers of these run side by side.
+// Exits when the shutdown eventfd passed as arg becomes readable
+void *AuthWorkerThreadTask(void *arg) {
+  int shutdown_fd = *(int*)arg;
+
+  queued_scan scan;
+  eventfd_t event_count;
+
+  struct pollfd fds[2];
+  fds[0].fd = scan_queue_event_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = shutdown_fd;
+  fds[1].events = POLLIN;
 
-  char last_read_content[512] = {0};
-  char buffer[512] = {0};
-  int bytes_read, cursor_pos = 0;
-  
   while (true) {
-    if ((bytes_read = ReadFromSerialPort(fd, buffer, 512)) > 0) {
-      memcpy(&last_read_content[cursor_pos], buffer, bytes_read);
-      cursor_pos += bytes_read;
-      
-      if (cursor_pos < 512) {
-        if (last_read_content[cursor_pos - 1] == '\n') {
-          // Terminating char has been sent, fire 'event'
-          AuthCodeRead(last_read_content, cursor_pos - 1);
-          cursor_pos = 0;
-        }
-      } else {
-        if (last_read_content[511] == '\n') {
-          AuthCodeRead(last_read_content, 511);
-        } else {
-          AuthCodeRead(last_read_content, 512);
-        }
-        cursor_pos = 0;
-      }
+    if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+      cout << "Auth worker failed to poll, stopping" << endl;
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      break;
+    }
+
+    // Every worker wakes, whichever pops a scan first takes it
+    if (fds[0].revents & POLLIN) {
+      eventfd_read(scan_queue_event_fd, &event_count);
+    }
+
+    while (scan_queue.TryPop(&scan)) {
+      scan_queue_latency.Record(chrono::steady_clock::now() - scan.scanned_at);
+      AuthCodeRead(scan.auth_code, scan.reader, scan.scanned_at);
     }
-    // cout << "Read" << endl;
-    pthread_testcancel();
-    this_thread::sleep_for(chrono::milliseconds(10));
   }
 
   return NULL;
 }
 
-void *ReadGPIOThreadTask(void *arg) {
-  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+bool IsShutdownRequested() {
+  struct pollfd shutdown_poll;
+  shutdown_poll.fd = shutdown_event_fd;
+  shutdown_poll.events = POLLIN;
+  return poll(&shutdown_poll, 1, 0) > 0;
+}
 
-  vector<bool> data(num_hardware_positions), prev_data(num_hardware_positions);
-  bool has_changed;
-  
-  while (true) {
-    has_changed = false;
-    ReadGPIO(&data);
-    for (HARDWARE_POSITIONS_TYPE i = 0; i < num_hardware_positions; i++) {
-      if (data.at(i) != prev_data.at(i)) {
-        has_changed = true;
-        break;
-      }
-    }
+// Tells every worker to return and waits for them
+void StopWorkThreads() {
+  eventfd_write(shutdown_event_fd, 1);
 
-    if (has_changed) {
-      for (int i = 0; i < num_hardware_positions; i++) {
-        if (data.at(i)) 
-          cout << '1';
-        else
-          cout << '0';
-      }
-      cout << endl;
+  for (auto thread : work_threads) {
+    pthread_join(thread, NULL);
+  }
+  work_threads.clear();
+}
+
+// Brings the pool up and reads the cabinet in the background, so GPIO and the serial
+// reader do not wait on the database. Scans are served from the first connection on
+void *DatabaseStartupThreadTask(void *arg) {
+  int shutdown_fd = *(int*)arg;
+
+  vector<thread> connectors = StartStartupConnectors(shutdown_fd);
+
+  while (!IsShutdownRequested()) {
+    auto conn = FetchConnection();
+    if (!conn) continue;
+
+    boot.Mark("Database connected");
+    if (!DoesCabinetExist(conn->conn.get())) {
+      cout << "Cabinet does not exist in database" << endl;
+      // TODO: Need to decide what to do, make new cabinet? Exit?
     }
 
-    prev_data.swap(data);
+    ReadCabinetIdIntoGlobal(conn->conn.get());
+    cout << "Cabinetid: " << cabinetid << endl;
+    break;
+  }
 
-    pthread_testcancel();
-    this_thread::sleep_for(chrono::milliseconds(10));
+  for (auto &connector : connectors) {
+    connector.join();
   }
 
   return NULL;
 }
 
+// Every failure after the database stage has started has to stop it before exiting
+void AbortStartup() {
+  StopWorkThreads();
+  db_watchdog.Stop();
+  CloseConnectionPool();
+  exit(1);
+}
+
+// Only wakes the main loop, which tears everything down. Anything more is not safe in a
+// signal handler, a lock the interrupted thread holds would never be released. A second
+// signal exits without waiting for the first one's teardown
 void HandleSignal(int signum) {
+  static volatile sig_atomic_t signalled = 0;
+  if (signalled) {
+    _exit(1);
+  }
+  signalled = 1;
+  int saved_errno = errno;
+  eventfd_write(shutdown_event_fd, 1);
+  errno = saved_errno;
+}
+
+// Run by main once the maintenance loop has seen the shutdown event
+void Shutdown() {
   try {
     cout << "\nKill signal received. Closing threads and exiting program..." << endl;
     // Add any cleanup here
     cout << "Closing worker threads..." << endl;
-    
-    for (auto thread : work_threads) {
-      pthread_cancel(thread);
-    }
 
-    for (auto thread : work_threads) {
-      pthread_join(thread, NULL);
-    }
-    
+    // Every worker watches the shutdown event and returns on its own
+    StopWorkThreads();
+
     cout << "Worker threads closed!" << endl;
+    db_watchdog.Stop();
     CloseConnectionPool();
-    CloseSerialPort(fd);
+    CloseSerialReaders();
+    PrintSerialReaderStats();
     cout << "Closing GPIO..." << endl;
+    CloseGPIOActor();
+    CloseEventSink();
+    PrintEventSinkStats();
+    CloseScanQueue();
+    PrintScanQueueStats();
+    CloseAuthCache();
+    PrintAuthCacheStats();
+    CloseAccessReplica();
+    PrintLockLatencies();
+    PrintTraceStats();
+    if (!metrics_path.empty()) {
+      ExportMetrics(metrics_path);
+    }
     ResetGPIO();
     CloseGPIO();
     cout << "GPIO closed!" << endl;
@@ -193,26 +297,13 @@ void HandleSignal(int signum) {
   exit(0);
 }
 
-bool IsHealthy(connection *conn) noexcept(true) {
-  if (!conn || !conn->is_open()) {
-    return false;
-  }
-  
-  try {
-    nontransaction ntxn(*conn, "health_check");
-    result result = ntxn.exec("SELECT version()");
-    
-    if (result.size() > 0) {
-      return true;
-    }
-  } catch (exception const &e) {
-    return false;
+int main() {
+  shutdown_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (shutdown_event_fd < 0) {
+    cout << "Could not create shutdown event" << endl;
+    exit(1);
   }
-  
-  return false;
-}
 
-int main() {
   signal(SIGINT, HandleSignal);
   signal(SIGTERM, HandleSignal);
 
@@ -221,59 +312,71 @@ int main() {
   cout << "Firmware initializing\nCores available: " << cores_available  << endl;
 
   LoadEnv();
+  boot.Mark("Environment loaded");
 
-  connect_db:
+  // Database, serial and GPIO are brought up side by side, none of them needs the others
   InitializeConnectionPools();
+  db_watchdog.Start();
+  pthread_t temp;
+  pthread_create(&temp, NULL, DatabaseStartupThreadTask, &shutdown_event_fd);
+  work_threads.push_back(temp);
 
-  auto conn = FetchConnection();
-  
-  if (!DoesCabinetExist(&conn->conn)) {
-    cout << "Cabinet does not exist in database" << endl;
-    // TODO: Need to decide what to do, make new cabinet? Exit?
-  }
-
-  ReadCabinetIdIntoGlobal(&conn->conn);
+  thread serial_startup([] {
+    if (OpenSerialReaders() > 0) {
+      boot.Mark("Serial readers open");
+    }
+  });
 
   cout << "Opening GPIO..." << endl;
 
-  if (OpenGPIOChip(getenv("GPIO_CHIP_NAME"))) {
-    cout << "Could not open GPIO chip" << endl;
-    // TODO: Decide what do to
-    CloseConnectionPool();
-    exit(1);
-  }
+  if (IsGPIOSimulated()) {
+    const char *simulated_positions = getenv("GPIO_SIMULATED_POSITIONS");
+    if (OpenSimulatedGPIO(simulated_positions == NULL ? 8 : atoi(simulated_positions))) {
+      cout << "Could not open simulated GPIO" << endl;
+      serial_startup.join();
+      AbortStartup();
+    }
+    cout << "Using simulated GPIO, no hardware will be driven" << endl;
+  } else {
+    if (OpenGPIOChip(getenv("GPIO_CHIP_NAME"))) {
+      cout << "Could not open GPIO chip" << endl;
+      // TODO: Decide what do to
+      serial_startup.join();
+      AbortStartup();
+    }
 
-  if (GetGPIOOutputLines()) {
-    cout << "Could not get GPIO output lines" << endl;
-    // TODO: Decide what do to
-    CloseGPIOChipOnly();
-    CloseConnectionPool();
-    exit(1);
-  }
+    if (GetGPIOOutputLines()) {
+      cout << "Could not get GPIO output lines" << endl;
+      // TODO: Decide what do to
+      CloseGPIOChipOnly();
+      serial_startup.join();
+      AbortStartup();
+    }
 
-  if (GetGPIOInputLines()) {
-    cout << "Could not get GPIO input lines" << endl;
-    // TODO: Decide what do to
-    CloseGPIOChipOnly();
-    CloseGPIOOutputLines();
-    CloseConnectionPool();
-    exit(1);
-  }
+    if (GetGPIOInputLines()) {
+      cout << "Could not get GPIO input lines" << endl;
+      // TODO: Decide what do to
+      CloseGPIOChipOnly();
+      CloseGPIOOutputLines();
+      serial_startup.join();
+      AbortStartup();
+    }
 
-  if (ConfigureGPIOChipOutput()) {
-    cout << "Could not configure GPIO output lines" << endl;
-    // TODO: Decide what do to
-    CloseGPIO();
-    CloseConnectionPool();
-    exit(1);
-  }
+    if (ConfigureGPIOChipOutput()) {
+      cout << "Could not configure GPIO output lines" << endl;
+      // TODO: Decide what do to
+      CloseGPIO();
+      serial_startup.join();
+      AbortStartup();
+    }
 
-  if (ConfigureGPIOChipInput()) {
-    cout << "Could not configure GPIO input lines" << endl;
-    // TODO: Decide what do to
-    CloseGPIO();
-    CloseConnectionPool();
-    exit(1);
+    if (ConfigureGPIOChipInput()) {
+      cout << "Could not configure GPIO input lines" << endl;
+      // TODO: Decide what do to
+      CloseGPIO();
+      serial_startup.join();
+      AbortStartup();
+    }
   }
 
   ResetGPIO();
@@ -281,8 +384,9 @@ int main() {
   ReadDipSwitchIntoGlobal();
 
   cout << "GPIO opened!" << endl;
+  boot.Mark("GPIO open");
 
-  cout << "Cabinetid: " << cabinetid << endl << "Num positions hardware: " << num_hardware_positions << endl;
+  cout << "Num positions hardware: " << num_hardware_positions << endl;
 
   // if (!DoesCabinetPositionMatchHardwarePositionCount(&conn->conn)) {
   //   cout << "Cabinet does not contain the same amount of positions as dip switches are reporting" << endl;
@@ -292,23 +396,86 @@ int main() {
   //   exit(1);
   // }
  
-  cout << "Initialization complete\nProgram will now run for the rest of eternity, unless stopped o7" << endl;
+  serial_startup.join();
 
-  fd = OpenSerialPort("/dev/ttyACM0");
-  ConfigureSerialPort(fd, 9600);
+  if (OpenGPIOActor()) {
+    cout << "Could not create GPIO command event" << endl;
+    ResetGPIO();
+    CloseGPIO();
+    AbortStartup();
+  }
 
-  pthread_t temp;
-  pthread_create(&temp, NULL, ReadSerialThreadTask, &fd);
+  const char *journal_path = getenv("EVENT_JOURNAL_PATH");
+  const char *journal_capacity = getenv("EVENT_JOURNAL_CAPACITY");
+  if (OpenEventSink(_connection_string, controller_serial_number,
+                    journal_path == NULL ? JOURNAL_DEFAULT_PATH : journal_path,
+                    journal_capacity == NULL || atoi(journal_capacity) <= 0 ? JOURNAL_DEFAULT_CAPACITY : atoi(journal_capacity))) {
+    cout << "Could not open the position event journal at " << (journal_path == NULL ? JOURNAL_DEFAULT_PATH : journal_path) << endl;
+    CloseGPIOActor();
+    ResetGPIO();
+    CloseGPIO();
+    AbortStartup();
+  }
+
+  const char *replica_path = getenv("ACCESS_REPLICA_PATH");
+  if (replica_path != NULL && OpenAccessReplica(_connection_string, controller_serial_number, replica_path)) {
+    cout << "Could not open the access replica" << endl;
+    CloseEventSink();
+    CloseGPIOActor();
+    ResetGPIO();
+    CloseGPIO();
+    AbortStartup();
+  }
+
+  const char *scan_journal_path = getenv("AUTH_JOURNAL_PATH");
+  const char *scan_journal_capacity = getenv("AUTH_JOURNAL_CAPACITY");
+  if (OpenAuthCache(scan_journal_path == NULL ? AUTH_AUDIT_DEFAULT_PATH : scan_journal_path,
+                    scan_journal_capacity == NULL || atoi(scan_journal_capacity) <= 0 ? AUTH_AUDIT_DEFAULT_CAPACITY : atoi(scan_journal_capacity))) {
+    cout << "Could not open the scan journal at " << (scan_journal_path == NULL ? AUTH_AUDIT_DEFAULT_PATH : scan_journal_path) << endl;
+    CloseEventSink();
+    CloseGPIOActor();
+    ResetGPIO();
+    CloseGPIO();
+    AbortStartup();
+  }
+
+  if (OpenScanQueue()) {
+    cout << "Could not create scan queue event" << endl;
+    CloseAuthCache();
+    CloseEventSink();
+    CloseGPIOActor();
+    ResetGPIO();
+    CloseGPIO();
+    AbortStartup();
+  }
+
+  pthread_create(&temp, NULL, AuthAuditThreadTask, &shutdown_event_fd);
   work_threads.push_back(temp);
-  pthread_create(&temp, NULL, ReadGPIOThreadTask, NULL);
+  for (size_t i = 0; i < scan_workers; i++) {
+    pthread_create(&temp, NULL, AuthWorkerThreadTask, &shutdown_event_fd);
+    work_threads.push_back(temp);
+  }
+  if (IsAccessReplicaEnabled()) {
+    pthread_create(&temp, NULL, AccessReplicaThreadTask, &shutdown_event_fd);
+    work_threads.push_back(temp);
+  }
+  pthread_create(&temp, NULL, SerialReadersThreadTask, &shutdown_event_fd);
+  work_threads.push_back(temp);
+  pthread_create(&temp, NULL, EventSinkThreadTask, &shutdown_event_fd);
+  work_threads.push_back(temp);
+  pthread_create(&temp, NULL, GPIOActorThreadTask, &shutdown_event_fd);
   work_threads.push_back(temp);
 
-  while (true) {
-    this_thread::sleep_for(chrono::seconds(1));
-    if (!IsHealthy(&conn->conn)) {
-      cout << "Database connection lost. Reconnecting..." << endl;
-      CloseConnectionPool();
-      goto connect_db;
-    }
+  cout << "Initialization complete\nProgram will now run for the rest of eternity, unless stopped o7" << endl;
+  boot.Mark("Serving scans");
+
+  // Dead connections are found from their sockets and rebuilt one by one, scans keep
+  // being served by the rest of the pool in the meantime
+  while (WaitForPoolMaintenance(shutdown_event_fd, chrono::seconds(1))) {
+    ProbeIdleConnections();
+    RepairBrokenConnections();
+    ProbeAuthBreaker();
+    ExportMetricsIfDue();
   }
+  Shutdown();
 }
@@ -0,0 +1,349 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <bit>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Log-linear buckets: values below 2^HISTOGRAM_SUB_BUCKET_BITS get a bucket each,
+// above that every power of two is split into HISTOGRAM_SUB_BUCKETS linear buckets,
+// so any recorded value is off by at most 1/HISTOGRAM_SUB_BUCKETS of itself
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Latency histogram in microseconds. Recording is a couple of relaxed atomic adds,
+// so any thread can record into a shared histogram without taking a lock
+class latency_histogram {
+ public:
+  void Record(chrono::nanoseconds latency) {
+    unsigned long value = max(0L, (long)chrono::duration_cast<chrono::microseconds>(latency).count());
+    counts[BucketIndex(value)].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(value, memory_order_relaxed);
+
+    unsigned long current = maximum.load(memory_order_relaxed);
+    while (value > current && !maximum.compare_exchange_weak(current, value, memory_order_relaxed)) {}
+  }
+
+  unsigned long Count() const {
+    return total.load(memory_order_relaxed);
+  }
+
+  unsigned long Sum() const {
+    return sum.load(memory_order_relaxed);
+  }
+
+  unsigned long Max() const {
+    return maximum.load(memory_order_relaxed);
+  }
+
+  // Upper bound of the bucket the given percentile (0 to 100) falls in
+  unsigned long Percentile(double percentile) const {
+    unsigned long count = Count();
+    if (count == 0) {
+      return 0;
+    }
+
+    unsigned long rank = max(1UL, (unsigned long)(percentile / 100.0 * count + 0.5)), seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      seen += counts[i].load(memory_order_relaxed);
+      if (seen >= rank) {
+        return min(BucketUpperBound(i), Max());
+      }
+    }
+    return Max();
+  }
+
+  static size_t BucketIndex(unsigned long value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+      return value;
+    }
+    int magnitude = bit_width(value) - 1;
+    size_t sub_bucket = (value >> (magnitude - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (magnitude - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+  }
+
+  static unsigned long BucketUpperBound(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+      return index;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    unsigned long lower = (unsigned long)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+    return lower + (1UL << shift) - 1;
+  }
+
+ private:
+  atomic<unsigned long> counts[HISTOGRAM_BUCKETS] = {};
+  atomic<unsigned long> total{0};
+  atomic<unsigned long> sum{0};
+  atomic<unsigned long> maximum{0};
+};
+
+void PrintHistogram(const char *name, const latency_histogram *histogram) {
+  cout << name << ": count=" << histogram->Count();
+  if (histogram->Count() > 0) {
+    cout << " p50=" << histogram->Percentile(50) << "us"
+         << " p90=" << histogram->Percentile(90) << "us"
+         << " p99=" << histogram->Percentile(99) << "us"
+         << " max=" << histogram->Max() << "us";
+  }
+  cout << endl;
+}
+
+// Milestones reached while the controller starts, each logged the first time it is hit.
+// Times are from when the process started and, to include the kernel and init, from
+// when the system booted
+class boot_trace {
+ public:
+  boot_trace() : start(chrono::steady_clock::now()) {}
+
+  void Mark(const char *milestone) {
+    lock_guard<mutex> lock(marks_mutex);
+    for (auto &mark : marks) {
+      if (mark.first == milestone) {
+        return;
+      }
+    }
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+    marks.emplace_back(milestone, elapsed);
+    cout << "[boot +" << elapsed.count() << "ms, " << SinceSystemBoot().count() << "ms since power on] "
+         << milestone << endl;
+  }
+
+  void Print() {
+    lock_guard<mutex> lock(marks_mutex);
+    cout << "Boot trace:" << endl;
+    for (auto &mark : marks) {
+      cout << "  +" << mark.second.count() << "ms " << mark.first << endl;
+    }
+  }
+
+ private:
+  static chrono::milliseconds SinceSystemBoot() {
+    struct timespec now;
+    if (clock_gettime(CLOCK_BOOTTIME, &now) < 0) {
+      return chrono::milliseconds(0);
+    }
+    return chrono::seconds(now.tv_sec) + chrono::duration_cast<chrono::milliseconds>(chrono::nanoseconds(now.tv_nsec));
+  }
+
+  chrono::steady_clock::time_point start;
+  mutex marks_mutex;
+  vector<pair<string, chrono::milliseconds>> marks;
+};
+
+boot_trace boot;
+
+// Tracepoints time the steps a scan goes through on its way to a latched lock. Every
+// thread records into its own shard with plain relaxed loads and stores, no locked
+// instruction and no shared cache line, so a tracepoint costs two clock reads and a few
+// adds. Shards are merged only when the totals are read. Durations are in nanoseconds
+// on the same log-linear buckets as latency_histogram
+
+// How often the Prometheus text file is rewritten
+#define METRICS_EXPORT_PERIOD 10000
+
+typedef enum _tracepoint {
+  // First byte of a frame read off the port to the frame being complete
+  TRACE_SERIAL_FRAME,
+  // A reader waking the serial thread to its bytes being decoded and queued
+  TRACE_SERIAL_DRAIN,
+  // Waiting for a pooled connection
+  TRACE_DB_CHECKOUT,
+  // cardScanned() round trip, one code or a batch
+  TRACE_DB_CARD_SCANNED,
+  // Shifting a word into the 595 chain
+  TRACE_GPIO_SHIFT_OUT,
+  // Driving OE to latch the shifted word onto the locks
+  TRACE_GPIO_LATCH,
+  // Frame complete to its unlock latched
+  TRACE_SCAN_TO_LATCH,
+  TRACEPOINT_COUNT
+} tracepoint;
+
+const char *TRACEPOINT_NAMES[TRACEPOINT_COUNT] = {
+  "serial_frame", "serial_drain", "db_checkout", "db_card_scanned", "gpio_shift_out", "gpio_latch", "scan_to_latch"
+};
+
+// Written only by the thread that owns it, read by anyone
+class trace_histogram {
+ public:
+  void Record(unsigned long value) {
+    Add(&counts[latency_histogram::BucketIndex(value)], 1);
+    Add(&total, 1);
+    Add(&sum, value);
+    if (value > maximum.load(memory_order_relaxed)) {
+      maximum.store(value, memory_order_relaxed);
+    }
+  }
+
+  // Adds this histogram's counts into a merged copy
+  void MergeInto(vector<unsigned long> *merged_counts, unsigned long *merged_total, unsigned long *merged_sum, unsigned long *merged_max) const {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      (*merged_counts)[i] += counts[i].load(memory_order_relaxed);
+    }
+    *merged_total += total.load(memory_order_relaxed);
+    *merged_sum += sum.load(memory_order_relaxed);
+    *merged_max = max(*merged_max, maximum.load(memory_order_relaxed));
+  }
+
+ private:
+  static void Add(atomic<unsigned long> *counter, unsigned long value) {
+    counter->store(counter->load(memory_order_relaxed) + value, memory_order_relaxed);
+  }
+
+  atomic<unsigned long> counts[HISTOGRAM_BUCKETS] = {};
+  atomic<unsigned long> total{0};
+  atomic<unsigned long> sum{0};
+  atomic<unsigned long> maximum{0};
+};
+
+typedef struct _trace_shard {
+  trace_histogram histograms[TRACEPOINT_COUNT];
+} trace_shard;
+
+// Shards outlive their threads, what a finished thread recorded still counts
+mutex trace_shards_mutex;
+vector<unique_ptr<trace_shard>> trace_shards;
+thread_local trace_shard *trace_local_shard = NULL;
+
+trace_shard *TraceShard() {
+  if (trace_local_shard == NULL) {
+    auto shard = make_unique<trace_shard>();
+    trace_local_shard = shard.get();
+    lock_guard<mutex> lock(trace_shards_mutex);
+    trace_shards.push_back(std::move(shard));
+  }
+  return trace_local_shard;
+}
+
+void Trace(tracepoint point, chrono::nanoseconds duration) {
+  TraceShard()->histograms[point].Record(max(0L, (long)duration.count()));
+}
+
+// Records the time since start
+void Trace(tracepoint point, chrono::steady_clock::time_point start) {
+  Trace(point, chrono::steady_clock::now() - start);
+}
+
+// Records the time until it goes out of scope
+class trace_scope {
+ public:
+  explicit trace_scope(tracepoint point) : point(point), start(chrono::steady_clock::now()) {}
+  ~trace_scope() {
+    Trace(point, start);
+  }
+
+ private:
+  tracepoint point;
+  chrono::steady_clock::time_point start;
+};
+
+// Every shard of one tracepoint added up
+typedef struct _trace_totals {
+  vector<unsigned long> counts = vector<unsigned long>(HISTOGRAM_BUCKETS);
+  unsigned long total = 0;
+  unsigned long sum = 0;
+  unsigned long maximum = 0;
+
+  unsigned long Percentile(double percentile) const {
+    unsigned long rank = max(1UL, (unsigned long)(percentile / 100.0 * total + 0.5)), seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return min(latency_histogram::BucketUpperBound(i), maximum);
+      }
+    }
+    return maximum;
+  }
+} trace_totals;
+
+trace_totals TraceTotals(tracepoint point) {
+  trace_totals totals;
+  lock_guard<mutex> lock(trace_shards_mutex);
+  for (auto &shard : trace_shards) {
+    shard->histograms[point].MergeInto(&totals.counts, &totals.total, &totals.sum, &totals.maximum);
+  }
+  return totals;
+}
+
+void PrintTraceStats() {
+  cout << "Tracepoints:" << endl;
+  for (size_t i = 0; i < TRACEPOINT_COUNT; i++) {
+    trace_totals totals = TraceTotals((tracepoint)i);
+    cout << "  " << TRACEPOINT_NAMES[i] << ": count=" << totals.total;
+    if (totals.total > 0) {
+      cout << " p50=" << totals.Percentile(50) / 1000.0 << "us"
+           << " p90=" << totals.Percentile(90) / 1000.0 << "us"
+           << " p99=" << totals.Percentile(99) / 1000.0 << "us"
+           << " max=" << totals.maximum / 1000.0 << "us";
+    }
+    cout << endl;
+  }
+}
+
+string metrics_path;
+chrono::steady_clock::time_point metrics_next_export;
+
+// Tracepoints as Prometheus histograms, for node_exporter's textfile collector. Bucket
+// bounds are powers of 4 from ~1us to ~17s, each falls on a bucket boundary so no bucket
+// is split between two bounds
+bool ExportMetrics(const string &path) {
+  string temporary = path + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "w");
+  if (file == NULL) {
+    return false;
+  }
+
+  fprintf(file, "# HELP simsafe_trace_seconds Time spent in each step from a card scan to its lock latching\n");
+  fprintf(file, "# TYPE simsafe_trace_seconds histogram\n");
+  for (size_t point = 0; point < TRACEPOINT_COUNT; point++) {
+    trace_totals totals = TraceTotals((tracepoint)point);
+    const char *name = TRACEPOINT_NAMES[point];
+
+    size_t bucket = 0;
+    unsigned long cumulative = 0;
+    for (int shift = 10; shift <= 34; shift += 2) {
+      unsigned long bound = 1UL << shift;
+      while (bucket < HISTOGRAM_BUCKETS && latency_histogram::BucketUpperBound(bucket) < bound) {
+        cumulative += totals.counts[bucket++];
+      }
+      fprintf(file, "simsafe_trace_seconds_bucket{point=\"%s\",le=\"%.9g\"} %lu\n", name, bound / 1e9, cumulative);
+    }
+    fprintf(file, "simsafe_trace_seconds_bucket{point=\"%s\",le=\"+Inf\"} %lu\n", name, totals.total);
+    fprintf(file, "simsafe_trace_seconds_sum{point=\"%s\"} %.9f\n", name, totals.sum / 1e9);
+    fprintf(file, "simsafe_trace_seconds_count{point=\"%s\"} %lu\n", name, totals.total);
+  }
+
+  // The collector never sees a half written file
+  bool written = fflush(file) == 0;
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Run from the maintenance loop, rewrites the metrics file every METRICS_EXPORT_PERIOD
+void ExportMetricsIfDue() {
+  auto now = chrono::steady_clock::now();
+  if (metrics_path.empty() || now < metrics_next_export) {
+    return;
+  }
+  metrics_next_export = now + chrono::milliseconds(METRICS_EXPORT_PERIOD);
+  if (!ExportMetrics(metrics_path)) {
+    cout << "Could not write metrics to " << metrics_path << endl;
+  }
+}
@@ -0,0 +1,115 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <bit>
+#include <limits>
+
+using namespace std;
+
+#define HARDWARE_POSITIONS_TYPE u_int16_t
+
+// Largest number of positions the firmware handles, every position word is sized for
+// this at compile time. Build with -DMAX_HARDWARE_POSITIONS=8 for a single board or
+// -DMAX_HARDWARE_POSITIONS=4096 for a long chain
+#ifndef MAX_HARDWARE_POSITIONS
+#define MAX_HARDWARE_POSITIONS 256
+#endif
+
+// One bit per position packed into 64 bit words, bit i % 64 of word i / 64 is position i.
+// The storage is a fixed array, so a position word never allocates and copying one is
+// a handful of word moves. Whole word operations are plain loops over that array, which
+// the compiler unrolls and vectorises. Bits past the positions in use are kept clear
+template <size_t Capacity>
+class position_bitset {
+  static_assert(Capacity > 0 && Capacity - 1 <= numeric_limits<HARDWARE_POSITIONS_TYPE>::max(),
+                "Capacity must be addressable by HARDWARE_POSITIONS_TYPE");
+
+ public:
+  static constexpr size_t CAPACITY = Capacity;
+  static constexpr size_t WORD_COUNT = (Capacity + 63) / 64;
+
+  bool Test(size_t position) const {
+    return (words[position / 64] >> (position % 64)) & 1;
+  }
+
+  void Set(size_t position, bool value = true) {
+    uint64_t mask = 1ULL << (position % 64);
+    if (value) {
+      words[position / 64] |= mask;
+    } else {
+      words[position / 64] &= ~mask;
+    }
+  }
+
+  void Clear() {
+    for (size_t w = 0; w < WORD_COUNT; w++) {
+      words[w] = 0;
+    }
+  }
+
+  uint64_t Word(size_t index) const {
+    return words[index];
+  }
+
+  void SetWord(size_t index, uint64_t value) {
+    words[index] = value;
+  }
+
+  size_t Count() const {
+    size_t count = 0;
+    for (size_t w = 0; w < WORD_COUNT; w++) {
+      count += popcount(words[w]);
+    }
+    return count;
+  }
+
+  bool Any() const {
+    uint64_t any = 0;
+    for (size_t w = 0; w < WORD_COUNT; w++) {
+      any |= words[w];
+    }
+    return any != 0;
+  }
+
+  // Calls visit(position) for every set bit, lowest first. Each word is read before its
+  // bits are visited, so visit may clear bits of the set it is walking
+  template <typename F>
+  void ForEach(F visit) const {
+    for (size_t w = 0; w < WORD_COUNT; w++) {
+      uint64_t bits = words[w];
+      while (bits != 0) {
+        visit((HARDWARE_POSITIONS_TYPE)(w * 64 + countr_zero(bits)));
+        bits &= bits - 1;
+      }
+    }
+  }
+
+  position_bitset operator^(const position_bitset &other) const {
+    position_bitset result;
+    for (size_t w = 0; w < WORD_COUNT; w++) {
+      result.words[w] = words[w] ^ other.words[w];
+    }
+    return result;
+  }
+
+  position_bitset operator&(const position_bitset &other) const {
+    position_bitset result;
+    for (size_t w = 0; w < WORD_COUNT; w++) {
+      result.words[w] = words[w] & other.words[w];
+    }
+    return result;
+  }
+
+  position_bitset &operator|=(const position_bitset &other) {
+    for (size_t w = 0; w < WORD_COUNT; w++) {
+      words[w] |= other.words[w];
+    }
+    return *this;
+  }
+
+  bool operator==(const position_bitset &other) const = default;
+
+ private:
+  uint64_t words[WORD_COUNT] = {};
+};
+
+typedef position_bitset<MAX_HARDWARE_POSITIONS> position_word;
@@ -0,0 +1,132 @@
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <sys/eventfd.h>
+
+using namespace std;
+
+// Scans are decoded on the serial reader thread and authorized on a pool of workers, so a
+// burst of people scanning is answered side by side instead of one round trip after
+// another. Every worker's access goes to the GPIO thread as its own unlock, and the
+// unlocks that arrive together are shifted out as one word
+
+#define SCAN_QUEUE_SIZE 64
+#define SCAN_WORKERS 4
+// The same code scanned again within this long is taken as one scan
+#define SCAN_DEDUP_WINDOW 2000
+// Entries the deduplicator holds before it forgets the ones past the window
+#define SCAN_DEDUP_PRUNE_SIZE 64
+
+typedef struct _queued_scan {
+  string auth_code;
+  chrono::steady_clock::time_point scanned_at;
+  // Index of the reader in serial_readers
+  size_t reader;
+} queued_scan;
+
+size_t scan_workers = SCAN_WORKERS;
+chrono::milliseconds scan_dedup_window(SCAN_DEDUP_WINDOW);
+bounded_queue<queued_scan, SCAN_QUEUE_SIZE> scan_queue;
+int scan_queue_event_fd = -1;
+
+atomic<unsigned long> scans_queued{0};
+atomic<unsigned long> scans_deduplicated{0};
+// Queue was full, every worker was busy for SCAN_QUEUE_SIZE scans
+atomic<unsigned long> scans_dropped{0};
+// Scan to a worker picking it up
+latency_histogram scan_queue_latency;
+
+// Workers past the pool's connection count only wait for a connection
+bool SetScanWorkers(const char *workers) {
+  if (workers == NULL) return false;
+  char *end;
+  long count = strtol(workers, &end, 10);
+  if (*workers == '\0' || *end != '\0' || count < 1 || count > SCAN_QUEUE_SIZE) return false;
+  scan_workers = count;
+  return true;
+}
+
+// Milliseconds, 0 passes every scan through
+bool SetScanDedupWindow(const char *window) {
+  if (window == NULL) return false;
+  char *end;
+  long ms = strtol(window, &end, 10);
+  if (*window == '\0' || *end != '\0' || ms < 0) return false;
+  scan_dedup_window = chrono::milliseconds(ms);
+  return true;
+}
+
+// Drops repeats of a code within scan_dedup_window of the scan that was let through.
+// The thread reading the scans fills it in, and a worker whose scan opened nothing
+// forgets it again so the card can be scanned again straight away
+class scan_deduplicator {
+ public:
+  bool IsRepeat(string_view auth_code, chrono::steady_clock::time_point now) {
+    if (scan_dedup_window.count() == 0) {
+      return false;
+    }
+
+    uint64_t key = AuthCacheKey(auth_code).key;
+    lock_guard<mutex> lock(seen_mutex);
+    auto last = seen.find(key);
+    if (last != seen.end() && now - last->second < scan_dedup_window) {
+      return true;
+    }
+
+    if (seen.size() >= SCAN_DEDUP_PRUNE_SIZE) {
+      erase_if(seen, [&](const auto &entry) { return now - entry.second >= scan_dedup_window; });
+    }
+    seen[key] = now;
+    return false;
+  }
+
+  // Only the entry the scan at scanned_at made, a later scan that was let through stays
+  void Forget(string_view auth_code, chrono::steady_clock::time_point scanned_at) {
+    uint64_t key = AuthCacheKey(auth_code).key;
+    lock_guard<mutex> lock(seen_mutex);
+    auto last = seen.find(key);
+    if (last != seen.end() && last->second == scanned_at) {
+      seen.erase(last);
+    }
+  }
+
+ private:
+  mutex seen_mutex;
+  unordered_map<uint64_t, chrono::steady_clock::time_point> seen;
+};
+
+int OpenScanQueue() {
+  scan_queue_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  return scan_queue_event_fd < 0 ? -1 : 0;
+}
+
+void CloseScanQueue() {
+  close(scan_queue_event_fd);
+  scan_queue_event_fd = -1;
+}
+
+// Returns false when the scan was not queued, as a repeat or because the queue is full
+bool QueueScan(scan_deduplicator *deduplicator, string_view auth_code, chrono::steady_clock::time_point scanned_at, size_t reader) {
+  if (deduplicator->IsRepeat(auth_code, scanned_at)) {
+    scans_deduplicated++;
+    return false;
+  }
+
+  if (!scan_queue.TryPush({ .auth_code = string(auth_code), .scanned_at = scanned_at, .reader = reader })) {
+    scans_dropped++;
+    cout << "Scan queue full, discarding input" << endl;
+    return false;
+  }
+
+  scans_queued++;
+  eventfd_write(scan_queue_event_fd, 1);
+  return true;
+}
+
+void PrintScanQueueStats() {
+  cout << "Scans: queued=" << scans_queued << " deduplicated=" << scans_deduplicated << " dropped=" << scans_dropped << endl;
+  PrintHistogram("Scan to worker", &scan_queue_latency);
+}
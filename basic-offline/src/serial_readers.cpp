@@ -0,0 +1,372 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+using namespace std;
+
+// Every card reader is its own serial device, all of them are read by one thread through
+// one epoll set. Each reader has its own frame decoder and deduplicator, so bytes from two
+// readers never end up in one frame. Readers can be unplugged and plugged back in: the
+// directories holding them are watched with inotify and a reader is reopened as soon as
+// its device node is back
+
+#define SERIAL_MAX_READERS 16
+#define SERIAL_DEFAULT_READERS "/dev/ttyACM0"
+#define SERIAL_DEFAULT_BAUD 9600
+// Missing readers are also retried this often. inotify cannot watch a directory that is
+// not there yet, /dev/serial/by-id only exists once the first device is plugged in
+#define SERIAL_RETRY_PERIOD 5000
+// epoll tags, a reader's tag is SERIAL_TAG_READERS plus its index
+#define SERIAL_TAG_SHUTDOWN 0
+#define SERIAL_TAG_HOTPLUG 1
+#define SERIAL_TAG_READERS 2
+
+typedef struct _serial_reader {
+  string id;
+  string path;
+  long baud;
+  int fd = -1;
+  frame_decoder decoder;
+  scan_deduplicator deduplicator;
+  // When the first byte of the frame in the decoder was read
+  chrono::steady_clock::time_point frame_started;
+  unsigned long frames = 0;
+  unsigned long connects = 0;
+  // Overflows of the decoders dropped on earlier disconnects
+  unsigned long overflows = 0;
+  // Scan on this reader to its unlock being latched
+  latency_histogram scan_to_unlock;
+  // Scans that were denied or only held open positions already open, nothing was latched
+  atomic<unsigned long> unlatched_scans{0};
+} serial_reader;
+
+// Set once from the environment, readers are only ever opened and closed after that
+vector<unique_ptr<serial_reader>> serial_readers;
+
+// Comma separated [id=]path[@baud], the id defaults to the device name
+bool SetSerialReaders(const char *readers) {
+  if (readers == NULL) return false;
+
+  vector<unique_ptr<serial_reader>> parsed;
+  string_view list(readers);
+
+  while (true) {
+    size_t comma = list.find(',');
+    string_view entry = list.substr(0, comma);
+    auto reader = make_unique<serial_reader>();
+
+    size_t equals = entry.find('=');
+    if (equals != string_view::npos) {
+      reader->id = entry.substr(0, equals);
+      entry.remove_prefix(equals + 1);
+    }
+
+    reader->baud = SERIAL_DEFAULT_BAUD;
+    size_t at = entry.rfind('@');
+    if (at != string_view::npos) {
+      string baud(entry.substr(at + 1));
+      char *end;
+      reader->baud = strtol(baud.c_str(), &end, 10);
+      if (baud.empty() || *end != '\0' || SerialSpeed(reader->baud) == B0) return false;
+      entry = entry.substr(0, at);
+    }
+
+    if (entry.empty() || entry[0] != '/') return false;
+    reader->path = entry;
+    if (equals == string_view::npos) {
+      reader->id = reader->path.substr(reader->path.rfind('/') + 1);
+    }
+    if (reader->id.empty()) return false;
+
+    for (auto &other : parsed) {
+      if (other->id == reader->id || other->path == reader->path) return false;
+    }
+    parsed.push_back(move(reader));
+    if (parsed.size() > SERIAL_MAX_READERS) return false;
+
+    if (comma == string_view::npos) break;
+    list.remove_prefix(comma + 1);
+  }
+
+  serial_readers = move(parsed);
+  return true;
+}
+
+// Returns false when the device is not there or will not take its settings
+bool OpenSerialReaderDevice(serial_reader *reader) {
+  // An unplugged reader is expected, only a device that is there and fails is reported
+  if (access(reader->path.c_str(), F_OK) != 0) return false;
+
+  int fd = OpenSerialPort(reader->path.c_str());
+  if (fd < 0) return false;
+
+  if (!ConfigureSerialPort(fd, reader->baud)) {
+    CloseSerialPort(fd);
+    return false;
+  }
+
+  reader->fd = fd;
+  reader->connects++;
+  cout << "Reader " << reader->id << " connected on " << reader->path << endl;
+  return true;
+}
+
+// Opens whichever readers are plugged in, the reader thread picks up the rest when they
+// appear. Returns the number opened
+size_t OpenSerialReaders() {
+  if (serial_readers.empty()) {
+    SetSerialReaders(SERIAL_DEFAULT_READERS);
+  }
+
+  size_t opened = 0;
+  for (auto &reader : serial_readers) {
+    if (OpenSerialReaderDevice(reader.get())) {
+      opened++;
+    } else {
+      cout << "Reader " << reader->id << " not available on " << reader->path << ", waiting for it" << endl;
+    }
+  }
+  return opened;
+}
+
+void CloseSerialReaders() {
+  for (auto &reader : serial_readers) {
+    if (reader->fd >= 0) {
+      CloseSerialPort(reader->fd);
+      reader->fd = -1;
+    }
+  }
+}
+
+// Opens the reader if it is not open yet and starts watching it
+bool AttachSerialReader(int epoll_fd, size_t index) {
+  serial_reader *reader = serial_readers[index].get();
+  if (reader->fd < 0 && !OpenSerialReaderDevice(reader)) return false;
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u64 = SERIAL_TAG_READERS + index;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reader->fd, &event) != 0) {
+    cerr << "Error adding reader " << reader->id << " to epoll" << endl;
+    CloseSerialPort(reader->fd);
+    reader->fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void DetachSerialReader(int epoll_fd, size_t index, const char *reason) {
+  serial_reader *reader = serial_readers[index].get();
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, reader->fd, NULL);
+  CloseSerialPort(reader->fd);
+  reader->fd = -1;
+  // A frame cut off by the unplug is not joined to the first one after it comes back
+  reader->overflows += reader->decoder.Overflows();
+  reader->decoder = frame_decoder();
+  cout << "Reader " << reader->id << " " << reason << ", waiting for it to come back" << endl;
+}
+
+// Returns false when the reader is gone: EOF, a read error or a hangup
+bool ReadSerialReader(size_t index, uint32_t events) {
+  serial_reader *reader = serial_readers[index].get();
+  string_view frame;
+  int bytes_read = 0;
+
+  if (events & EPOLLIN) {
+    trace_scope trace(TRACE_SERIAL_DRAIN);
+    // Drain everything the port has buffered before blocking again
+    while (true) {
+      char *write_pointer = reader->decoder.WritePointer();
+      if ((bytes_read = ReadFromSerialPort(reader->fd, write_pointer, reader->decoder.WriteCapacity())) <= 0) break;
+      auto now = chrono::steady_clock::now();
+      if (reader->decoder.Buffered() == 0) {
+        reader->frame_started = now;
+      }
+      reader->decoder.Commit(bytes_read);
+      // One read can hold several frames, each is queued for the auth workers
+      while (reader->decoder.NextFrame(&frame)) {
+        reader->frames++;
+        Trace(TRACE_SERIAL_FRAME, reader->frame_started);
+        QueueScan(&reader->deduplicator, frame, now, index);
+        // The rest of this read starts the next frame
+        reader->frame_started = now;
+      }
+    }
+
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true;
+    }
+  }
+
+  // Anything other than readable data on the port is EPOLLHUP or EPOLLERR
+  return false;
+}
+
+// Adds a watch for every reader directory not watched yet. Returns true when all of them are
+bool WatchSerialReaderDirectories(int hotplug_fd, unordered_map<int, string> *watched) {
+  if (hotplug_fd < 0) return false;
+
+  bool all_watched = true;
+  for (auto &reader : serial_readers) {
+    string directory = reader->path.substr(0, reader->path.rfind('/') + 1);
+    bool found = false;
+    for (auto &entry : *watched) {
+      if (entry.second == directory) {
+        found = true;
+        break;
+      }
+    }
+    if (found) continue;
+
+    int wd = inotify_add_watch(hotplug_fd, directory.c_str(), IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM);
+    if (wd < 0) {
+      all_watched = false;
+      continue;
+    }
+    (*watched)[wd] = directory;
+  }
+  return all_watched;
+}
+
+// Opens readers whose device node appeared, or had its permissions set by udev, and
+// closes readers whose node went away. Returns false when a watched directory was removed
+bool HandleSerialHotplug(int hotplug_fd, int epoll_fd, unordered_map<int, string> *watched) {
+  alignas(struct inotify_event) char buffer[4096];
+  ssize_t length;
+  bool all_watched = true;
+
+  while ((length = read(hotplug_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *next = buffer; next < buffer + length;) {
+      struct inotify_event *event = (struct inotify_event *)next;
+      next += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_IGNORED) {
+        watched->erase(event->wd);
+        all_watched = false;
+        continue;
+      }
+
+      auto directory = watched->find(event->wd);
+      if (event->len == 0 || directory == watched->end()) continue;
+
+      string path = directory->second + event->name;
+      for (size_t i = 0; i < serial_readers.size(); i++) {
+        if (serial_readers[i]->path != path) continue;
+
+        if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+          if (serial_readers[i]->fd >= 0) DetachSerialReader(epoll_fd, i, "removed");
+        } else if (serial_readers[i]->fd < 0) {
+          AttachSerialReader(epoll_fd, i);
+        }
+      }
+    }
+  }
+
+  return all_watched;
+}
+
+// Reads every reader until the shutdown eventfd passed as arg becomes readable
+void *SerialReadersThreadTask(void *arg) {
+  int shutdown_fd = *(int*)arg;
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    cout << "Could not start serial event loop, no scans will be read" << endl;
+    return NULL;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u64 = SERIAL_TAG_SHUTDOWN;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, shutdown_fd, &event) != 0) {
+    cout << "Could not start serial event loop, no scans will be read" << endl;
+    close(epoll_fd);
+    return NULL;
+  }
+
+  int hotplug_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  event.data.u64 = SERIAL_TAG_HOTPLUG;
+  if (hotplug_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, hotplug_fd, &event) != 0) {
+    close(hotplug_fd);
+    hotplug_fd = -1;
+  }
+  if (hotplug_fd < 0) {
+    cout << "Could not watch for readers being plugged in, retrying every " << SERIAL_RETRY_PERIOD << "ms instead" << endl;
+  }
+
+  unordered_map<int, string> watched;
+  bool all_watched = WatchSerialReaderDirectories(hotplug_fd, &watched);
+  for (size_t i = 0; i < serial_readers.size(); i++) {
+    AttachSerialReader(epoll_fd, i);
+  }
+
+  struct epoll_event events[SERIAL_MAX_READERS + 2];
+  bool running = true;
+
+  while (running) {
+    bool waiting = !all_watched;
+    for (auto &reader : serial_readers) {
+      if (reader->fd < 0) waiting = true;
+    }
+
+    int count = epoll_wait(epoll_fd, events, SERIAL_MAX_READERS + 2, waiting ? SERIAL_RETRY_PERIOD : -1);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      cout << "Serial event loop failed, no longer reading scans" << endl;
+      break;
+    }
+
+    if (count == 0) {
+      all_watched = WatchSerialReaderDirectories(hotplug_fd, &watched);
+      for (size_t i = 0; i < serial_readers.size(); i++) {
+        if (serial_readers[i]->fd < 0) AttachSerialReader(epoll_fd, i);
+      }
+      continue;
+    }
+
+    bool hotplug = false;
+    for (int i = 0; i < count; i++) {
+      uint64_t tag = events[i].data.u64;
+      if (tag == SERIAL_TAG_SHUTDOWN) {
+        running = false;
+      } else if (tag == SERIAL_TAG_HOTPLUG) {
+        hotplug = true;
+      } else {
+        size_t index = tag - SERIAL_TAG_READERS;
+        if (serial_readers[index]->fd >= 0 && !ReadSerialReader(index, events[i].events)) {
+          DetachSerialReader(epoll_fd, index, "disconnected");
+        }
+      }
+    }
+
+    // After the readers, so a hangup in this batch never closes a reader just reopened
+    if (hotplug && running && !HandleSerialHotplug(hotplug_fd, epoll_fd, &watched)) {
+      all_watched = false;
+    }
+  }
+
+  if (hotplug_fd >= 0) close(hotplug_fd);
+  close(epoll_fd);
+
+  return NULL;
+}
+
+void PrintSerialReaderStats() {
+  for (auto &reader : serial_readers) {
+    cout << "Reader " << reader->id << ": frames=" << reader->frames << " connects=" << reader->connects
+         << " overflows=" << reader->overflows + reader->decoder.Overflows()
+         << " unlatched=" << reader->unlatched_scans << endl;
+    PrintHistogram(("Reader " + reader->id + " scan to unlock").c_str(), &reader->scan_to_unlock);
+  }
+}
@@ -0,0 +1,97 @@
+#include <vector>
+#include <algorithm>
+#include <stddef.h>
+
+using namespace std;
+
+#define TIMER_WHEEL_SLOTS 256
+#define TIMER_WHEEL_NONE ((size_t)-1)
+
+// Hashed timer wheel over a dense set of ids (one per position).
+// A timer lives in slot expiry % TIMER_WHEEL_SLOTS on an intrusive list, so
+// scheduling, rescheduling and cancelling are O(1) and advancing one tick only
+// looks at the timers that hash to that tick. Delays longer than one turn of the
+// wheel simply stay in their slot until their expiry tick comes around
+class timer_wheel {
+ public:
+  explicit timer_wheel(size_t capacity) : entries(capacity) {
+    for (size_t i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+      heads[i] = TIMER_WHEEL_NONE;
+    }
+  }
+
+  // Replaces any timer id already has
+  void Schedule(size_t id, unsigned long delay_ticks) {
+    Cancel(id);
+
+    entry *timer = &entries.at(id);
+    timer->expiry = current_tick + max(delay_ticks, 1UL);
+    timer->scheduled = true;
+
+    size_t slot = timer->expiry % TIMER_WHEEL_SLOTS;
+    timer->prev = TIMER_WHEEL_NONE;
+    timer->next = heads[slot];
+    if (heads[slot] != TIMER_WHEEL_NONE) {
+      entries[heads[slot]].prev = id;
+    }
+    heads[slot] = id;
+  }
+
+  void Cancel(size_t id) {
+    entry *timer = &entries.at(id);
+    if (!timer->scheduled) {
+      return;
+    }
+
+    if (timer->prev != TIMER_WHEEL_NONE) {
+      entries[timer->prev].next = timer->next;
+    } else {
+      heads[timer->expiry % TIMER_WHEEL_SLOTS] = timer->next;
+    }
+    if (timer->next != TIMER_WHEEL_NONE) {
+      entries[timer->next].prev = timer->prev;
+    }
+    timer->scheduled = false;
+  }
+
+  bool IsScheduled(size_t id) const {
+    return entries.at(id).scheduled;
+  }
+
+  // Moves the wheel forward to tick and calls expire(id) for every timer that is due.
+  // expire must not schedule or cancel timers itself
+  template <typename F>
+  void Advance(unsigned long tick, F expire) {
+    if (tick <= current_tick) {
+      return;
+    }
+
+    // After a full turn every slot has been visited, no need to go round again
+    unsigned long steps = min(tick - current_tick, (unsigned long)TIMER_WHEEL_SLOTS);
+    for (unsigned long step = 1; step <= steps; step++) {
+      size_t id = heads[(current_tick + step) % TIMER_WHEEL_SLOTS];
+      while (id != TIMER_WHEEL_NONE) {
+        size_t next = entries[id].next;
+        if (entries[id].expiry <= tick) {
+          Cancel(id);
+          expire(id);
+        }
+        id = next;
+      }
+    }
+
+    current_tick = tick;
+  }
+
+ private:
+  struct entry {
+    size_t next = TIMER_WHEEL_NONE;
+    size_t prev = TIMER_WHEEL_NONE;
+    unsigned long expiry = 0;
+    bool scheduled = false;
+  };
+
+  vector<entry> entries;
+  size_t heads[TIMER_WHEEL_SLOTS];
+  unsigned long current_tick = 0;
+};
@@ -0,0 +1,95 @@
+#include "check.cpp"
+#include "../src/database.cpp"
+
+#include <random>
+
+// Text and bitmap access decoded against each other at chain lengths that end inside a
+// byte, on a byte and on either side of a word, up to the build's MAX_HARDWARE_POSITIONS.
+// Run with CXXFLAGS+=-DMAX_HARDWARE_POSITIONS=4096 to cover the long chain builds
+
+string ToBitmap(const vector<uint8_t> &bytes, bool upper_case) {
+  string bitmap = "\\x";
+  for (uint8_t byte : bytes) {
+    bitmap += (upper_case ? "0123456789ABCDEF" : "0123456789abcdef")[byte >> 4];
+    bitmap += (upper_case ? "0123456789ABCDEF" : "0123456789abcdef")[byte & 0xf];
+  }
+  return bitmap;
+}
+
+// Every position open, every third, the last one alone and random ones, in both formats.
+// Bits a bitmap carries past the chain have to come out closed and anything past the
+// chain is dropped and counted
+void TestBothFormatsAgree(size_t positions, mt19937 *rng) {
+  for (int pattern = 0; pattern < 4; pattern++) {
+    position_word expected, from_text, from_bitmap;
+    string text(positions, '0');
+    vector<uint8_t> bytes((positions + 7) / 8, 0);
+    for (size_t i = 0; i < positions; i++) {
+      bool open = pattern == 0 || (pattern == 1 && i % 3 == 0) || (pattern == 2 && i == positions - 1) || (pattern == 3 && (*rng)() % 2);
+      if (open) {
+        expected.Set(i);
+        text[i] = '1';
+        bytes[i / 8] |= 1 << (i % 8);
+      }
+    }
+    if (pattern == 0 || pattern == 3) {
+      bytes.back() |= 0xff << (positions % 8 == 0 ? 8 : positions % 8);
+    }
+    string bitmap = ToBitmap(bytes, pattern == 3);
+
+    unsigned long mismatches = access_length_mismatches;
+    ReadAccessText(text, positions, &from_text);
+    CHECK(ReadAccessBitmap(bitmap, positions, &from_bitmap));
+    CHECK(from_text == expected);
+    CHECK(from_bitmap == expected);
+    CHECK(access_length_mismatches == mismatches);
+
+    from_text.Clear();
+    from_bitmap.Clear();
+    ReadAccessText(text + "1", positions, &from_text);
+    CHECK(ReadAccessBitmap(bitmap + "ff", positions, &from_bitmap));
+    CHECK(from_text == expected);
+    CHECK(from_bitmap == expected);
+    CHECK(access_length_mismatches == mismatches + 2);
+  }
+
+  // A short answer leaves the positions it does not cover closed
+  unsigned long mismatches = access_length_mismatches;
+  if (positions > 1) {
+    position_word short_text;
+    ReadAccessText(string(positions - 1, '1'), positions, &short_text);
+    CHECK(short_text.Count() == positions - 1);
+    CHECK(!short_text.Test(positions - 1));
+    CHECK(access_length_mismatches == ++mismatches);
+  }
+  if (positions > 8) {
+    position_word short_bitmap;
+    CHECK(ReadAccessBitmap("\\x" + string((positions + 7) / 8 * 2 - 2, 'f'), positions, &short_bitmap));
+    CHECK(short_bitmap.Count() == ((positions + 7) / 8 - 1) * 8);
+    CHECK(access_length_mismatches == ++mismatches);
+  }
+}
+
+// Anything that is not a hex bytea is refused and leaves the output as it was, an empty
+// answer of either kind opens nothing
+void TestMalformed() {
+  position_word access;
+  access.Set(3);
+  for (const char *bad : { "\\x0g00", "0f00", "\\x0f0", "x0f", "\\", "" }) {
+    CHECK(!ReadAccessBitmap(bad, 16, &access));
+  }
+  CHECK(access.Test(3) && access.Count() == 1);
+  CHECK(ReadAccessBitmap("\\x", 16, &access));
+  ReadAccessText("", 16, &access);
+  CHECK(access.Test(3) && access.Count() == 1);
+}
+
+int main() {
+  mt19937 rng(7);
+  for (size_t positions : { 1, 7, 8, 9, 63, 64, 65, 127, 129, MAX_HARDWARE_POSITIONS - 1, MAX_HARDWARE_POSITIONS }) {
+    if (positions < 1 || positions > MAX_HARDWARE_POSITIONS) continue;
+    TestBothFormatsAgree(positions, &rng);
+  }
+  TestMalformed();
+  return CheckResult("access_decoding_test");
+}
@@ -0,0 +1,184 @@
+#include "check.cpp"
+#include "fake_postgres.cpp"
+#include "../src/database.cpp"
+#include "../src/gpio_actor.cpp"
+#include "../src/auth_cache.cpp"
+
+#include <stdlib.h>
+
+// Scans granted from the cache while the database is away are kept in the scan journal
+// and recorded once it is back, across a restart too. A scan the journal has no room
+// for is not granted locally
+
+#define TEST_POOL_SIZE 4
+#define TEST_DEADLINE_MS 200
+#define TEST_JOURNAL_CAPACITY 8
+
+// Every statement hangs up on the controller instead
+atomic<bool> server_down{false};
+
+fake_reply AnswerCards(const fake_statement &statement) {
+  fake_reply reply;
+  if (server_down) {
+    reply.hang_up = true;
+  } else if (statement.query.find("($1, $2)") != string::npos) {
+    reply.rows = { { "1010" } };
+  } else {
+    reply.rows = { { "1" } };
+  }
+  return reply;
+}
+
+string journal_path;
+
+// Pool maintenance the way main runs it, until shutdown_fd becomes readable
+void RunPoolMaintenance(int shutdown_fd) {
+  while (WaitForPoolMaintenance(shutdown_fd, chrono::milliseconds(50))) {
+    ProbeIdleConnections();
+    RepairBrokenConnections();
+    ProbeAuthBreaker();
+  }
+}
+
+size_t CountCardScanned(fake_postgres *server) {
+  size_t found = 0;
+  for (auto &statement : server->Statements()) {
+    if (statement.query.find("($1, $2)") != string::npos) found++;
+  }
+  return found;
+}
+
+// Waits until recorded reaches target, false when it does not within timeout
+bool WaitForRecorded(unsigned long target, chrono::milliseconds timeout) {
+  auto deadline = chrono::steady_clock::now() + timeout;
+  while (auth_audits_recorded < target) {
+    if (chrono::steady_clock::now() > deadline) return false;
+    this_thread::sleep_for(chrono::milliseconds(5));
+  }
+  return true;
+}
+
+class audit_thread {
+ public:
+  audit_thread() {
+    shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pthread_create(&thread, NULL, AuthAuditThreadTask, &shutdown_fd);
+  }
+
+  ~audit_thread() {
+    eventfd_write(shutdown_fd, 1);
+    pthread_join(thread, NULL);
+    close(shutdown_fd);
+  }
+
+  int shutdown_fd;
+  pthread_t thread;
+};
+
+bool Scan(const char *auth_code) {
+  position_word access;
+  return AuthorizeScan(auth_code, chrono::steady_clock::now(), &access) && access.Count() == 2;
+}
+
+// Cache hits while the server is away are granted and wait in the journal
+void TestRecordedAfterOutage(fake_postgres *server) {
+  audit_thread audit;
+  CHECK(Scan("A"));
+
+  server->ClearStatements();
+  unsigned long recorded = auth_audits_recorded;
+  server_down = true;
+  for (int i = 0; i < 5; i++) {
+    CHECK(Scan("A"));
+  }
+  this_thread::sleep_for(chrono::milliseconds(AUTH_AUDIT_RETRY_PERIOD / 2));
+  CHECK(auth_audits_recorded == recorded);
+
+  server_down = false;
+  server->ClearStatements();
+  CHECK(WaitForRecorded(recorded + 5, chrono::milliseconds(AUTH_BREAKER_PROBE_PERIOD + AUTH_AUDIT_RETRY_PERIOD * 2)));
+  CHECK(CountCardScanned(server) == 5);
+  CHECK(auth_audit_journal.Head() == auth_audit_journal.Flushed());
+}
+
+// Scans journaled before a restart are recorded after it
+void TestSurvivesRestart(fake_postgres *server) {
+  CHECK(Scan("A"));
+  CHECK(Scan("A"));
+  CHECK(Scan("A"));
+  CloseAuthCache();
+  CHECK(OpenAuthCache(journal_path.c_str(), TEST_JOURNAL_CAPACITY) == 0);
+  CHECK(auth_audit_journal.Head() - auth_audit_journal.Flushed() == 3);
+
+  server->ClearStatements();
+  unsigned long recorded = auth_audits_recorded;
+  audit_thread audit;
+  CHECK(WaitForRecorded(recorded + 3, chrono::milliseconds(2000)));
+  CHECK(CountCardScanned(server) == 3);
+}
+
+// Once the journal is full a cache hit waits on the database like a miss, and is denied
+// when it does not answer
+void TestJournalFull(fake_postgres *server) {
+  for (int i = 0; i < TEST_JOURNAL_CAPACITY; i++) {
+    CHECK(Scan("A"));
+  }
+  unsigned long unjournaled = auth_audits_unjournaled;
+  server->ClearStatements();
+  CHECK(Scan("A"));
+  CHECK(auth_audits_unjournaled == unjournaled + 1);
+  CHECK(CountCardScanned(server) == 1);
+
+  server_down = true;
+  CHECK(!Scan("A"));
+  CHECK(auth_audits_unjournaled == unjournaled + 2);
+  server_down = false;
+
+  unsigned long recorded = auth_audits_recorded;
+  audit_thread audit;
+  CHECK(WaitForRecorded(recorded + TEST_JOURNAL_CAPACITY, chrono::milliseconds(AUTH_BREAKER_PROBE_PERIOD + 2000)));
+}
+
+int main() {
+  fake_postgres server(AnswerCards);
+  setenv("PGPORT", to_string(server.Port()).c_str(), 1);
+  setenv("DATABASE_HOST", "127.0.0.1", 1);
+  setenv("DATABASE_NAME", "simsafe", 1);
+  setenv("DATABASE_USERNAME", "test", 1);
+  setenv("DATABASE_PASSWORD", "test", 1);
+  setenv("DATABASE_POOL_SIZE", to_string(TEST_POOL_SIZE).c_str(), 1);
+  setenv("CONTROLLER_SERIAL_NUMBER", "TEST", 1);
+  num_hardware_positions = 4;
+  CHECK(SetAuthDeadline(to_string(TEST_DEADLINE_MS).c_str()));
+  CHECK(SetAuthCacheTTL("60000"));
+
+  char path[] = "/tmp/auth_audit_test.XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  unlink(path);
+  journal_path = path;
+  CHECK(OpenAuthCache(journal_path.c_str(), TEST_JOURNAL_CAPACITY) == 0);
+
+  InitializeConnectionPools();
+  db_watchdog.Start();
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  for (auto &connector : StartStartupConnectors(shutdown_fd)) {
+    connector.join();
+  }
+  thread maintenance(RunPoolMaintenance, shutdown_fd);
+
+  TestRecordedAfterOutage(&server);
+  TestSurvivesRestart(&server);
+  TestJournalFull(&server);
+  PrintAuthCacheStats();
+
+  eventfd_write(shutdown_fd, 1);
+  maintenance.join();
+  db_watchdog.Stop();
+  CloseConnectionPool();
+  close(shutdown_fd);
+  CloseAuthCache();
+  unlink(journal_path.c_str());
+  return CheckResult("auth_audit_test");
+}
@@ -0,0 +1,160 @@
+#include "check.cpp"
+#include "fake_postgres.cpp"
+#include "../src/database.cpp"
+#include "../src/auth_batcher.cpp"
+
+#include <algorithm>
+
+// Scans that pile up behind a slow one go out as one batch. The test's cardScanned()
+// opens "1010" to every code, raises for "BAD" and takes a while for "SLOW"
+
+#define TEST_POOL_SIZE 4
+#define TEST_RIDERS 5
+#define TEST_SLOW_MS 300
+
+// Every batch and single cardScanned() call hangs up on the controller instead
+atomic<bool> hang_up_cards{false};
+
+fake_reply AnswerCards(const fake_statement &statement) {
+  fake_reply reply;
+  if (statement.query.find("unnest") != string::npos) {
+    const string &codes = statement.params.at(1).value();
+    if (hang_up_cards) {
+      reply.hang_up = true;
+    } else if (codes.find("BAD") != string::npos) {
+      reply.sqlstate = "P0001";
+      reply.message = "unknown card";
+    } else {
+      for (size_t i = 0; i < (size_t)count(codes.begin(), codes.end(), ',') + 1; i++) {
+        reply.rows.push_back({ "1010" });
+      }
+    }
+  } else if (statement.query.find("($1, $2)") != string::npos) {
+    const string &code = statement.params.at(1).value();
+    if (code == "SLOW") {
+      reply.delay = chrono::milliseconds(TEST_SLOW_MS);
+      reply.rows = { { "1010" } };
+    } else if (hang_up_cards) {
+      reply.hang_up = true;
+    } else if (code == "BAD") {
+      reply.sqlstate = "P0001";
+      reply.message = "unknown card";
+    } else {
+      reply.rows = { { "1010" } };
+    }
+  } else {
+    reply.rows = { { "1" } };
+  }
+  return reply;
+}
+
+// Pool maintenance the way main runs it, until shutdown_fd becomes readable
+void RunPoolMaintenance(int shutdown_fd) {
+  while (WaitForPoolMaintenance(shutdown_fd, chrono::milliseconds(50))) {
+    ProbeIdleConnections();
+    RepairBrokenConnections();
+  }
+}
+
+size_t CountStatements(fake_postgres *server, const char *part) {
+  size_t found = 0;
+  for (auto &statement : server->Statements()) {
+    if (statement.query.find(part) != string::npos) found++;
+  }
+  return found;
+}
+
+// Sends "SLOW" and, once it is in flight, one scan per code from their own threads, so
+// they go out together when it returns. Returns what each code got, "" for no answer
+vector<string> ScanBehindSlow(const vector<string> &codes) {
+  auto deadline = chrono::steady_clock::now() + chrono::seconds(2);
+  thread slow([&] {
+    position_word access;
+    CHECK(auth_batches.Fetch("SLOW", &access, deadline) != NULL);
+  });
+  this_thread::sleep_for(chrono::milliseconds(TEST_SLOW_MS / 3));
+
+  vector<string> answers(codes.size());
+  vector<thread> riders;
+  for (size_t i = 0; i < codes.size(); i++) {
+    riders.emplace_back([&, i] {
+      position_word access;
+      if (auth_batches.Fetch(codes[i], &access, deadline) == NULL) return;
+      for (size_t p = 0; p < num_hardware_positions; p++) {
+        answers[i] += access.Test(p) ? '1' : '0';
+      }
+    });
+  }
+  slow.join();
+  for (auto &rider : riders) {
+    rider.join();
+  }
+  return answers;
+}
+
+// A code the server raises for fails alone, everyone batched with it still gets access,
+// and the server raising is not held against it
+void TestBadCode(fake_postgres *server) {
+  server->ClearStatements();
+  unsigned long batches = auth_batches_sent, split = auth_batches_split;
+  vector<string> answers = ScanBehindSlow({ "A", "B", "BAD", "C", "D" });
+
+  CHECK((answers == vector<string>{ "1010", "1010", "", "1010", "1010" }));
+  CHECK(auth_batches_split == split + 1);
+  CHECK(auth_batches_sent == batches + 2);
+  CHECK(CountStatements(server, "unnest") == 1);
+  // SLOW and one resend per rider
+  CHECK(CountStatements(server, "($1, $2)") == 1 + TEST_RIDERS);
+  CHECK(auth_breaker_failures == 0 && !auth_breaker_open);
+}
+
+// A batch that loses its connection is one breaker sample, not one per rider. Resends
+// stop once the breaker opens
+void TestLostBatch(fake_postgres *server) {
+  server->ClearStatements();
+  hang_up_cards = true;
+  vector<string> answers = ScanBehindSlow({ "A", "B", "C", "D", "E" });
+  hang_up_cards = false;
+
+  CHECK(all_of(answers.begin(), answers.end(), [](const string &answer) { return answer.empty(); }));
+  CHECK(auth_breaker_open);
+  CHECK(auth_breaker_trips == 1);
+  CHECK(CountStatements(server, "unnest") == 1);
+  // The batch was the first failure, two resends made it three
+  CHECK(CountStatements(server, "($1, $2)") == 1 + AUTH_BREAKER_THRESHOLD - 1);
+
+  RecordDatabaseAnswer(true);
+  CHECK(!auth_breaker_open);
+}
+
+int main() {
+  fake_postgres server(AnswerCards);
+  setenv("PGPORT", to_string(server.Port()).c_str(), 1);
+  setenv("DATABASE_HOST", "127.0.0.1", 1);
+  setenv("DATABASE_NAME", "simsafe", 1);
+  setenv("DATABASE_USERNAME", "test", 1);
+  setenv("DATABASE_PASSWORD", "test", 1);
+  setenv("DATABASE_POOL_SIZE", to_string(TEST_POOL_SIZE).c_str(), 1);
+  setenv("CONTROLLER_SERIAL_NUMBER", "TEST", 1);
+  num_hardware_positions = 4;
+  auth_batch_max_wait = chrono::milliseconds(TEST_SLOW_MS * 2);
+
+  InitializeConnectionPools();
+  db_watchdog.Start();
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  for (auto &connector : StartStartupConnectors(shutdown_fd)) {
+    connector.join();
+  }
+  thread maintenance(RunPoolMaintenance, shutdown_fd);
+
+  TestBadCode(&server);
+  TestLostBatch(&server);
+  PrintAuthBatcherStats();
+
+  eventfd_write(shutdown_fd, 1);
+  maintenance.join();
+  db_watchdog.Stop();
+  CloseConnectionPool();
+  close(shutdown_fd);
+  return CheckResult("auth_batcher_test");
+}
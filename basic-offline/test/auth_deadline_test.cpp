@@ -0,0 +1,159 @@
+#include "check.cpp"
+#include "fake_postgres.cpp"
+#include "../src/database.cpp"
+#include "../src/gpio_actor.cpp"
+#include "../src/auth_cache.cpp"
+
+// Scans against a server that hangs, raises or answers nonsense: a scan never waits much
+// past AUTH_DEADLINE_MS, the watchdog cuts what the server does not answer, and only
+// those cuts trip the breaker
+
+#define TEST_POOL_SIZE 4
+#define TEST_DEADLINE_MS 300
+// Scheduling slack on top of the deadline and the watchdog's grace
+#define TEST_SLACK_MS 200
+
+typedef enum _test_server_mode {
+  SERVER_ANSWERS,
+  SERVER_HANGS,
+  SERVER_RAISES,
+  SERVER_ANSWERS_NULL
+} test_server_mode;
+
+atomic<test_server_mode> server_mode{SERVER_ANSWERS};
+
+fake_reply AnswerCards(const fake_statement &) {
+  fake_reply reply;
+  switch (server_mode.load()) {
+    case SERVER_ANSWERS:
+      reply.rows = { { "1010" } };
+      break;
+    case SERVER_HANGS:
+      reply.hang = true;
+      break;
+    case SERVER_RAISES:
+      reply.sqlstate = "P0001";
+      reply.message = "cardScanned failed";
+      break;
+    case SERVER_ANSWERS_NULL:
+      reply.rows = { { nullopt } };
+      break;
+  }
+  return reply;
+}
+
+// Pool maintenance the way main runs it, until shutdown_fd becomes readable
+void RunPoolMaintenance(int shutdown_fd) {
+  while (WaitForPoolMaintenance(shutdown_fd, chrono::milliseconds(50))) {
+    ProbeIdleConnections();
+    RepairBrokenConnections();
+  }
+}
+
+// AuthorizeScan's answer, and how long it took in elapsed
+bool Scan(const char *auth_code, position_word *access, chrono::milliseconds *elapsed) {
+  access->Clear();
+  auto scanned_at = chrono::steady_clock::now();
+  bool authorized = AuthorizeScan(auth_code, scanned_at, access);
+  *elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - scanned_at);
+  return authorized;
+}
+
+// Errors the server raises and answers it sends that cannot be read show it is up
+void TestServerUp(fake_postgres *server) {
+  position_word access;
+  chrono::milliseconds elapsed;
+
+  server_mode = SERVER_RAISES;
+  for (int i = 0; i < AUTH_BREAKER_THRESHOLD * 2; i++) {
+    CHECK(!Scan("A", &access, &elapsed));
+  }
+  CHECK(auth_breaker_failures == 0 && !auth_breaker_open);
+
+  // A null answer opens nothing, it is not an outage
+  server_mode = SERVER_ANSWERS_NULL;
+  unsigned long unreadable = access_unreadable;
+  access.Set(0);
+  CHECK(AuthorizeScan("A", chrono::steady_clock::now(), &access));
+  CHECK(!access.Any());
+  CHECK(access_unreadable == unreadable + 1);
+
+  server_mode = SERVER_ANSWERS;
+  CHECK(Scan("A", &access, &elapsed));
+  CHECK(access.Test(0) && access.Test(2) && access.Count() == 2);
+  CHECK(db_queries_cut == 0);
+}
+
+// A hung server has every scan cut at its deadline, three in a row open the breaker and
+// scans stop waiting on it until a probe gets an answer
+void TestServerHung(fake_postgres *server) {
+  position_word access;
+  chrono::milliseconds elapsed;
+
+  server_mode = SERVER_HANGS;
+  for (int i = 0; i < AUTH_BREAKER_THRESHOLD; i++) {
+    CHECK(!auth_breaker_open);
+    CHECK(!Scan("A", &access, &elapsed));
+    CHECK(elapsed >= chrono::milliseconds(TEST_DEADLINE_MS));
+    CHECK(elapsed < chrono::milliseconds(TEST_DEADLINE_MS + DB_DEADLINE_GRACE + TEST_SLACK_MS));
+    CHECK(db_queries_cut == (unsigned long)i + 1);
+  }
+  CHECK(auth_breaker_open);
+  CHECK(auth_breaker_trips == 1);
+
+  server->ClearStatements();
+  unsigned long skipped = auth_breaker_skipped;
+  CHECK(!Scan("A", &access, &elapsed));
+  CHECK(elapsed < chrono::milliseconds(TEST_SLACK_MS));
+  CHECK(auth_breaker_skipped == skipped + 1);
+  CHECK(server->Statements().empty());
+
+  // A probe the server does not answer either leaves it open
+  auth_breaker_next_probe = chrono::steady_clock::now();
+  ProbeAuthBreaker();
+  CHECK(auth_breaker_open);
+  CHECK(db_queries_cut == AUTH_BREAKER_THRESHOLD + 1);
+
+  server_mode = SERVER_ANSWERS;
+  // Not yet due
+  ProbeAuthBreaker();
+  CHECK(auth_breaker_open);
+  auth_breaker_next_probe = chrono::steady_clock::now();
+  ProbeAuthBreaker();
+  CHECK(!auth_breaker_open);
+  CHECK(Scan("A", &access, &elapsed));
+  CHECK(access.Count() == 2);
+}
+
+int main() {
+  fake_postgres server(AnswerCards);
+  setenv("PGPORT", to_string(server.Port()).c_str(), 1);
+  setenv("DATABASE_HOST", "127.0.0.1", 1);
+  setenv("DATABASE_NAME", "simsafe", 1);
+  setenv("DATABASE_USERNAME", "test", 1);
+  setenv("DATABASE_PASSWORD", "test", 1);
+  setenv("DATABASE_POOL_SIZE", to_string(TEST_POOL_SIZE).c_str(), 1);
+  setenv("CONTROLLER_SERIAL_NUMBER", "TEST", 1);
+  num_hardware_positions = 4;
+  CHECK(SetAuthDeadline(to_string(TEST_DEADLINE_MS).c_str()));
+  CHECK(SetAuthCacheTTL("0"));
+
+  InitializeConnectionPools();
+  db_watchdog.Start();
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  for (auto &connector : StartStartupConnectors(shutdown_fd)) {
+    connector.join();
+  }
+  thread maintenance(RunPoolMaintenance, shutdown_fd);
+
+  TestServerUp(&server);
+  TestServerHung(&server);
+  PrintAuthCacheStats();
+
+  eventfd_write(shutdown_fd, 1);
+  maintenance.join();
+  db_watchdog.Stop();
+  CloseConnectionPool();
+  close(shutdown_fd);
+  return CheckResult("auth_deadline_test");
+}
@@ -0,0 +1,25 @@
+#include <iostream>
+
+using namespace std;
+
+// Minimal assertions for the test programs under test/, each is its own binary run by
+// `make test`. A failed CHECK is reported and counted, the test keeps going
+int check_failures = 0;
+
+#define CHECK(condition)                                                                       \
+  do {                                                                                         \
+    if (!(condition)) {                                                                        \
+      cout << __FILE__ << ":" << __LINE__ << ": CHECK(" << #condition << ") failed" << endl;  \
+      check_failures++;                                                                        \
+    }                                                                                          \
+  } while (0)
+
+// Exit status for main
+int CheckResult(const char *test_name) {
+  if (check_failures > 0) {
+    cout << test_name << ": " << check_failures << " checks failed" << endl;
+    return 1;
+  }
+  cout << test_name << ": ok" << endl;
+  return 0;
+}
@@ -0,0 +1,136 @@
+#include "check.cpp"
+#include "fake_postgres.cpp"
+#include "../src/database.cpp"
+
+#define TEST_POOL_SIZE 4
+#define TEST_THREADS 16
+#define TEST_LEASES 300
+// Every this many leases the first thread kills the connection it holds
+#define TEST_CUT_EVERY 50
+
+// Pool maintenance the way main runs it, until shutdown_fd becomes readable
+void RunPoolMaintenance(int shutdown_fd) {
+  while (WaitForPoolMaintenance(shutdown_fd, chrono::milliseconds(50))) {
+    ProbeIdleConnections();
+    RepairBrokenConnections();
+  }
+}
+
+size_t FreeConnections() {
+  lock_guard<mutex> lock(_pool_mutex);
+  return _free_connections.size();
+}
+
+// What a server sends idle sessions unprompted keeps them in the pool, a server that
+// went away takes every one of them out
+void TestIdleProbe(fake_postgres *server) {
+  CHECK(FreeConnections() == TEST_POOL_SIZE);
+  unsigned long lost = db_connections_lost;
+
+  server->SendParameterStatus("application_name", "simsafe");
+  server->SendNotice("checkpoint starting");
+  this_thread::sleep_for(chrono::milliseconds(50));
+  ProbeIdleConnections();
+  CHECK(FreeConnections() == TEST_POOL_SIZE);
+  CHECK(db_connections_lost == lost);
+  for (int i = 0; i < TEST_POOL_SIZE; i++) {
+    db_lease lease = FetchConnection(chrono::milliseconds(100));
+    CHECK(lease && lease->conn->is_open());
+  }
+
+  server->DropConnections();
+  this_thread::sleep_for(chrono::milliseconds(50));
+  ProbeIdleConnections();
+  CHECK(FreeConnections() == 0);
+  CHECK(db_connections_lost == lost + TEST_POOL_SIZE);
+}
+
+int main() {
+  fake_postgres server([](const fake_statement &) {
+    fake_reply reply;
+    reply.rows = { { "1" } };
+    reply.delay = chrono::milliseconds(1);
+    return reply;
+  });
+  setenv("PGPORT", to_string(server.Port()).c_str(), 1);
+  setenv("DATABASE_HOST", "127.0.0.1", 1);
+  setenv("DATABASE_NAME", "simsafe", 1);
+  setenv("DATABASE_USERNAME", "test", 1);
+  setenv("DATABASE_PASSWORD", "test", 1);
+  setenv("DATABASE_POOL_SIZE", to_string(TEST_POOL_SIZE).c_str(), 1);
+  setenv("CONTROLLER_SERIAL_NUMBER", "TEST", 1);
+
+  InitializeConnectionPools();
+  db_watchdog.Start();
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  for (auto &connector : StartStartupConnectors(shutdown_fd)) {
+    connector.join();
+  }
+  CHECK(server.open_connections == DB_STARTUP_CONNECTIONS);
+  thread maintenance(RunPoolMaintenance, shutdown_fd);
+
+  // No slot is ever leased to two threads at once, even while connections die under
+  // their users and are repaired in the background
+  array<atomic<int>, TEST_POOL_SIZE> holders = {};
+  atomic<int> leased{0}, most_leased{0};
+  atomic<unsigned long> missed{0}, shared{0}, queries_failed{0}, cuts{0};
+  vector<thread> threads;
+  for (int t = 0; t < TEST_THREADS; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < TEST_LEASES; i++) {
+        db_lease lease = FetchConnection(chrono::milliseconds(5000));
+        if (!lease) {
+          missed++;
+          continue;
+        }
+        size_t slot = lease.operator->() - &_connections->at(0);
+        if (++holders.at(slot) != 1) shared++;
+        int now_leased = ++leased, most = most_leased;
+        while (now_leased > most && !most_leased.compare_exchange_weak(most, now_leased)) {}
+
+        try {
+          nontransaction tx{*lease->conn};
+          tx.exec("select 1");
+        } catch (exception const &e) {
+          queries_failed++;
+        }
+        if (t == 0 && i % TEST_CUT_EVERY == 0) {
+          lease->conn->close();
+          cuts++;
+        }
+
+        leased--;
+        holders.at(slot)--;
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  CHECK(missed == 0);
+  CHECK(shared == 0);
+  CHECK(queries_failed == 0);
+  CHECK(most_leased <= TEST_POOL_SIZE);
+  // Waiting callers grew the pool to its full size
+  CHECK(most_leased == TEST_POOL_SIZE);
+  CHECK(db_connections_lost == cuts);
+
+  // Every cut connection comes back and the whole pool ends up free
+  auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+  while ((FreeConnections() < TEST_POOL_SIZE || db_reconnects < cuts) && chrono::steady_clock::now() < deadline) {
+    this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  CHECK(FreeConnections() == TEST_POOL_SIZE);
+  CHECK(db_reconnects == cuts);
+  CHECK(server.open_connections == TEST_POOL_SIZE);
+  cout << "Leases: " << TEST_THREADS * TEST_LEASES << ", connections opened: " << server.connections << ", cut: " << cuts << endl;
+
+  eventfd_write(shutdown_fd, 1);
+  maintenance.join();
+  TestIdleProbe(&server);
+  db_watchdog.Stop();
+  CloseConnectionPool();
+  close(shutdown_fd);
+  return CheckResult("database_pool_test");
+}
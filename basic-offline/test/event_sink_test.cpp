@@ -0,0 +1,162 @@
+#include "check.cpp"
+#include "fake_postgres.cpp"
+#include "../src/database.cpp"
+#include "../src/gpio_actor.cpp"
+
+#include <stdlib.h>
+#include <sys/resource.h>
+
+// The event sink against the in-process Postgres, each run on a fresh connection and the
+// same journal
+
+#define TEST_SLOW_MS 300
+
+string journal_path;
+string sink_connection_string;
+
+// Position whose opened event the server rejects, 0 for none
+atomic<int> rejected_position{0};
+// Position whose closed event the server takes TEST_SLOW_MS over, 0 for none
+atomic<int> slow_position{0};
+
+fake_reply AnswerEvents(const fake_statement &statement) {
+  if (statement.params.size() > 1 && statement.params[1] == to_string(rejected_position) && statement.query.find("Opened") != string::npos) {
+    return fake_reply{ .sqlstate = "23503", .message = "unknown position" };
+  }
+  if (statement.params.size() > 1 && statement.params[1] == to_string(slow_position) && statement.query.find("Closed") != string::npos) {
+    return fake_reply{ .columns = 0, .delay = chrono::milliseconds(TEST_SLOW_MS) };
+  }
+  return fake_reply{ .columns = 0 };
+}
+
+// Position and "O"/"C" of every event call, in the order the server got them
+vector<string> CallOrder(const vector<fake_statement> &calls) {
+  vector<string> order;
+  for (auto &call : calls) {
+    order.push_back(*call.params.at(1) + (call.query.find("Opened") != string::npos ? "O" : "C"));
+  }
+  return order;
+}
+
+// Waits until acked reaches target, false when it does not within timeout
+bool WaitForAcked(unsigned long target, chrono::milliseconds timeout) {
+  auto deadline = chrono::steady_clock::now() + timeout;
+  while (events_acked < target) {
+    if (chrono::steady_clock::now() > deadline) return false;
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  return true;
+}
+
+// Queues count events, an opened and a closed per position, before a sink of its own
+// starts and waits for all of them to be acked or rejected. Returns the calls the
+// server got for them
+vector<fake_statement> RunSink(fake_postgres *server, int count) {
+  server->ClearStatements();
+  CHECK(OpenEventSink(sink_connection_string, "TEST", journal_path.c_str(), 1024) == 0);
+  unsigned long acked = events_acked, failed = events_failed;
+  for (int i = 0; i < count; i++) {
+    CHECK(QueuePositionEvent(i % 2 == 0 ? POSITION_EVENT_OPENED : POSITION_EVENT_CLOSED, i / 2 + 1, chrono::steady_clock::now()));
+  }
+
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  pthread_t thread;
+  pthread_create(&thread, NULL, EventSinkThreadTask, &shutdown_fd);
+  unsigned long rejected = rejected_position > 0 && rejected_position <= count / 2 ? 1 : 0;
+  CHECK(WaitForAcked(acked + count - rejected, chrono::milliseconds(2000)));
+  CHECK(events_failed == failed + rejected);
+
+  eventfd_write(shutdown_fd, 1);
+  pthread_join(thread, NULL);
+  close(shutdown_fd);
+  CloseEventSink();
+
+  vector<fake_statement> calls;
+  for (auto &statement : server->Statements()) {
+    if (statement.query.find("eventInsertPosition") != string::npos) calls.push_back(statement);
+  }
+  return calls;
+}
+
+// Procedures with happened_at get it, ones deployed before it was added are still called
+// with the two arguments they take
+void TestSignatures(fake_postgres *server) {
+  vector<fake_statement> calls = RunSink(server, 4);
+  CHECK(calls.size() == 4);
+  for (auto &call : calls) {
+    CHECK(call.params.size() == 3);
+    CHECK(call.params.size() == 3 && call.params[2]->ends_with("+00"));
+  }
+  CHECK(calls.size() == 4 && *calls[1].params[1] == "1" && calls[1].query.find("Closed") != string::npos);
+
+  server->RefusePrepare("$3");
+  calls = RunSink(server, 4);
+  CHECK(calls.size() == 4);
+  for (auto &call : calls) {
+    CHECK(call.params.size() == 2);
+    CHECK(call.query.find("$3") == string::npos);
+  }
+  CHECK(calls.size() == 4 && *calls[3].params[1] == "2" && calls[3].query.find("Closed") != string::npos);
+  server->RefusePrepare("");
+}
+
+// A rejected event rolls back its batch, and the rest of that batch is written again
+// before anything queued after it
+void TestFailedBatchOrder(fake_postgres *server) {
+  int count = EVENT_SINK_BATCH_SIZE * 2 + 10;
+  rejected_position = 6;
+  vector<string> order = CallOrder(RunSink(server, count));
+  rejected_position = 0;
+
+  vector<string> expected;
+  auto add = [&](int from, int to, bool skip_rejected) {
+    for (int i = from; i < to; i++) {
+      if (skip_rejected && i == 10) continue;
+      expected.push_back(to_string(i / 2 + 1) + (i % 2 == 0 ? "O" : "C"));
+    }
+  };
+  // Up to the rejected opened, the rest of its batch is aborted without reaching the server
+  add(0, 11, false);
+  add(0, EVENT_SINK_BATCH_SIZE, true);
+  add(EVENT_SINK_BATCH_SIZE, count, false);
+  CHECK(order == expected);
+}
+
+double ProcessCpuMs() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+         usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+// Waiting on a slow reply sleeps on the socket instead of spinning on libpq
+void TestSlowReply(fake_postgres *server) {
+  slow_position = 2;
+  double cpu_before = ProcessCpuMs();
+  auto started = chrono::steady_clock::now();
+  CHECK(RunSink(server, 8).size() == 8);
+  slow_position = 0;
+  double cpu = ProcessCpuMs() - cpu_before;
+  cout << "CPU while waiting " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count()
+       << "ms on a slow reply: " << cpu << "ms" << endl;
+  CHECK(cpu < TEST_SLOW_MS / 3);
+}
+
+int main() {
+  fake_postgres server(AnswerEvents);
+  sink_connection_string = "host=127.0.0.1 port=" + to_string(server.Port()) + " dbname=simsafe user=test password=test";
+  char path[] = "/tmp/event_sink_test.XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  unlink(path);
+  journal_path = path;
+
+  TestSignatures(&server);
+  TestFailedBatchOrder(&server);
+  TestSlowReply(&server);
+  PrintEventSinkStats();
+
+  unlink(journal_path.c_str());
+  return CheckResult("event_sink_test");
+}
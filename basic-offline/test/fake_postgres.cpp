@@ -0,0 +1,570 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <optional>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <set>
+#include <map>
+#include <chrono>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+using namespace std;
+
+// In-process stand-in for a PostgreSQL server, speaking just enough of protocol 3.0 for
+// libpq and libpqxx: trust authentication, simple queries, prepared statements and
+// pipelines. What every statement answers is up to the test's handler, so a test can
+// make the server slow, hang, fail or hang up without a real database.
+// Listens on 127.0.0.1, point PGPORT at Port() and connect to host=127.0.0.1
+
+#define FAKE_POSTGRES_PROTOCOL 196608
+#define FAKE_POSTGRES_SSL_REQUEST 80877103
+#define FAKE_POSTGRES_GSS_REQUEST 80877104
+#define FAKE_POSTGRES_TEXT_OID 25
+
+typedef optional<string> fake_value;
+
+typedef struct _fake_reply {
+  // Every row has the same number of columns, all of them text
+  vector<vector<fake_value>> rows;
+  // Columns of a select that returns no rows
+  size_t columns = 1;
+  // Set to answer with an error instead
+  string sqlstate;
+  string message;
+  // Before answering
+  chrono::milliseconds delay{0};
+  // Never answer, the connection is only closed when the client or the server goes away
+  bool hang = false;
+  // Close the connection instead of answering
+  bool hang_up = false;
+} fake_reply;
+
+// Statement text and parameters of one statement the server ran
+typedef struct _fake_statement {
+  string query;
+  vector<fake_value> params;
+} fake_statement;
+
+// Answers every statement, called on the connection's thread. Transaction control and
+// LISTEN never reach it
+typedef function<fake_reply(const fake_statement &statement)> fake_handler;
+
+class fake_postgres {
+ public:
+  explicit fake_postgres(fake_handler handler) : handler(handler) {
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(listen_fd, (struct sockaddr *)&address, length) != 0 || listen(listen_fd, 64) != 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&address, &length) != 0) {
+      cout << "Fake postgres could not listen: " << strerror(errno) << endl;
+      return;
+    }
+    port = ntohs(address.sin_port);
+    acceptor = thread(&fake_postgres::Accept, this);
+  }
+
+  ~fake_postgres() {
+    eventfd_write(stop_fd, 1);
+    DropConnections();
+    if (acceptor.joinable()) acceptor.join();
+    vector<thread> finished;
+    {
+      lock_guard<mutex> lock(state_mutex);
+      finished.swap(sessions);
+    }
+    for (auto &session : finished) {
+      session.join();
+    }
+    close(listen_fd);
+    close(stop_fd);
+  }
+
+  int Port() const {
+    return port;
+  }
+
+  void SetHandler(fake_handler new_handler) {
+    lock_guard<mutex> lock(state_mutex);
+    handler = new_handler;
+  }
+
+  // Sent unprompted to every connection sitting idle, the way a server reports a
+  // changed setting or a notice to sessions that are not running anything
+  void SendParameterStatus(const string &name, const string &value) {
+    SendToIdle(Message('S', name + '\0' + value + '\0'));
+  }
+
+  void SendNotice(const string &message) {
+    SendToIdle(Message('N', string("SNOTICE\0C00000\0M", 16) + message + '\0' + '\0'));
+  }
+
+  // Cuts every open connection, as a restarted server or a pulled cable would
+  void DropConnections() {
+    lock_guard<mutex> lock(state_mutex);
+    for (int fd : clients) {
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+
+  // Statements whose text contains part fail to prepare with undefined_function, the way
+  // a server refuses a call to a signature it does not have. Empty refuses nothing
+  void RefusePrepare(const string &part) {
+    lock_guard<mutex> lock(state_mutex);
+    refused = part;
+  }
+
+  // Statements the handler was asked about, in the order they arrived
+  vector<fake_statement> Statements() {
+    lock_guard<mutex> lock(state_mutex);
+    return statements;
+  }
+
+  void ClearStatements() {
+    lock_guard<mutex> lock(state_mutex);
+    statements.clear();
+  }
+
+  atomic<unsigned long> connections{0};
+  atomic<unsigned long> open_connections{0};
+
+ private:
+  typedef struct _prepared {
+    string query;
+    size_t columns;
+  } prepared;
+
+  static string Int32(uint32_t value) {
+    value = htonl(value);
+    return string((const char *)&value, 4);
+  }
+
+  static string Int16(uint16_t value) {
+    value = htons(value);
+    return string((const char *)&value, 2);
+  }
+
+  static uint32_t ReadInt32(const string &body, size_t *offset) {
+    uint32_t value = 0;
+    if (*offset + 4 <= body.size()) memcpy(&value, &body[*offset], 4);
+    *offset += 4;
+    return ntohl(value);
+  }
+
+  static uint16_t ReadInt16(const string &body, size_t *offset) {
+    uint16_t value = 0;
+    if (*offset + 2 <= body.size()) memcpy(&value, &body[*offset], 2);
+    *offset += 2;
+    return ntohs(value);
+  }
+
+  static string ReadString(const string &body, size_t *offset) {
+    size_t end = body.find('\0', *offset);
+    if (end == string::npos) end = body.size();
+    string value = body.substr(*offset, end - *offset);
+    *offset = end + 1;
+    return value;
+  }
+
+  static string Message(char type, const string &body) {
+    return string(1, type) + Int32(body.size() + 4) + body;
+  }
+
+  static bool SendAll(int fd, const string &data) {
+    for (size_t sent = 0; sent < data.size();) {
+      ssize_t written = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (written <= 0) return false;
+      sent += written;
+    }
+    return true;
+  }
+
+  // False once the client is gone or the server is stopping
+  bool ReadAll(int fd, char *buffer, size_t size) {
+    for (size_t got = 0; got < size;) {
+      struct pollfd fds[2] = { { fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+      if (poll(fds, 2, -1) < 0 && errno != EINTR) return false;
+      if (fds[1].revents & POLLIN) return false;
+      if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      ssize_t bytes = recv(fd, buffer + got, size - got, 0);
+      if (bytes <= 0) return false;
+      got += bytes;
+    }
+    return true;
+  }
+
+  static bool InputPending(int fd) {
+    int pending = 0;
+    return ioctl(fd, FIONREAD, &pending) == 0 && pending > 0;
+  }
+
+  bool ReadMessage(int fd, char *type, string *body) {
+    char header[5];
+    if (!ReadAll(fd, header, 5)) return false;
+    *type = header[0];
+    size_t offset = 1;
+    uint32_t length = ReadInt32(string(header, 5), &offset);
+    if (length < 4) return false;
+    body->resize(length - 4);
+    return body->empty() || ReadAll(fd, body->data(), body->size());
+  }
+
+  // Waits for the client to go away, discarding whatever it sends meanwhile
+  void Hang(int fd) {
+    char discard[4096];
+    while (true) {
+      struct pollfd fds[2] = { { fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+      if (poll(fds, 2, -1) < 0 && errno != EINTR) return;
+      if (fds[1].revents & POLLIN) return;
+      if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && recv(fd, discard, sizeof(discard), 0) <= 0) return;
+    }
+  }
+
+  static size_t CountParameters(const string &query) {
+    size_t count = 0;
+    for (size_t i = 0; i + 1 < query.size(); i++) {
+      if (query[i] == '$' && isdigit(query[i + 1])) {
+        count = max(count, (size_t)atoi(&query[i + 1]));
+      }
+    }
+    return count;
+  }
+
+  static bool StartsWith(const string &query, const char *word) {
+    return strncasecmp(query.c_str(), word, strlen(word)) == 0;
+  }
+
+  // Statements answered here rather than by the handler: transaction control, session
+  // settings and LISTEN
+  static bool IsSessionStatement(const string &query) {
+    for (const char *word : { "begin", "commit", "rollback", "end", "set ", "listen", "unlisten", "reset", "discard" }) {
+      if (StartsWith(query, word)) return true;
+    }
+    return query.empty();
+  }
+
+  static string RowDescription(size_t columns) {
+    string body = Int16(columns);
+    for (size_t i = 0; i < columns; i++) {
+      body += string("?column?\0", 9) + Int32(0) + Int16(0) + Int32(FAKE_POSTGRES_TEXT_OID) + Int16(0xffff) + Int32(0xffffffff) + Int16(0);
+    }
+    return Message('T', body);
+  }
+
+  static string DataRows(const fake_reply &reply) {
+    string out;
+    for (auto &row : reply.rows) {
+      string body = Int16(row.size());
+      for (auto &value : row) {
+        body += value ? Int32(value->size()) + *value : Int32(0xffffffff);
+      }
+      out += Message('D', body);
+    }
+    return out;
+  }
+
+  static string Error(const fake_reply &reply) {
+    return Message('E', string("SERROR\0C", 8) + reply.sqlstate + '\0' + 'M' + reply.message + '\0' + '\0');
+  }
+
+  static size_t Columns(const fake_reply &reply) {
+    return reply.rows.empty() ? reply.columns : reply.rows.front().size();
+  }
+
+  static string CommandTag(const string &query, const fake_reply &reply) {
+    if (StartsWith(query, "select") || !reply.rows.empty()) return "SELECT " + to_string(reply.rows.size());
+    size_t end = query.find_first_of(" ;");
+    string tag = query.substr(0, end);
+    for (char &c : tag) c = toupper(c);
+    return tag;
+  }
+
+  fake_reply Answer(const string &query, const vector<fake_value> &params) {
+    fake_handler current;
+    {
+      lock_guard<mutex> lock(state_mutex);
+      if (IsSessionStatement(query)) return fake_reply{ .columns = 0 };
+      statements.push_back({ query, params });
+      current = handler;
+    }
+    return current({ query, params });
+  }
+
+  bool IsRefused(const string &query) {
+    lock_guard<mutex> lock(state_mutex);
+    return !refused.empty() && query.find(refused) != string::npos;
+  }
+
+  void SendToIdle(const string &message) {
+    lock_guard<mutex> lock(state_mutex);
+    for (int fd : idle) {
+      SendAll(fd, message);
+    }
+  }
+
+  void SetIdle(int fd, bool is_idle) {
+    lock_guard<mutex> lock(state_mutex);
+    if (is_idle) {
+      idle.insert(fd);
+    } else {
+      idle.erase(fd);
+    }
+  }
+
+  void Accept() {
+    while (true) {
+      struct pollfd fds[2] = { { listen_fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+      if (poll(fds, 2, -1) < 0 && errno != EINTR) return;
+      if (fds[1].revents & POLLIN) return;
+      if (!(fds[0].revents & POLLIN)) continue;
+      int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0) continue;
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      lock_guard<mutex> lock(state_mutex);
+      clients.insert(fd);
+      sessions.emplace_back(&fake_postgres::Session, this, fd);
+    }
+  }
+
+  void Session(int fd) {
+    if (Startup(fd)) {
+      connections++;
+      open_connections++;
+      Serve(fd);
+      open_connections--;
+    }
+    lock_guard<mutex> lock(state_mutex);
+    idle.erase(fd);
+    clients.erase(fd);
+    close(fd);
+  }
+
+  bool Startup(int fd) {
+    while (true) {
+      char header[4];
+      if (!ReadAll(fd, header, 4)) return false;
+      size_t offset = 0;
+      uint32_t length = ReadInt32(string(header, 4), &offset);
+      if (length < 8 || length > 10000) return false;
+      string body(length - 4, '\0');
+      if (!ReadAll(fd, body.data(), body.size())) return false;
+      offset = 0;
+      uint32_t code = ReadInt32(body, &offset);
+      if (code == FAKE_POSTGRES_SSL_REQUEST || code == FAKE_POSTGRES_GSS_REQUEST) {
+        if (!SendAll(fd, "N")) return false;
+        continue;
+      }
+      if (code != FAKE_POSTGRES_PROTOCOL) return false;
+      break;
+    }
+
+    string greeting = Message('R', Int32(0));
+    for (auto &setting : vector<pair<string, string>>{ { "server_version", "17.0" }, { "server_encoding", "UTF8" },
+                                                       { "client_encoding", "UTF8" }, { "DateStyle", "ISO, MDY" },
+                                                       { "integer_datetimes", "on" }, { "standard_conforming_strings", "on" },
+                                                       { "TimeZone", "UTC" } }) {
+      greeting += Message('S', setting.first + '\0' + setting.second + '\0');
+    }
+    greeting += Message('K', Int32(getpid()) + Int32(fd));
+    return SendAll(fd, greeting);
+  }
+
+  // Runs the reply for one statement, false when the connection has to end
+  bool Execute(int fd, const fake_reply &reply, bool describe, string *out) {
+    if (reply.delay.count() > 0 || reply.hang || reply.hang_up) {
+      if (!SendAll(fd, *out)) return false;
+      out->clear();
+      if (reply.delay.count() > 0) {
+        struct pollfd stop_poll = { stop_fd, POLLIN, 0 };
+        if (poll(&stop_poll, 1, reply.delay.count()) > 0) return false;
+      }
+      if (reply.hang) {
+        Hang(fd);
+        return false;
+      }
+      if (reply.hang_up) return false;
+    }
+    if (!reply.sqlstate.empty()) {
+      *out += Error(reply);
+      return true;
+    }
+    if (describe && Columns(reply) > 0) {
+      *out += RowDescription(Columns(reply));
+    }
+    *out += DataRows(reply);
+    return true;
+  }
+
+  void Serve(int fd) {
+    map<string, prepared> statements_by_name;
+    // Bound portal, its reply is worked out at Bind when the parameters are known.
+    // A Describe of it is answered along with the Execute, so a slow reply is slow
+    // from its first byte
+    string portal_query;
+    fake_reply portal_reply;
+    bool portal_ready = false, portal_described = false;
+    char transaction = 'I';
+    // After an error in an extended query everything up to the next Sync is skipped
+    bool skipping = false;
+    string out = Message('Z', string(1, transaction));
+
+    while (true) {
+      // Like a real server, replies go out once everything the client sent is handled
+      if (!out.empty() && !InputPending(fd)) {
+        if (!SendAll(fd, out)) return;
+        out.clear();
+      }
+      SetIdle(fd, transaction == 'I');
+      char type;
+      string body;
+      if (!ReadMessage(fd, &type, &body)) return;
+      SetIdle(fd, false);
+      size_t offset = 0;
+
+      if (skipping && type != 'S' && type != 'X') continue;
+
+      switch (type) {
+        case 'Q': {
+          string query = ReadString(body, &offset);
+          fake_reply reply = Answer(query, {});
+          if (!Execute(fd, reply, true, &out)) return;
+          if (!reply.sqlstate.empty()) {
+            transaction = transaction == 'I' ? 'I' : 'E';
+          } else {
+            if (StartsWith(query, "begin")) transaction = 'T';
+            if (StartsWith(query, "commit") || StartsWith(query, "rollback") || StartsWith(query, "end")) transaction = 'I';
+            out += Message('C', CommandTag(query, reply) + '\0');
+          }
+          out += Message('Z', string(1, transaction));
+          break;
+        }
+        case 'P': {
+          string name = ReadString(body, &offset);
+          string query = ReadString(body, &offset);
+          if (IsRefused(query)) {
+            out += Error({ .sqlstate = "42883", .message = "function in \"" + query + "\" does not exist" });
+            skipping = true;
+            break;
+          }
+          statements_by_name[name] = { query, StartsWith(query, "select") ? (size_t)1 : 0 };
+          out += Message('1', "");
+          break;
+        }
+        case 'B': {
+          ReadString(body, &offset);
+          string name = ReadString(body, &offset);
+          uint16_t formats = ReadInt16(body, &offset);
+          offset += formats * 2;
+          uint16_t count = ReadInt16(body, &offset);
+          vector<fake_value> params;
+          for (uint16_t i = 0; i < count; i++) {
+            uint32_t length = ReadInt32(body, &offset);
+            if (length == 0xffffffff) {
+              params.push_back(nullopt);
+            } else {
+              params.push_back(body.substr(offset, length));
+              offset += length;
+            }
+          }
+          auto found = statements_by_name.find(name);
+          if (found == statements_by_name.end()) {
+            out += Error({ .sqlstate = "26000", .message = "prepared statement \"" + name + "\" does not exist" });
+            skipping = true;
+            break;
+          }
+          portal_query = found->second.query;
+          portal_reply = Answer(portal_query, params);
+          portal_ready = true;
+          portal_described = false;
+          out += Message('2', "");
+          break;
+        }
+        case 'D': {
+          offset = 1;
+          string name = ReadString(body, &offset);
+          if (body.empty() || body[0] != 'S') {
+            portal_described = true;
+            break;
+          }
+          auto found = statements_by_name.find(name);
+          if (found == statements_by_name.end()) {
+            out += Error({ .sqlstate = "26000", .message = "prepared statement \"" + name + "\" does not exist" });
+            skipping = true;
+            break;
+          }
+          size_t count = CountParameters(found->second.query);
+          string description = Int16(count);
+          for (size_t i = 0; i < count; i++) description += Int32(FAKE_POSTGRES_TEXT_OID);
+          out += Message('t', description);
+          out += found->second.columns > 0 ? RowDescription(found->second.columns) : Message('n', "");
+          break;
+        }
+        case 'E': {
+          if (!portal_ready) {
+            out += Error({ .sqlstate = "34000", .message = "portal does not exist" });
+            skipping = true;
+            break;
+          }
+          portal_ready = false;
+          if (portal_described && portal_reply.sqlstate.empty() && Columns(portal_reply) == 0) {
+            out += Message('n', "");
+          }
+          if (!Execute(fd, portal_reply, portal_described, &out)) return;
+          if (!portal_reply.sqlstate.empty()) {
+            skipping = true;
+            if (transaction == 'T') transaction = 'E';
+            break;
+          }
+          out += Message('C', CommandTag(portal_query, portal_reply) + '\0');
+          break;
+        }
+        case 'S':
+          skipping = false;
+          out += Message('Z', string(1, transaction));
+          break;
+        case 'H':
+          break;
+        case 'C':
+          out += Message('3', "");
+          break;
+        case 'X':
+          return;
+        default:
+          out += Error({ .sqlstate = "08P01", .message = string("unsupported message ") + type });
+          skipping = true;
+          break;
+      }
+    }
+  }
+
+  fake_handler handler;
+  int listen_fd = -1;
+  int stop_fd = -1;
+  int port = 0;
+  thread acceptor;
+  mutex state_mutex;
+  vector<thread> sessions;
+  set<int> clients;
+  // Connections waiting for a query outside a transaction
+  set<int> idle;
+  vector<fake_statement> statements;
+  string refused;
+};
@@ -0,0 +1,90 @@
+#include "check.cpp"
+#include "../src/frame_decoder.cpp"
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+// Feeds input to a decoder in chunks of at most max_chunk bytes (random when rng is set)
+// and returns every frame it hands out
+vector<string> DecodeInChunks(const string &input, size_t max_chunk, mt19937 *rng, frame_decoder *decoder) {
+  vector<string> frames;
+  string_view frame;
+  size_t position = 0;
+  while (position < input.size()) {
+    char *write_to = decoder->WritePointer();
+    size_t chunk = rng == NULL ? max_chunk : 1 + (*rng)() % max_chunk;
+    chunk = min({ chunk, decoder->WriteCapacity(), input.size() - position });
+    memcpy(write_to, input.data() + position, chunk);
+    decoder->Commit(chunk);
+    position += chunk;
+    while (decoder->NextFrame(&frame)) {
+      frames.emplace_back(frame);
+    }
+  }
+  return frames;
+}
+
+int main() {
+  // Delimiters
+  {
+    frame_decoder decoder;
+    auto frames = DecodeInChunks("abc\ndef\r\n\r\nghi\r\n\n\nj\nk", 64, NULL, &decoder);
+    CHECK((frames == vector<string>{ "abc", "def", "ghi", "j" }));
+    CHECK(decoder.Buffered() == 1);
+    CHECK(decoder.Overflows() == 0);
+  }
+
+  // A frame of exactly FRAME_MAX_LENGTH passes, with or without '\r', one byte more is dropped
+  {
+    string longest(FRAME_MAX_LENGTH, 'A');
+    frame_decoder decoder;
+    auto frames = DecodeInChunks(longest + "\n" + longest + "\r\n" + longest + "B\nok\n", 100, NULL, &decoder);
+    CHECK((frames == vector<string>{ longest, longest, "ok" }));
+    CHECK(decoder.Overflows() == 1);
+  }
+
+  // Line noise with no delimiter is discarded up to the next one, then decoding resyncs
+  {
+    frame_decoder decoder;
+    auto frames = DecodeInChunks(string(3 * FRAME_DECODER_CAPACITY, 'x') + "\nafter\n", 1, NULL, &decoder);
+    CHECK((frames == vector<string>{ "after" }));
+    CHECK(decoder.Overflows() >= 1);
+  }
+
+  // Property: any way the input is split into reads decodes to the same frames as
+  // splitting the whole buffer on '\n' does
+  mt19937 rng(1);
+  for (int iteration = 0; iteration < 20000; iteration++) {
+    string input;
+    vector<string> expected;
+    int frame_count = rng() % 20;
+    for (int f = 0; f < frame_count; f++) {
+      size_t length = rng() % 40;
+      if (rng() % 50 == 0) {
+        length = rng() % 2 ? 600 : FRAME_MAX_LENGTH - 2 + rng() % 5;
+      }
+      string code;
+      for (size_t i = 0; i < length; i++) {
+        code += 'A' + rng() % 26;
+      }
+      int delimiter = rng() % 3;
+      input += code + (delimiter == 0 ? "\n" : delimiter == 1 ? "\r\n" : "\r\n\r\n");
+      if (length > 0 && length <= FRAME_MAX_LENGTH) {
+        expected.push_back(code);
+      }
+    }
+
+    frame_decoder decoder;
+    auto frames = DecodeInChunks(input, 300, &rng, &decoder);
+    CHECK(frames == expected);
+    CHECK(decoder.Buffered() == 0);
+    if (frames != expected) {
+      cout << "iteration " << iteration << ": got " << frames.size() << " frames, expected " << expected.size() << endl;
+      break;
+    }
+  }
+
+  return CheckResult("frame_decoder_test");
+}
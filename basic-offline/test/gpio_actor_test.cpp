@@ -0,0 +1,138 @@
+#include "check.cpp"
+#include "../src/database.cpp"
+#include "../src/gpio_actor.cpp"
+
+#include <random>
+#include <thread>
+
+// Drives the GPIO thread from many threads at once against the simulated shift
+// registers, the same backend GPIO_DRIVER="simulated" runs the firmware on
+
+#define TEST_POSITIONS 64
+#define TEST_PRODUCERS 8
+#define TEST_COMMANDS 500
+// One exchange pass: 3 writes to load the sensors, 2 per position and 1 to drop RCLK
+#define EXCHANGE_BULK_WRITES (2 * TEST_POSITIONS + 4)
+
+position_word RandomWord(mt19937 *rng) {
+  position_word word;
+  for (HARDWARE_POSITIONS_TYPE i = 0; i < TEST_POSITIONS; i++) {
+    word.Set(i, (*rng)() % 8 == 0);
+  }
+  return word;
+}
+
+position_word LatchedWord() {
+  position_word word;
+  for (HARDWARE_POSITIONS_TYPE i = 0; i < TEST_POSITIONS; i++) {
+    word.Set(i, gpio_simulated_driver->IsLockEnergized(i));
+  }
+  return word;
+}
+
+// Every command from every thread completes, and the chain ends up holding the last word
+void TestConcurrentCommands() {
+  atomic<unsigned long> completed{0}, failed{0}, unlatched_relocks{0};
+  vector<thread> producers;
+  for (int p = 0; p < TEST_PRODUCERS; p++) {
+    producers.emplace_back([&, p] {
+      mt19937 rng(p);
+      for (int i = 0; i < TEST_COMMANDS; i++) {
+        gpio_command_type type = (gpio_command_type)(rng() % 3);
+        position_word word = RandomWord(&rng);
+        shared_ptr<gpio_completion> completion;
+        if (!RunGPIOCommand(type, type == GPIO_COMMAND_UNLOCK ? &word : NULL, chrono::milliseconds(2000), &completion)) {
+          failed++;
+          continue;
+        }
+        completed++;
+        if (type == GPIO_COMMAND_RELOCK && completion->stats.bulk_calls == 0) {
+          unlatched_relocks++;
+        }
+      }
+    });
+  }
+  for (auto &producer : producers) {
+    producer.join();
+  }
+
+  CHECK(failed == 0);
+  CHECK(completed == TEST_PRODUCERS * TEST_COMMANDS);
+  CHECK(unlatched_relocks == 0);
+
+  // Once the others are done, the chain holds exactly what was asked for last
+  CHECK(RunGPIOCommand(GPIO_COMMAND_RELOCK, NULL, chrono::milliseconds(1000), NULL));
+  CHECK(!LatchedWord().Any());
+  mt19937 rng(99);
+  position_word word = RandomWord(&rng);
+  word.Set(0);
+  shared_ptr<gpio_completion> completion;
+  CHECK(RunGPIOCommand(GPIO_COMMAND_UNLOCK, &word, chrono::milliseconds(1000), &completion));
+  CHECK(completion->stats.bulk_calls == EXCHANGE_BULK_WRITES);
+  CHECK(LatchedWord() == word);
+  // Reopening positions that are already open latches nothing
+  CHECK(RunGPIOCommand(GPIO_COMMAND_UNLOCK, &word, chrono::milliseconds(1000), &completion));
+  CHECK(completion->stats.bulk_calls == 0);
+  CHECK(RunGPIOCommand(GPIO_COMMAND_RELOCK, NULL, chrono::milliseconds(1000), NULL));
+  CHECK(!LatchedWord().Any());
+}
+
+// A full queue turns commands away instead of blocking, and everything that was
+// accepted is carried out once the thread gets to it
+void TestQueueFull(int shutdown_fd) {
+  vector<shared_ptr<gpio_completion>> accepted;
+  size_t rejected = 0;
+  position_word word;
+  for (int i = 0; i < GPIO_COMMAND_QUEUE_SIZE * 2; i++) {
+    word.Clear();
+    word.Set(i % TEST_POSITIONS);
+    auto completion = SubmitGPIOCommand(GPIO_COMMAND_UNLOCK, &word);
+    if (completion == NULL) {
+      rejected++;
+    } else {
+      accepted.push_back(completion);
+    }
+  }
+  CHECK(accepted.size() == GPIO_COMMAND_QUEUE_SIZE);
+  CHECK(rejected == GPIO_COMMAND_QUEUE_SIZE);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, GPIOActorThreadTask, &shutdown_fd);
+  for (auto &completion : accepted) {
+    CHECK(completion->done.try_acquire_for(chrono::milliseconds(1000)));
+    // Unlocks drained together go out as one word, every one of them gets its stats
+    CHECK(completion->stats.bulk_calls == EXCHANGE_BULK_WRITES);
+    CHECK(completion->stats.duration == accepted.front()->stats.duration);
+  }
+  CHECK(LatchedWord().Count() == TEST_POSITIONS);
+
+  CHECK(RunGPIOCommand(GPIO_COMMAND_RELOCK, NULL, chrono::milliseconds(1000), NULL));
+  eventfd_write(shutdown_fd, 1);
+  pthread_join(thread, NULL);
+  close(shutdown_fd);
+}
+
+int main() {
+  CHECK(OpenSimulatedGPIO(TEST_POSITIONS) == 0);
+  num_hardware_positions = TEST_POSITIONS;
+  ResetGPIO();
+  CHECK(OpenGPIOActor() == 0);
+
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  pthread_t thread;
+  pthread_create(&thread, NULL, GPIOActorThreadTask, &shutdown_fd);
+  TestConcurrentCommands();
+  eventfd_write(shutdown_fd, 1);
+  pthread_join(thread, NULL);
+  close(shutdown_fd);
+
+  TestQueueFull(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+
+  // Every bank write the actor made kept SER and DATA stable across their clock edges
+  CHECK(gpio_simulated_driver->setup_violations == 0);
+  cout << "Bank writes: " << gpio_simulated_driver->set_calls << ", reads: " << gpio_simulated_driver->get_calls << endl;
+
+  CloseGPIOActor();
+  CloseGPIO();
+  return CheckResult("gpio_actor_test");
+}
@@ -0,0 +1,221 @@
+#include "check.cpp"
+#include "../src/database.cpp"
+#include "../src/gpio_actor.cpp"
+#include "../src/auth_cache.cpp"
+#include "../src/scan_queue.cpp"
+#include "../src/serial_readers.cpp"
+
+#include <algorithm>
+#include <pty.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <thread>
+
+// Readers are pty pairs: the reader thread opens a symlink to the slave end, the test
+// writes card codes into the master end and reads what was queued off scan_queue
+
+string reader_directory;
+
+// Opens a pty and links path to its slave end, returns the master
+int PlugReader(const string &path) {
+  int master, slave;
+  if (openpty(&master, &slave, NULL, NULL, NULL) != 0) {
+    return -1;
+  }
+  string slave_path = ttyname(slave);
+  close(slave);
+  unlink(path.c_str());
+  if (symlink(slave_path.c_str(), path.c_str()) != 0) {
+    close(master);
+    return -1;
+  }
+  return master;
+}
+
+// Waits until the reader thread has opened the reader for the nth time
+bool WaitForConnects(size_t reader, unsigned long connects) {
+  auto deadline = chrono::steady_clock::now() + chrono::seconds(2);
+  while (__atomic_load_n(&serial_readers[reader]->connects, __ATOMIC_ACQUIRE) < connects) {
+    if (chrono::steady_clock::now() > deadline) return false;
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  return true;
+}
+
+// Next queued scan, false when none arrives within timeout
+bool WaitForScan(queued_scan *scan, chrono::milliseconds timeout) {
+  struct pollfd scan_poll = { scan_queue_event_fd, POLLIN, 0 };
+  auto deadline = chrono::steady_clock::now() + timeout;
+  while (!scan_queue.TryPop(scan)) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+    if (left.count() <= 0 || poll(&scan_poll, 1, left.count()) <= 0) return false;
+    eventfd_t count;
+    eventfd_read(scan_queue_event_fd, &count);
+  }
+  return true;
+}
+
+double ProcessCpuMs() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+         usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+// The reader thread blocks on epoll: a scan is queued as soon as its bytes arrive and an
+// idle thread burns no CPU
+void TestWakeup() {
+  int master = PlugReader(reader_directory + "/front");
+  CHECK(master >= 0);
+  CHECK(SetSerialReaders((reader_directory + "/front").c_str()));
+
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  pthread_t thread;
+  pthread_create(&thread, NULL, SerialReadersThreadTask, &shutdown_fd);
+  CHECK(WaitForConnects(0, 1));
+
+  latency_histogram wakeup;
+  queued_scan scan;
+  for (int i = 0; i < 20; i++) {
+    string code = "CARD" + to_string(i) + "\n";
+    auto written_at = chrono::steady_clock::now();
+    CHECK(write(master, code.data(), code.size()) == (ssize_t)code.size());
+    CHECK(WaitForScan(&scan, chrono::milliseconds(1000)));
+    CHECK(scan.auth_code == code.substr(0, code.size() - 1));
+    wakeup.Record(scan.scanned_at - written_at);
+    this_thread::sleep_for(chrono::milliseconds(5));
+  }
+  PrintHistogram("Write to scan queued", &wakeup);
+  // A sleep-polling reader would add up to its poll period to every scan
+  CHECK(wakeup.Percentile(99) < 20000);
+
+  double cpu_before = ProcessCpuMs();
+  this_thread::sleep_for(chrono::milliseconds(1000));
+  double idle_cpu = ProcessCpuMs() - cpu_before;
+  cout << "Idle CPU over 1s: " << idle_cpu << "ms" << endl;
+  CHECK(idle_cpu < 20);
+
+  // Shutdown wakes the thread straight away
+  auto stop_at = chrono::steady_clock::now();
+  eventfd_write(shutdown_fd, 1);
+  pthread_join(thread, NULL);
+  CHECK(chrono::steady_clock::now() - stop_at < chrono::milliseconds(100));
+
+  CloseSerialReaders();
+  close(shutdown_fd);
+  close(master);
+}
+
+// Several readers on one thread: frames that arrive interleaved in pieces come out whole
+// and tagged with their reader, and readers are picked up when plugged in or back in
+void TestReaders() {
+  int front = PlugReader(reader_directory + "/front");
+  int back = PlugReader(reader_directory + "/back");
+  CHECK(front >= 0 && back >= 0);
+  string side_path = reader_directory + "/side";
+  CHECK(SetSerialReaders(("front=" + reader_directory + "/front,back=" + reader_directory + "/back@115200,side=" + side_path).c_str()));
+
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  pthread_t thread;
+  pthread_create(&thread, NULL, SerialReadersThreadTask, &shutdown_fd);
+  CHECK(WaitForConnects(0, 1));
+  CHECK(WaitForConnects(1, 1));
+  CHECK(serial_readers[2]->connects == 0);
+
+  auto send = [](int master, const char *bytes) {
+    CHECK(write(master, bytes, strlen(bytes)) == (ssize_t)strlen(bytes));
+    this_thread::sleep_for(chrono::milliseconds(10));
+  };
+  auto received = [](size_t count) {
+    vector<pair<string, size_t>> scans;
+    queued_scan scan;
+    while (scans.size() < count && WaitForScan(&scan, chrono::milliseconds(1000))) {
+      scans.emplace_back(scan.auth_code, scan.reader);
+    }
+    sort(scans.begin(), scans.end());
+    return scans;
+  };
+
+  // Each write is its own read on the reader thread
+  send(front, "FRO");
+  send(back, "BA");
+  send(front, "NT1\r");
+  send(back, "CK1\r\nBACK2");
+  send(front, "\n");
+  send(back, "\r\n");
+  CHECK((received(3) == vector<pair<string, size_t>>{ { "BACK1", 1 }, { "BACK2", 1 }, { "FRONT1", 0 } }));
+
+  // Plugged in after startup
+  int side = PlugReader(side_path);
+  CHECK(side >= 0);
+  CHECK(WaitForConnects(2, 1));
+  send(side, "SIDE1\n");
+  CHECK((received(1) == vector<pair<string, size_t>>{ { "SIDE1", 2 } }));
+
+  // Unplugged halfway through a frame, the half is not joined to the first frame after
+  // it comes back
+  send(front, "HALF");
+  close(front);
+  auto deadline = chrono::steady_clock::now() + chrono::seconds(2);
+  while (__atomic_load_n(&serial_readers[0]->fd, __ATOMIC_ACQUIRE) >= 0 && chrono::steady_clock::now() < deadline) {
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  CHECK(serial_readers[0]->fd < 0);
+  send(back, "BACK3\n");
+  CHECK((received(1) == vector<pair<string, size_t>>{ { "BACK3", 1 } }));
+
+  front = PlugReader(reader_directory + "/front");
+  CHECK(front >= 0);
+  CHECK(WaitForConnects(0, 2));
+  send(front, "FRONT2\n");
+  CHECK((received(1) == vector<pair<string, size_t>>{ { "FRONT2", 0 } }));
+
+  queued_scan extra;
+  CHECK(!WaitForScan(&extra, chrono::milliseconds(50)));
+  CHECK(serial_readers[0]->frames == 2 && serial_readers[1]->frames == 3 && serial_readers[2]->frames == 1);
+
+  eventfd_write(shutdown_fd, 1);
+  pthread_join(thread, NULL);
+  CloseSerialReaders();
+  close(shutdown_fd);
+  close(front);
+  close(back);
+  close(side);
+}
+
+// A repeat within the window is dropped until the scan it repeats is forgotten, and
+// forgetting an older scan leaves a later one in place
+void TestDeduplicator() {
+  scan_dedup_window = chrono::milliseconds(2000);
+  scan_deduplicator deduplicator;
+  auto now = chrono::steady_clock::now();
+  CHECK(!deduplicator.IsRepeat("CARD", now));
+  CHECK(deduplicator.IsRepeat("CARD", now + chrono::milliseconds(1)));
+  CHECK(!deduplicator.IsRepeat("OTHER", now + chrono::milliseconds(1)));
+
+  deduplicator.Forget("CARD", now + chrono::milliseconds(1));
+  CHECK(deduplicator.IsRepeat("CARD", now + chrono::milliseconds(2)));
+  deduplicator.Forget("CARD", now);
+  CHECK(!deduplicator.IsRepeat("CARD", now + chrono::milliseconds(3)));
+
+  deduplicator.Forget("CARD", now);
+  CHECK(deduplicator.IsRepeat("CARD", now + chrono::milliseconds(4)));
+  CHECK(!deduplicator.IsRepeat("CARD", now + chrono::milliseconds(2003)));
+  scan_dedup_window = chrono::milliseconds(0);
+}
+
+int main() {
+  char directory[] = "/tmp/serial_readers_test.XXXXXX";
+  CHECK(mkdtemp(directory) != NULL);
+  reader_directory = directory;
+  CHECK(OpenScanQueue() == 0);
+  scan_dedup_window = chrono::milliseconds(0);
+
+  TestDeduplicator();
+  TestWakeup();
+  TestReaders();
+
+  CloseScanQueue();
+  system(("rm -rf " + reader_directory).c_str());
+  return CheckResult("serial_readers_test");
+}